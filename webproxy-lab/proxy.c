@@ -5,69 +5,783 @@
 #include <strings.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <dirent.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+// writev 한 번에 넘길 수 있는 조각 수의 상한(큰 캐시 엔트리는 조각이 이보다 많을 수 있어 나눠서 쓴다)
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE 1
+#define SPLICE_F_MORE 4
+#endif
+#define SPLICE_CHUNK (64 * 1024)
+// splice 플래그(_GNU_SOURCE 없이는 fcntl.h가 선언하지 않는다)와 한 번에 옮기는 크기(파이프 기본 용량 64KB)
 
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 #define MAX_HEADERS 100
 
+static size_t g_max_cache = MAX_CACHE_SIZE;
+static size_t g_max_object = MAX_OBJECT_SIZE;
+static bool g_count_meta = false;
+// 실제로 쓰는 캐시 전체 / 오브젝트 하나 한도(기본값은 위 권장값, -C/-O로 바꾼다)
+// 오브젝트는 고정 크기 세그먼트 여러 개에 나눠 담으므로 한도를 키워도 작은 응답이 큰 버퍼를 잡지 않는다.
+// g_count_meta: 캐시 용량에 엔트리 메타데이터(엔트리 구조체, 키, 세그먼트 배열)까지 셀지(-M)
+
+#define CACHE_DEFAULT_TTL 300
+static long g_default_ttl = CACHE_DEFAULT_TTL;
+// 원서버가 신선도(Cache-Control max-age/s-maxage, Expires)를 안 알려 준 응답을 캐시에 둘 기본 시간(초, -t로 바꾼다)
+// 0이면 신선도를 명시한 응답만 캐시한다.
+static long g_default_swr = 0;
+// 원서버가 stale-while-revalidate를 안 알려 준 엔트리에 쓸 기본 창(초, -w). 만료 후 이 시간 안이면 낡은 사본을 바로 주고 뒤에서 갱신한다.
+
+#define CACHE_FRESH 0
+#define CACHE_STALE_SWR 1
+#define CACHE_STALE 2
+// cache_lookup이 알려 주는 엔트리 상태: 신선 / 만료됐지만 stale-while-revalidate 창 안 / 만료(원서버 확인 필요)
+
+//클라이언트 연결 유지(keep-alive)
+#define CLIENT_IDLE_TIMEOUT 5
+#define CLIENT_MAX_REQUESTS 100
+// CLIENT_IDLE_TIMEOUT: 다음 요청을 이 초까지만 기다린다(pool 모드에서는 쉬는 연결도 워커 하나를 붙잡고 있으므로 짧게)
+// CLIENT_MAX_REQUESTS: 연결 하나로 처리할 최대 요청 수(넘으면 마지막 응답에 Connection: close를 붙이고 닫는다)
+
 //캐시
 #define KEYMAX (MAXLINE * 3)
 // 캐시의 키(문자열) 최대 길이. 보통 키는 "<host>:<port><path>"
 // MAXLINE 기준으로 넉넉히 3배 잡아 둔 거라 긴 URL도 안전
+// 요청을 처리하는 동안 스택에서 키를 만들 때만 이 크기를 쓰고, 엔트리에는 실제 길이만큼만 인터닝해서 둔다.
 
-typedef struct cache_obj{
-  char key[KEYMAX];
-  char *data;
+#define KEY_STRIPES 16
+#define KEY_INIT_BUCKETS 64
+// 인터닝 테이블을 락 단위로 나눈 수(키 해시로 고름)와 줄무늬 하나의 초기 버킷 수
+
+typedef struct cache_key{
+  struct cache_key *next;
+  uint64_t hash;
+  int refs;
+  uint32_t len;
+  char str[];
+} cache_key_t;
+// 인터닝된 캐시 키: 같은 문자열은 프로세스 안에 하나만 두고 참조 카운트로 공유한다.
+// hash/len: 문자열 옆에 둔 64비트 해시와 길이(비교할 때 해시 -> 길이 -> memcmp 순서라 다른 키는 문자열을 거의 안 읽는다)
+// refs: 이 키를 쓰는 캐시 엔트리/진행 중인 미스 수(줄무늬 락 안에서만 바꾼다), str: 널 종료 문자열(len바이트 + '\0')
+
+typedef struct {
+  pthread_mutex_t lock;
+  cache_key_t **buckets;
+  size_t nbuckets, count;
+  size_t bytes;
+} key_stripe_t;
+// 인터닝 테이블 줄무늬 하나(체이닝 해시, 키 수가 버킷 수를 넘으면 두 배로)
+// bytes: 이 줄무늬에 있는 키들의 메모리 합(SIGUSR1 통계)
+
+static key_stripe_t g_keys[KEY_STRIPES];
+
+#define CACHE_INIT_BUCKETS 256
+// 해시 인덱스의 초기 버킷 수(2의 거듭제곱이어야 mask 연산으로 버킷을 고를 수 있음)
+// 엔트리 수가 버킷 수를 넘으면(load factor > 1) 두 배로 늘려서 체인 길이를 O(1)로 유지
+
+//크기 클래스 슬랩
+#define CACHE_SEG_SIZE (16 * 1024)
+// 캐시 본문과 채우는 중인 응답을 담는 고정 크기 세그먼트(16KB)
+#define SLAB_MIN_SHIFT 6
+#define SLAB_CLASSES 10
+#define SLAB_MAX_SIZE ((size_t)1 << (SLAB_MIN_SHIFT + SLAB_CLASSES - 1))
+#define SLAB_CHUNK_OBJS 64
+// 크기 클래스: 64B, 128B, ... 32KB(2의 거듭제곱 10개). 이보다 큰 요청은 그냥 Malloc으로 간다.
+// 클래스마다 한 번에 64칸씩 잘라 둔다(64B 클래스는 4KB, 16KB 세그먼트 클래스는 1MB 덩어리)
+
+typedef struct {
   size_t size;
+  pthread_mutex_t lock;
+  void *free;
+  size_t nobjs, nfree;
+  size_t req_bytes;
+  unsigned long allocs;
+} slab_class_t;
+// 크기 클래스 하나
+// free: 빈 칸 리스트(칸의 첫 바이트에 다음 포인터를 둔다). 해제된 칸은 OS에 돌려주지 않고 같은 크기 요청에 재사용한다.
+// nobjs/nfree: 지금까지 잘라 낸 칸 수 / 그중 놀고 있는 수
+// req_bytes: 쓰이고 있는 칸들에 실제로 요청된 바이트 합(칸 크기 합과 비교하면 클래스 내부 낭비율이 나온다)
+// allocs: 누적 할당 횟수
+
+typedef struct {
+  slab_class_t classes[SLAB_CLASSES];
+  atomic_ulong large_allocs;
+} slab_t;
+// 캐시 엔트리/헤더 블록/본문 세그먼트처럼 오래 사는 캐시 페이로드용 할당기
+// 오브젝트마다 크기에 딱 맞는 malloc/free를 반복하지 않으므로 크고 작은 응답이 섞여도 힙이 조각나지 않고,
+// 락이 클래스마다 따로라 서로 다른 크기를 할당하는 스레드끼리는 malloc의 아레나 락을 두고 다투지 않는다.
+// large_allocs: SLAB_MAX_SIZE보다 커서 Malloc으로 넘긴 횟수
+
+static slab_t g_slab;
+
+//요청 단위 아레나
+#define ARENA_BLOCK_SIZE (16 * 1024)
+// 연결마다 두는 아레나의 기본 블록 크기(보통 요청 하나에 필요한 임시 버퍼가 다 들어간다)
+
+typedef struct arena_block{
+  struct arena_block *next;
+  size_t cap, used;
+  char data[];
+} arena_block_t;
+
+typedef struct {
+  arena_block_t *head;
+} arena_t;
+// 요청 하나 동안만 쓰는 버퍼(원서버로 보낼 요청, 캐시 히트의 iovec 배열 등)를 밀어 쓰기(bump)로 내주는 할당기
+// 하나씩 해제하지 않고 요청이 끝나면 arena_reset으로 한꺼번에 비운다.
+// 첫 블록은 연결이 끝날 때까지 남겨 두므로 keep-alive 연결의 다음 요청은 malloc 없이 같은 메모리를 다시 쓴다.
+// 블록이 모자라면 더 큰 블록을 앞에 붙이고(head), reset 때 첫 블록만 남기고 해제한다.
+
+typedef struct {
+  atomic_ulong resets, overflow_blocks;
+  atomic_size_t peak;
+} arena_stats_t;
+// 아레나 통계: 비운 횟수(= 처리한 요청 수) / 기본 블록이 모자라 더 붙인 블록 수 / 요청 하나가 쓴 최대 바이트
+
+static arena_stats_t g_arena_stats;
+
+typedef struct {
+  char **segs;
+  int n, cap;
+  size_t len;
+} seglist_t;
+// 세그먼트에 이어 붙이는 버퍼(이벤트 루프 모드의 캐시용 사본). segs 배열만 늘리고 이미 쓴 바이트는 옮기지 않는다.
+
+typedef struct cache_obj{
+  uint64_t hash;
+  cache_key_t *key;
+  struct cache_obj *hnext;
+  atomic_int refcnt;
+  atomic_uchar referenced;
+  atomic_uchar refreshing;
   struct cache_obj *prev, *next;
+  uint32_t size;
+  uint32_t charge;
+  time_t expires;
+  char *hdr;
+  size_t hdr_len;
+  char **segs;
+  size_t body_len;
+  int nsegs;
+  uint32_t swr;
 } cache_obj_t;
 // 캐시 엔트리(한 개 웹 오브젝트)
-// key: 요청 식별자(예: localhost: 15213/home.html) 비교해서 같은 요청인지 판별
-// data: 응답 전체 바이트(상태라인 + 헤더 + 바디)
-// size: data의 바이트 수(스펙상 캐시 용량 계산에는 오브젝트 바이트만 카운트해야 하므로 이값들만 합산)
+// 조회/축출이 건드리는 필드(hash, key, 체인/리스트 링크, 참조, 크기)를 앞쪽 64바이트(캐시 라인 하나)에 모았다.
+  // 버킷 체인을 따라가거나 LRU 꼬리를 훑을 때 엔트리마다 캐시 라인 하나만 읽는다. 헤더/본문 포인터는 히트로 보낼 때만 읽는다.
+// key: 인터닝된 요청 식별자(예: localhost:15213/home.html) 비교해서 같은 요청인지 판별
+// hash: key의 64비트 해시(FNV-1a). 요청마다 한 번만 계산해서 버킷 선택과 문자열 비교 전 빠른 비교에 쓴다(key를 따라가지 않고 바로)
+// hdr/hdr_len: 상태라인 + 헤더(빈 줄 앞까지). Connection 헤더가 없고 항상 Content-Length가 있어서
+  // 보낼 때 헤더 뒤에 클라이언트 연결에 맞는 Connection 헤더만 끼워 넣으면 된다(데이터 자체는 복사하지 않음)
+// segs/nsegs/body_len: 본문을 담은 슬랩 세그먼트들(마지막 세그먼트만 덜 찰 수 있다)
+// size: 헤더 + 빈 줄 + 본문 바이트 수
+// charge: 샤드 용량 계산에 쓰는 바이트. 기본은 size(스펙상 오브젝트 바이트만 카운트), -M이면 엔트리/키/세그먼트 배열 같은 메타데이터도 더한다.
+  // 오브젝트 한도가 FILL_MAX_SIZE(16MB) 이하라 32비트로 충분하다(엔트리 앞쪽 캐시 라인에 expires까지 넣으려고 줄였다).
+// expires: 신선도가 끝나는 시각(단조 시계 upstream_now 기준, 초). 이 시각이 지나면 원서버에 조건부 요청으로 확인한다.
+// swr: 만료 뒤에도 낡은 사본을 바로 보내고 뒤에서 갱신해도 되는 시간(stale-while-revalidate, 초)
+  // expires/swr만은 삽입 후에도 바뀐다(304로 갱신). 샤드 쓰기 락 아래에서 고치고 조회가 읽기 락 아래에서 읽는다.
+// refreshing: 뒤에서 갱신하는 스레드가 이미 떠 있으면 1(엔트리당 하나만 띄운다)
+// refcnt: 참조 카운트. 캐시에 연결돼 있는 동안 캐시가 1개, 히트로 데이터를 쓰고 있는 스레드가 각자 1개씩 가진다.
+  // 삽입 후 key/hdr/segs/size는 절대 바뀌지 않으므로(immutable) 락 없이 읽어도 된다.
+  // 축출/교체는 캐시의 참조만 내려놓고, 마지막 참조가 풀릴 때(cache_release) 메모리를 해제한다.
+// referenced: CLOCK 정책의 참조 비트. 히트가 읽기 락만 잡은 채 원자적으로 1로 세우고, 축출할 때 검사/해제한다.
 // prev/next: LRU(Double-linked list) 연결용 포인터.
   //head = 가장 최근에 사용(MRU)
   //tail = 가장 오래된(LRU, 축출 후보)
+// hnext: 해시 버킷 체인(같은 버킷에 걸린 다음 엔트리)
+
+_Static_assert(offsetof(cache_obj_t, hdr) <= 64, "cache_obj_t hot fields must fit in one cache line");
+
+#define CACHE_SHARDS 8
+// 캐시를 키 해시로 나눈 샤드 수. 샤드마다 락/LRU 리스트/해시 테이블/용량 한도가 따로 있다.
+// 샤드 한 개의 용량(MAX_CACHE_SIZE / CACHE_SHARDS)이 MAX_OBJECT_SIZE보다 작아지면
+// 최대 크기 오브젝트를 담을 수 없으므로 그보다 많이 쪼개지 않는다(-C/-O로 바꾼 한도는 main에서 같은 조건을 검사).
+_Static_assert(MAX_CACHE_SIZE / CACHE_SHARDS >= MAX_OBJECT_SIZE, "cache shard smaller than MAX_OBJECT_SIZE");
 
 typedef struct {
   cache_obj_t *head, *tail; // 캐시 객체들을 잇는 양방향 연결 리스트의 머리/꼬리
-  size_t total; // 현재 캐시에 들어 있는 데이터 총 크기
-  pthread_rwlock_t rwlock; // 캐시 접근 동기화용 Read/Write 락(rwlock으로 여러 스레드가 동시에 캐시에 접글할때 충돌 방지)
-} cache_t;
-// 전역 캐시 컨테이너
-// head/tail: LRU 리스트의 양 끝
-// total: 현재 캐시에 담긴 오브젝트 바이트 총합
+  cache_obj_t **buckets; // key 해시로 찾는 체이닝 해시 테이블(LRU 리스트와 같은 노드를 공유)
+  size_t nbuckets; // 버킷 수(항상 2의 거듭제곱)
+  size_t count; // 현재 샤드에 들어 있는 엔트리 수
+  size_t total; // 현재 샤드에 들어 있는 데이터 총 크기
+  size_t budget; // 이 샤드가 쓸 수 있는 최대 바이트(모든 샤드의 budget 합 = g_max_cache)
+  atomic_uchar *sketch; // 빈도 추정용 count-min sketch(빈도를 쓰는 정책에서만 할당, 아니면 NULL)
+  atomic_uint sketch_adds; // sketch에 기록한 횟수. SKETCH_SAMPLE에 닿으면 모든 카운터를 절반으로 줄인다(aging)
+  pthread_rwlock_t rwlock; // 샤드 접근 동기화용 Read/Write 락(rwlock으로 여러 스레드가 동시에 캐시에 접글할때 충돌 방지)
+} cache_shard_t;
+// 캐시 샤드 하나
+// head/tail: 이 샤드의 LRU 리스트 양 끝(LRU 순서는 샤드 안에서만 유지된다)
+// buckets/nbuckets/count: 해시 인덱스. 조회/삽입/축출 모두 리스트를 훑지 않고 O(1)
+// total/budget: 현재 바이트 합과 한도. 축출은 샤드 단위로 budget을 넘지 않게 한다.
+// sketch/sketch_adds: TinyLFU 정책이 조회마다 키 빈도를 기록하는 곳. 읽기 락만 잡고도 기록하도록 카운터는 원자 변수
 // rwlock: 읽기-쓰기 락
   // 여러 스레드가 동시에 읽기(lookup) 가능 -> 성능 ok
   // 쓰기(삽입/축출)는 1개 스레드만 -> 일관성 보장
+  // 락이 샤드마다 따로라서 다른 샤드의 키를 다루는 스레드끼리는 서로 막지 않는다.
+
+typedef struct {
+  cache_shard_t shards[CACHE_SHARDS];
+} cache_t;
+// 전역 캐시 컨테이너: 키 해시의 상위 비트로 샤드를 고른다(하위 비트는 샤드 안의 버킷 선택에 쓰임)
 
 static cache_t g_cache;
 
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 4096
+#define SKETCH_MAX 15
+#define SKETCH_SAMPLE (SKETCH_WIDTH * 10)
+// count-min sketch 크기: 샤드마다 4행 x 4096칸의 카운터(4비트 카운터처럼 15에서 포화)
+// SKETCH_SAMPLE번 기록할 때마다 전체를 절반으로 줄여서 예전에 뜨거웠던 키가 영원히 남지 않게 한다.
+
+typedef struct {
+  bool no_store, no_cache, priv, must_revalidate;
+  long max_age, s_maxage, swr;
+} cache_control_t;
+// 응답의 Cache-Control 지시자 중 캐시 저장/신선도에 쓰는 것들(max_age/s_maxage/swr은 없으면 -1)
+// must_revalidate: must-revalidate/proxy-revalidate(만료 뒤에는 원서버 확인 없이 낡은 사본을 보내면 안 된다)
+
+typedef struct cache_policy{
+  const char *name;
+  void (*init_shard)(cache_shard_t *s);
+  void (*record)(cache_shard_t *s, uint64_t hash);
+  void (*hit_shared)(cache_shard_t *s, cache_obj_t *o);
+  void (*hit_exclusive)(cache_shard_t *s, cache_obj_t *o);
+  cache_obj_t* (*victim)(cache_shard_t *s);
+  bool (*admit)(cache_shard_t *s, uint64_t hash, cache_obj_t *victim);
+  atomic_ulong lookups, hits, hit_bytes, inserts, rejects, evictions, expired, revalidated, swr_served;
+} cache_policy_t;
+// 축출/승인(eviction/admission) 정책 인터페이스. 캐시 본체(cache_lookup/cache_insert)는 아래 훅만 부른다.
+// init_shard: 샤드 초기화 때 정책 전용 상태를 준비(NULL이면 없음)
+// record: 히트/미스 상관없이 조회마다 불림(읽기 락). 빈도 기록용
+// hit_shared: 히트 때 읽기 락을 잡은 채 불림. 원자 연산만 써야 한다(CLOCK 참조 비트 등)
+// hit_exclusive: 히트 때 쓰기 락을 다시 잡고 불림. NULL이면 히트 경로에서 쓰기 락을 아예 잡지 않는다.
+// victim: 쓰기 락 안에서 다음 축출 후보를 고른다(리스트에서 떼지는 않음)
+// admit: 새 엔트리를 넣으려면 victim을 내보내야 할 때, 넣을지 말지 결정(NULL이면 항상 승인)
+// lookups ~ swr_served: 정책별 통계(expired: 엔트리는 있었지만 신선도가 지난 조회, revalidated: 원서버가 304로 확인해 준 갱신,
+  // swr_served: 갱신을 기다리지 않고 낡은 사본을 바로 보낸 조회) 같은 요청 기록을 재생해 정책끼리 히트율을 비교할 때 쓴다(SIGUSR1로 출력)
+
+static void policy_lru_hit(cache_shard_t *s, cache_obj_t *o);
+static cache_obj_t* policy_lru_victim(cache_shard_t *s);
+static void policy_clock_hit(cache_shard_t *s, cache_obj_t *o);
+static cache_obj_t* policy_clock_victim(cache_shard_t *s);
+static void sketch_init(cache_shard_t *s);
+static void sketch_record(cache_shard_t *s, uint64_t hash);
+static unsigned sketch_estimate(cache_shard_t *s, uint64_t hash);
+static bool policy_tinylfu_admit(cache_shard_t *s, uint64_t hash, cache_obj_t *victim);
+
+static cache_policy_t g_policies[] = {
+  { .name = "lru", .hit_exclusive = policy_lru_hit, .victim = policy_lru_victim },
+  { .name = "clock", .hit_shared = policy_clock_hit, .victim = policy_clock_victim },
+  { .name = "tinylfu", .init_shard = sketch_init, .record = sketch_record,
+    .hit_shared = policy_clock_hit, .victim = policy_clock_victim, .admit = policy_tinylfu_admit },
+};
+static cache_policy_t *g_policy = &g_policies[0];
+// 사용할 정책. 명령행 -c 옵션으로 고른다(기본값은 기존과 같은 엄격한 LRU).
+  // lru: 히트마다 쓰기 락을 잡고 엔트리를 리스트 맨 앞으로 옮긴다(정확한 LRU 순서).
+  // clock: 히트는 참조 비트만 세우고(읽기 락만), 리스트 정리는 축출할 때 몰아서 한다(근사 LRU, second chance).
+  // tinylfu: clock으로 축출 후보를 고르되, 새 오브젝트의 추정 빈도가 후보보다 높을 때만 받아들인다.
+    // 크롤러처럼 한 번씩만 보이는 URL을 쓸어 담아도 자주 쓰이는 오브젝트가 밀려나지 않는다(scan resistant).
+
+//디스크 계층(-D)
+#define DISK_REC_MAGIC 0x31434552u
+#define DISK_IDX_MAGIC 0x32584449u
+#define DISK_DEFAULT_SIZE (256UL << 20)
+#define DISK_SEG_MIN (1UL << 20)
+#define DISK_SEG_MAX (64UL << 20)
+#define DISK_MAX_SEGS 4096
+#define DISK_IDX_HDR 64
+#define DISK_QUEUE_MAX 256
+// DISK_REC_MAGIC/DISK_IDX_MAGIC: 레코드/인덱스 파일 앞의 표식("REC1"/"IDX2", 형식을 바꾸면 숫자를 올린다)
+// IDX2: 지운 칸(tombstone)을 쓰지 않는다. IDX1 인덱스에 쌓여 있던 지운 칸은 재구성으로 털어 낸다.
+// DISK_DEFAULT_SIZE: 디스크 계층 기본 용량(-S로 바꾼다)
+// DISK_SEG_MIN/MAX: 세그먼트 파일 하나의 크기 범위(용량의 1/8로 잡는다). 용량을 넘으면 가장 오래된 세그먼트 파일을 통째로 지운다.
+// DISK_MAX_SEGS: 동시에 열어 두는 세그먼트 파일 수 상한(파일 디스크립터 링 크기)
+// DISK_IDX_HDR: 인덱스 파일에서 슬롯 배열 앞의 헤더 자리
+// DISK_QUEUE_MAX: 디스크에 쓰려고 기다리는 엔트리 수 상한(넘으면 그 엔트리는 디스크에 쓰지 않는다)
+
+typedef struct {
+  uint32_t magic;
+  uint32_t key_len;
+  uint32_t hdr_len;
+  uint32_t body_len;
+  uint64_t hash;
+  int64_t expires;
+  uint32_t swr;
+  uint32_t pad;
+} disk_rec_t;
+// 세그먼트 파일 안의 레코드 머리. 바로 뒤에 키, 헤더 블록(cache_obj_t.hdr), 본문이 이어진다.
+// expires는 벽시계(time) 기준이다(단조 시계는 재시작하면 기준이 바뀌므로)
+
+typedef struct {
+  uint64_t hash;
+  uint64_t off;
+  int64_t expires;
+  uint32_t seg;
+  uint32_t len;
+  uint32_t swr;
+  uint32_t state;
+} disk_slot_t;
+// 인덱스 슬롯 하나(키 해시 -> 세그먼트 번호/오프셋/레코드 길이). state: 0 빈 칸, 1 사용
+// 키 문자열은 레코드에만 있다. 해시가 같은 다른 키인지는 읽을 때 레코드의 키와 비교해서 거른다.
+
+typedef struct {
+  uint32_t magic;
+  uint32_t nslots;
+  uint32_t head, tail;
+} disk_index_hdr_t;
+// 인덱스 파일 헤더: 슬롯 수와 살아 있는 세그먼트 범위[head, tail]. 범위가 디렉터리의 파일과 맞아야 인덱스를 그대로 믿는다.
+
+typedef struct {
+  uint64_t *hash;
+  uint32_t n, cap;
+} disk_seg_keys_t;
+// 세그먼트 하나에 기록된 키 해시들(메모리에만 둔다). 세그먼트를 버릴 때 인덱스 전체 대신 이것만 훑는다.
+
+typedef struct disk_job {
+  struct cache_obj *o;
+  struct disk_job *next;
+} disk_job_t;
+// 디스크 쓰기 대기열의 항목 하나(엔트리 참조 하나를 쥐고 있다)
+
+typedef struct {
+  bool enabled;
+  char dir[MAXLINE];
+  pthread_rwlock_t lock;
+  pthread_mutex_t qlock;
+  pthread_cond_t qcond;
+  disk_job_t *qhead, *qtail;
+  int qlen;
+  disk_index_hdr_t *hdr;
+  disk_slot_t *slots;
+  size_t map_len;
+  int fds[DISK_MAX_SEGS];
+  uint64_t seg_bytes[DISK_MAX_SEGS];
+  disk_seg_keys_t seg_keys[DISK_MAX_SEGS];
+  uint64_t seg_max;
+  uint64_t bytes;
+  uint32_t objects;
+  atomic_ulong hits, misses, stores, dropped, skipped;
+} disk_t;
+// 디스크 계층 전체 상태
+// lock: 인덱스와 세그먼트 목록을 지킨다. 조회/읽기는 읽기 락, 덧붙이기/세그먼트 삭제는 쓰기 락
+// qlock/qcond/qhead/qtail/qlen: 디스크 쓰기 대기열(요청 스레드가 넣고 disk_writer 스레드 하나가 꺼내 쓴다)
+// hdr/slots/map_len: mmap한 인덱스 파일(MAP_SHARED라 고친 슬롯은 커널이 파일에 반영 -> 프로세스가 죽어도 남는다)
+// fds/seg_bytes: 세그먼트 번호 % DISK_MAX_SEGS 자리에 파일 디스크립터와 크기. 마지막(tail) 세그먼트에만 덧붙인다.
+// seg_keys: 같은 자리에 그 세그먼트를 가리키게 기록했던 키 해시들(덮어써져 다른 세그먼트로 간 해시도 남아 있을 수 있다)
+// bytes/objects: 살아 있는 세그먼트 크기 합과 인덱스에 있는 오브젝트 수
+// hits ~ skipped: 통계(디스크에서 올린 조회, 디스크에도 없던 조회, 내려 쓴 오브젝트, 용량 때문에 지운 세그먼트, 대기열이 차서 안 쓴 오브젝트)
+
+static disk_t g_disk;
+static size_t g_disk_max = DISK_DEFAULT_SIZE;
+
+//이벤트 루프
+#define EPOLL_MAX_EVENTS 64
+#define EPOLL_RELAY_ROUNDS 16
+#define EPOLL_ACCEPT_BACKOFF_MS 100
+// EPOLL_MAX_EVENTS: epoll_wait 한 번에 받아 오는 최대 이벤트 수
+// EPOLL_RELAY_ROUNDS: 중계 중인 연결 하나가 루프를 연속으로 쓰는 최대 읽기/쓰기 횟수(나머지 연결이 굶지 않게)
+// EPOLL_ACCEPT_BACKOFF_MS: fd가 바닥나(EMFILE/ENFILE) accept가 실패하면 이 시간 동안 리스너를 epoll에서 빼 둔다
+
+typedef enum { EV_LISTEN, EV_CLIENT, EV_ORIGIN, EV_RESOLVED } ev_kind_t;
+typedef struct ev_handle {
+  ev_kind_t kind;
+  struct conn *c;
+} ev_handle_t;
+// epoll_event.data.ptr에 넣는 핸들. 이벤트가 온 fd가 리스닝/클라이언트/원서버/주소 해석 완료 파이프 중 무엇인지, 어느 연결인지 알려 준다.
+
+typedef struct ev_loop {
+  int epfd;
+  int listenfd;
+  int cpu;
+  ev_handle_t lh;
+  uint32_t listen_events;
+  long accept_resume;
+  int resolved[2];
+  ev_handle_t rh;
+  struct conn *idle_head, *idle_tail;
+  char (*header)[MAXLINE];
+} ev_loop_t;
+// 이벤트 루프 하나(스레드 하나가 돌림)
+// epfd: 이 루프의 epoll 인스턴스, listenfd/lh: 새 연결을 받는 리스닝 소켓과 그 핸들
+// cpu: 루프 스레드를 고정할 CPU 번호(-1이면 고정하지 않음). SO_REUSEPORT 모드에서 루프마다 리스너와 CPU를 하나씩 준다.
+// listen_events/accept_resume: 리스너를 등록할 때의 이벤트와, fd가 바닥나 리스너를 빼 둔 경우 다시 넣을 시각(ms, 0이면 등록 중)
+// resolved/rh: 리졸버 스레드가 주소 해석을 끝낸 연결(conn_t 포인터)을 돌려주는 파이프와 그 읽는 쪽의 핸들
+// idle_head/idle_tail: 요청 헤더를 읽는 중인 연결들(마감 시각 순, 모두 같은 CLIENT_IDLE_TIMEOUT을 받으므로 뒤에 붙이면 정렬이 유지된다)
+// header: 요청 헤더 파싱용 작업 공간(루프 안에서는 한 번에 한 연결만 파싱하므로 루프당 하나)
+
+typedef enum {
+  CONN_READ_REQ,
+  CONN_RESOLVE,
+  CONN_CONNECT,
+  CONN_SEND_REQ,
+  CONN_RELAY,
+  CONN_WRITE,
+  CONN_DONE
+} conn_state_t;
+// 연결별 상태 머신: 요청 읽기 -> 주소 해석 -> 원서버 접속 -> 요청 전송 -> 응답 중계 -> 완료
+// CONN_RESOLVE: 리졸버 스레드가 getaddrinfo 중(이 동안 연결은 리졸버 몫이라 루프가 해제하면 안 된다)
+// CONN_WRITE: 캐시 히트나 에러 응답처럼 이미 준비된 바이트를 클라이언트에 쓰는 중(다 쓰면 종료)
+
+typedef struct conn {
+  conn_state_t state;
+  ev_loop_t *loop;
+  int cfd, sfd;
+  ev_handle_t ch, sh;
+  char *in; size_t in_len, in_cap;
+  char *out; size_t out_len, out_off;
+  struct iovec *wv; int wv_cnt;
+  cache_obj_t *hit;
+  struct addrinfo *ai_list, *ai;
+  char *host; char port[16];
+  int gai_err; bool gone; struct conn *rnext;
+  long deadline; struct conn *iprev, *inext;
+  char *key; uint64_t hash;
+  char buf[MAXBUF]; size_t buf_len, buf_off;
+  seglist_t obj; int cacheable;
+} conn_t;
+// 이벤트 루프 모드의 연결 하나(스레드 모드에서 스택에 있던 지역 변수들을 힙의 상태로 옮긴 것)
+// cfd/sfd, ch/sh: 클라이언트/원서버 소켓과 각각의 epoll 핸들
+// in: 읽는 중인 요청 헤더 블록, out: 원서버로 보낼 요청(또는 에러 응답)
+// deadline/iprev/inext: 요청 헤더를 이 시각(ms)까지 다 받아야 한다. 그동안 루프의 idle 리스트에 걸려 있다(0이면 리스트 밖)
+// wv: CONN_WRITE에서 쓸 바이트 조각들(캐시 히트면 헤더 + Connection 헤더 + 본문 세그먼트들, 에러면 out 하나)
+// hit: 캐시 히트 엔트리(참조를 잡고 있다가 연결을 닫을 때 release)
+// ai_list/ai: 원서버 주소 후보와 지금 시도 중인 주소, host/port: 해석할 원서버(host는 502 메시지에도 씀)
+// gai_err: 리졸버의 getaddrinfo 결과, gone: 해석 중에 클라이언트가 끊김(돌아오면 닫는다), rnext: 리졸버 대기열 링크
+// key/hash: 캐시 키, buf: 원서버 -> 클라이언트 중계 버퍼, obj: 캐시에 넣을 응답 사본
+
+#define RESOLVER_THREADS 4
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct conn *head, *tail;
+} g_resolver = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL };
+// 이벤트 루프의 주소 해석 대기열. getaddrinfo는 블로킹(느린 DNS면 수 초)이라 루프 스레드에서 부르면
+// 그 루프의 모든 연결이 멈춘다 -> 리졸버 스레드들이 대신 부르고 결과를 연결의 루프로 돌려준다(모든 루프가 공유).
+
+typedef enum { MODE_THREAD, MODE_POOL, MODE_EPOLL } proxy_mode_t;
+
+//스레드 풀
+#define SBUF_DEFAULT_PER_WORKER 16
+// 연결 대기열 기본 깊이 = 워커 수 x 16 (-q로 바꿀 수 있음)
+
+typedef struct {
+  int *buf;
+  int n;
+  int front;
+  int rear;
+  sem_t mutex;
+  sem_t slots;
+  sem_t items;
+} sbuf_t;
+// 연결된 fd를 워커에게 넘기는 유한 크기 생산자-소비자 큐(CS:APP 12.5.4의 sbuf)
+// buf: 원형 버퍼(n칸), front/rear: 꺼낼 위치 바로 앞 / 마지막으로 넣은 위치
+// mutex: buf 접근 보호, slots: 빈 칸 수, items: 들어 있는 fd 수
+
+typedef enum { OVERLOAD_BLOCK, OVERLOAD_REJECT } overload_t;
+// 큐가 꽉 찼을 때의 동작
+  // block: accept 스레드가 빈 칸이 날 때까지 기다린다(커널 backlog에 연결이 쌓임)
+  // reject: 즉시 503을 보내고 연결을 닫는다(빠른 실패)
+
+static sbuf_t g_sbuf;
+
+typedef struct {
+  char *port;
+  int cpu;
+} acceptor_arg_t;
+// SO_REUSEPORT 워커 스레드에 넘기는 인자: 열 포트와 고정할 CPU(스레드가 받아서 Free)
+
+//업스트림(원서버) 연결 풀
+#define UPSTREAM_BUCKETS 64
+#define UPSTREAM_MAX_IDLE_PER_HOST 8
+#define UPSTREAM_MAX_IDLE 256
+#define UPSTREAM_IDLE_TIMEOUT 15
+// UPSTREAM_BUCKETS: host:port 해시 테이블의 버킷 수
+// UPSTREAM_MAX_IDLE_PER_HOST / UPSTREAM_MAX_IDLE: 원서버 하나당 / 전체 유휴 연결 한도(넘치면 반납하는 연결을 그냥 닫는다)
+// UPSTREAM_IDLE_TIMEOUT: 이 초 넘게 쉰 유휴 연결은 닫는다(원서버가 먼저 끊기 전에 정리하고, fd를 붙잡아 두지 않게)
+
+typedef struct upstream{
+  int fd;
+  rio_t rio;
+  char *key;
+  uint64_t hash;
+  time_t idle_since;
+  struct upstream *next;
+} upstream_t;
+// 원서버와의 연결 하나
+// rio: 연결과 같이 보관하는 읽기 버퍼(재사용할 때도 같은 버퍼로 이어서 읽는다)
+// key/hash: "host:port"와 그 해시(반납할 풀을 찾을 때 사용), idle_since: 풀에 반납된 시각(단조 시계, 초)
+// next: 같은 원서버의 유휴 연결 리스트
+
+typedef struct upstream_host{
+  char *key;
+  uint64_t hash;
+  upstream_t *idle;
+  int nidle;
+  struct upstream_host *next;
+} upstream_host_t;
+// host:port 하나의 유휴 연결 풀(해시 버킷 체인으로 연결)
+// idle: 가장 최근에 반납한 연결이 맨 앞(LIFO)
+  // 앞쪽일수록 덜 쉬었으니 살아 있을 가능성이 높고, 리스트가 반납 시각 역순이라 만료 정리는 뒷부분만 잘라내면 된다.
+// 유휴 연결이 하나도 없으면 풀 자체를 해제한다(한 번 방문한 원서버마다 항목이 쌓이지 않게)
+
+typedef struct {
+  pthread_mutex_t lock;
+  upstream_host_t *buckets[UPSTREAM_BUCKETS];
+  int nidle;
+  time_t last_sweep;
+  atomic_ulong opened, reused, expired, spliced, spliced_bytes;
+} upstream_pool_t;
+// 전역 업스트림 풀
+// lock: 풀 조작은 리스트 앞에서 떼고 붙이는 정도라 짧으므로 뮤텍스 하나로 충분하다(원서버 I/O는 락 밖에서 한다)
+// nidle: 전체 유휴 연결 수, last_sweep: 마지막으로 전체 버킷의 만료 연결을 정리한 시각(초당 한 번만)
+// opened/reused/expired: 새로 연 연결 / 풀에서 꺼내 재사용 / 만료나 상태 검사로 닫은 유휴 연결 수(SIGUSR1 통계)
+// spliced/spliced_bytes: 본문을 사용자 공간을 거치지 않고(splice) 원서버 소켓에서 클라이언트 소켓으로 옮긴 응답 수 / 바이트
+
+static upstream_pool_t g_upstream;
+
+//요청 합치기(single-flight)
+#define FLIGHT_BUCKETS 64
+// 진행 중인 미스 테이블의 버킷 수
+#define FILL_SEG_SIZE CACHE_SEG_SIZE
+// 채우는 중인 응답을 담는 조각 하나의 크기(캐시와 같은 슬랩 세그먼트를 쓴다)
+#define FILL_MAX_SIZE (16 * 1024 * 1024)
+#define FILL_MAX_SEGS ((FILL_MAX_SIZE + FILL_SEG_SIZE - 1) / FILL_SEG_SIZE)
+// 팔로워에게 나눠 주려고 붙잡아 둘 수 있는 응답 크기의 상한(넘으면 채우기를 중단하고 따라오던 팔로워는 연결을 닫는다)
+// 캐시에 넣을 사본도 이 안에 모으므로 -O는 이보다 클 수 없다.
+#define FILL_BUDGET (64 * 1024 * 1024)
+// 채우는 중인 응답들이 모두 합쳐 붙잡는 메모리가 이보다 많으면, 캐시할 수 없는 큰 응답은 따라 읽는 팔로워가 없을 때 나눠 주기를 그만둔다.
+
+typedef enum { FILL_FILLING, FILL_COMPLETE, FILL_ABORTED } fill_state_t;
+// 채우기 상태: 원서버에서 받는 중 / 응답 끝까지 받음 / 중간에 실패(원서버 끊김, 크기 초과)
+
+typedef struct flight{
+  cache_key_t *key;
+  uint64_t hash;
+  atomic_int refs;
+  bool listed;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  fill_state_t state;
+  char *segs[FILL_MAX_SEGS];
+  size_t len;
+  size_t hdr_len;
+  bool framed, can_chunk;
+  bool detached;
+  struct flight *next;
+} flight_t;
+// 원서버에서 가져오는 중인 키 하나(같은 키의 동시 미스는 이 항목 하나로 합쳐진다)
+// 리더가 받는 대로 뒤에 이어 붙이는(growing) 응답이라, 팔로워는 리더가 끝나기를 기다리지 않고 도착한 바이트까지 따라 읽는다(tail).
+// refs: 리더 1 + 따라 읽는 팔로워 수(0이 되면 해제), listed: 아직 테이블에 있어서 새 미스가 합류할 수 있는지(테이블 락)
+// lock/cond: 아래 채우기 상태를 지키는 항목별 락과, 팔로워가 새 바이트/끝을 기다리는 조건 변수
+// segs/len: 지금까지 받은 응답(캐시 사본과 같은 형식: hop-by-hop 헤더를 뺀 헤더 + 빈 줄 + 청크를 푼 본문). 조각은 한 번 쓰면 바뀌지 않는다.
+// hdr_len: 헤더 끝(빈 줄) 위치. 0이면 아직 헤더를 다 못 받았다.
+// framed/can_chunk: 본문 끝을 Content-Length로 알 수 있는지(본문 없음 포함) / 아니면 클라이언트에게 chunked로 다시 묶어 보낼 수 있는지
+// detached: 리더가 응답을 나눠 주지 않기로 함(200이 아님). 팔로워는 헤더를 기다리지 않고 각자 가져간다.
+
+typedef struct {
+  pthread_mutex_t lock;
+  flight_t *buckets[FLIGHT_BUCKETS];
+  atomic_ulong leaders, coalesced;
+  atomic_long fill_bytes;
+} flight_table_t;
+// 진행 중인 미스 테이블(키 해시로 버킷 선택). 미스일 때만 잡는 락이라 히트 경로에는 영향이 없다.
+// leaders/coalesced: 원서버로 실제로 보낸 미스 / 리더에 합쳐져 원서버 요청을 생략한 미스(SIGUSR1 통계)
+// fill_bytes: 채우는 중인 응답 조각들이 잡고 있는 메모리 합(FILL_BUDGET과 비교)
+
+static flight_table_t g_flights;
+
+typedef struct {
+  int clientfd;
+  bool client_ok;
+  bool http11;
+  bool keepalive;
+  bool chunk_out;
+  flight_t *fill;
+  bool sharing;
+  bool cacheable;
+  bool complete;
+  cache_obj_t *stale;
+} relay_t;
+// 원서버 응답을 클라이언트로 흘려보내면서 캐시에 넣을 사본을 모으는 상태
+// client_ok: 클라이언트 쓰기가 실패하면 false(이후 중계 중단)
+// http11: 클라이언트가 HTTP/1.1로 요청했는지(chunked로 받을 수 있는지)
+// keepalive: 들어올 때는 클라이언트 연결을 유지하고 싶은지, 나갈 때는 이 응답 뒤에도 유지할 수 있는지
+  // 응답 끝을 클라이언트에게 알릴 방법(Content-Length/chunked)이 없으면 false가 되어 연결을 닫는 것으로 끝을 알린다.
+// chunk_out: 원서버의 chunked 응답을 클라이언트에게도 chunked로 다시 묶어 보내는 중
+// fill: 받는 응답을 이어 붙이는 항목(팔로워들이 따라 읽고, 끝나면 캐시 사본이 된다). sharing: 아직 fill에 붙이는 중인지
+// cacheable: 오브젝트 한도(-O)를 넘거나 응답이 잘리면 false, complete: 원서버 응답을 끝까지 받았는지
+// stale: 조건부 요청으로 확인 중인 만료 엔트리(304가 오면 이 엔트리를 갱신하고 클라이언트에는 아무것도 보내지 않는다)
+
+typedef struct {
+  char host[MAXLINE], port[16], path[MAXLINE];
+  cache_obj_t *o;
+} refresh_arg_t;
+// 백그라운드 갱신 스레드에 넘기는 요청 정보와 갱신할 엔트리(참조 하나를 들고 간다)
+
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr =
     "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 "
     "Firefox/10.0.3\r\n";
 
 static void handle_client(int fd);
-static void read_request_headers(rio_t* rio, char header[][MAXLINE], int* num_headers);
+static bool handle_request(int fd, rio_t* rio, bool may_keep, arena_t* arena);
+static int read_request_headers(rio_t* rio, char header[][MAXLINE], int* num_headers);
 void clienterror(int fd, char* cause, char* errnum, char* shortmsg, char* longmsg);
 static int parse_uri(const char* uri, char* host, char* port, char* path);
+static int resolve_target(const char* uri, char header[][MAXLINE], int num_headers,
+  char* host, char* port, char* path, const char** errmsg);
+static size_t build_clienterror(char* out, size_t outsz, const char* cause, const char* errnum, const char* shortmsg, const char* longmsg);
+static void make_cache_key(char* key, size_t keysz, const char* host, const char* port, const char* path);
+static char* build_origin_request(const char* host, const char* port, const char* path,
+  char header[][MAXLINE], int num_headers, bool keepalive, const cache_obj_t* validate, arena_t* arena, size_t* out_len);
 static int forward_request_to_origin(
   int clientfd,
   const char* host, const char* port, const char* path,
-  char header[][MAXLINE], int num_headers);
+  char header[][MAXLINE], int num_headers, bool http11, bool* keepalive, arena_t* arena);
+static int fetch_from_origin(const char* host, const char* port, const char* path,
+  char header[][MAXLINE], int num_headers, const char* key, uint64_t hash, relay_t* r, arena_t* arena);
+static void refresh_in_background(const char* host, const char* port, const char* path, cache_obj_t* o);
+static void* refresh_thread(void* arg);
+
+  // 업스트림 연결 풀 + 응답 프레이밍
+static void upstream_init(void);
+static time_t upstream_now(void);
+static upstream_host_t** upstream_host_slot(const char* key, uint64_t hash);
+static upstream_t* upstream_acquire(const char* host, const char* port, bool use_idle, bool* reused);
+static void upstream_release(upstream_t* u, bool reusable);
+static void upstream_prune(upstream_host_t* h, time_t now);
+static void upstream_sweep(time_t now);
+static bool upstream_alive(upstream_t* u);
+static void upstream_close(upstream_t* u);
+static int relay_origin_response(upstream_t* u, relay_t* r, bool* reusable);
+static int relay_not_modified(upstream_t* u, cache_obj_t* o, int minor, bool* reusable);
+static int relay_body(upstream_t* u, relay_t* r, size_t n);
+static int relay_chunked_body(upstream_t* u, relay_t* r);
+static int relay_splice(upstream_t* u, relay_t* r, long long n);
+static void relay_out(relay_t* r, const char* buf, size_t n);
+static void relay_send(relay_t* r, const char* buf, size_t n);
+static void relay_keep(relay_t* r, const char* buf, size_t n);
+static void relay_body_out(relay_t* r, const char* buf, size_t n);
+static void relay_finish_headers(relay_t* r, bool framed, bool can_chunk);
+static bool relay_wanted(relay_t* r);
+static bool header_has_token(const char* value, const char* token);
+static bool is_hop_header(const char* line);
+static bool request_is_personal(char header[][MAXLINE], int num_headers);
+static int writev_all(int fd, struct iovec* iov, int cnt);
+static void iov_advance(struct iovec* iov, int* cnt, size_t n);
 
   // 동시성
 static void* worker(void* arg); //스레드 함수
+static void* pool_worker(void* arg); //스레드 풀 워커
+static void sbuf_init(sbuf_t *sp, int n);
+static void sbuf_insert(sbuf_t *sp, int item);
+static int sbuf_try_insert(sbuf_t *sp, int item);
+static int sbuf_remove(sbuf_t *sp);
+static void* reuseport_worker(void* arg); //SO_REUSEPORT 리스너를 직접 accept하는 워커
+static void run_reuseport_workers(char* port, int nworkers);
+static void pin_to_cpu(int cpu);
 
  // 캐시
-static void dll_push_front(cache_obj_t *o);
-static void dll_remove(cache_obj_t *o);
+static void dll_push_front(cache_shard_t *s, cache_obj_t *o);
+static void dll_remove(cache_shard_t *s, cache_obj_t *o);
+static uint64_t cache_hash(const char* key);
+static cache_shard_t* cache_shard_of(uint64_t hash);
+static void ht_insert(cache_shard_t *s, cache_obj_t *o);
+static void ht_remove(cache_shard_t *s, cache_obj_t *o);
+static void ht_grow(cache_shard_t *s);
 static void cache_init(void);
-static cache_obj_t* cache_find_unlocked(const char* key);
-static int cache_lookup(const char* key, char** out, size_t* out_sz);
-static void cache_insert(const char *key, const char* data, size_t sz);
+static cache_obj_t* cache_find_unlocked(cache_shard_t *s, const char* key, size_t len, uint64_t hash);
+static cache_obj_t* cache_lookup(const char* key, uint64_t hash, int* state);
+static void cache_refresh(cache_obj_t* o, const cache_control_t* cc, const char* expires, const char* date, long age);
+static const char* cache_obj_header(const cache_obj_t* o, const char* name, size_t* vlen);
+static void cache_release(cache_obj_t *o);
+static cache_obj_t* cache_insert(const char *key, uint64_t hash, cache_obj_t *o);
+static cache_obj_t* cache_make_object(char* const* src, size_t sz);
+static void parse_cache_control(const char* v, cache_control_t* cc);
+static time_t parse_http_date(const char* s);
+static long response_ttl(int status, const cache_control_t* cc, const char* expires, const char* date, long age);
+static uint32_t response_swr(const cache_control_t* cc);
+static int cache_obj_iov(cache_obj_t* o, bool keepalive, struct iovec* iov);
+static void slab_init(void);
+static void key_init(void);
+static cache_key_t* key_intern(const char* str, size_t len, uint64_t hash);
+static void key_release(cache_key_t* k);
+static bool key_equal(const cache_key_t* k, const char* str, size_t len, uint64_t hash);
+static key_stripe_t* key_stripe_of(uint64_t hash);
+static void key_grow(key_stripe_t* ks);
+static void* slab_alloc(size_t n);
+static void slab_free(void* p, size_t n);
+static int slab_class_of(size_t n);
+static char* seg_alloc(void);
+static void seg_free(char* seg);
+static void arena_init(arena_t* a);
+static void* arena_alloc(arena_t* a, size_t n);
+static void arena_reset(arena_t* a);
+static void arena_destroy(arena_t* a);
+static void seg_copy_out(char* const* segs, size_t off, char* dst, size_t n);
+static void seglist_append(seglist_t* sl, const char* buf, size_t n);
+static void seglist_free(seglist_t* sl);
+static size_t parse_size(const char* s);
+static void flight_init(void);
+static flight_t* flight_join(const char* key, uint64_t hash, bool* leader);
+static flight_t* flight_new(const char* key, uint64_t hash);
+static int flight_append(flight_t* f, const char* buf, size_t n);
+static void flight_header(flight_t* f, size_t hdr_len, bool framed, bool can_chunk);
+static bool flight_unshare(flight_t* f);
+static void flight_detach(flight_t* f);
+static void flight_finish(flight_t* f, bool ok);
+static void flight_put(flight_t* f);
+static int flight_stream(flight_t* f, relay_t* r);
+static void* stats_thread(void* arg);
+
+ // 디스크 계층
+static void disk_init(const char* dir);
+static void disk_seg_path(char* buf, size_t sz, uint32_t seg);
+static int disk_seg_open(uint32_t seg, bool create);
+static bool disk_index_open(uint32_t nslots, uint32_t head, uint32_t tail);
+static void disk_rebuild(void);
+static disk_slot_t* disk_slot_find(uint64_t hash);
+static void disk_slot_put(uint64_t hash, uint32_t seg, uint64_t off, uint32_t len, int64_t expires, uint32_t swr);
+static void disk_slot_delete(disk_slot_t* sl);
+static void disk_seg_note(uint32_t seg, uint64_t hash);
+static void disk_drop_oldest(void);
+static int disk_io(int fd, struct iovec* iov, int cnt, off_t off, bool write);
+static void disk_store(const char* key, cache_obj_t* o);
+static void disk_enqueue(cache_obj_t* o);
+static void* disk_writer(void* arg);
+static cache_obj_t* disk_load(const char* key, uint64_t hash);
+static void disk_touch(uint64_t hash, time_t expires, uint32_t swr);
+
+ // 이벤트 루프
+static void set_nonblocking(int fd);
+static void run_event_loops(char* port, int nloops, bool reuseport);
+static void* ev_loop_thread(void* arg);
+static void ev_accept(ev_loop_t* lp);
+static void* resolver_thread(void* arg);
+static void ev_resolved(ev_loop_t* lp);
+static long ev_now_ms(void);
+static void ev_idle_remove(conn_t* c);
+static int ev_expire(ev_loop_t* lp);
+static void conn_watch(conn_t* c, uint32_t cev, uint32_t sev);
+static void conn_close(conn_t* c);
+static void conn_reply_error(conn_t* c, const char* cause, const char* errnum, const char* shortmsg, const char* longmsg);
+static void conn_on_client(conn_t* c, uint32_t events);
+static void conn_start_request(conn_t* c);
+static void conn_connect_next(conn_t* c);
+static void conn_on_origin(conn_t* c, uint32_t events);
+static void conn_relay(conn_t* c);
 //######################################################################################################################################################
 /*
 * 명령행에서 포트를 받고 그 포트로 리스닝 소켓을 연다.
@@ -75,26 +789,203 @@ static void cache_insert(const char *key, const char* data, size_t sz);
 * 처리가 끝난 소켓을 닫는다.
 */
 int main(int argc, char** argv){
-  
-  int listenfd, connfd, *connfdp;
+
+  int listenfd, *connfdp, opt;
   socklen_t clientlen;
   struct sockaddr_storage clientaddr;
+  proxy_mode_t mode = MODE_THREAD;
+  int nworkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if(nworkers < 1) nworkers = 1;
+  int qdepth = 0;
+  overload_t overload = OVERLOAD_BLOCK;
+  bool reuseport = false;
+
+  while((opt = getopt(argc, argv, "c:m:n:q:o:rC:O:Mt:w:D:S:")) != -1){
+    switch(opt){
+      case 'c':
+        g_policy = NULL;
+        for(size_t i = 0; i < sizeof(g_policies) / sizeof(g_policies[0]); i++)
+          if(!strcasecmp(optarg, g_policies[i].name)) g_policy = &g_policies[i];
+        if(!g_policy){
+          fprintf(stderr, "unknown cache policy: %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'm':
+        if(!strcasecmp(optarg, "thread")) mode = MODE_THREAD;
+        else if(!strcasecmp(optarg, "pool")) mode = MODE_POOL;
+        else if(!strcasecmp(optarg, "epoll")) mode = MODE_EPOLL;
+        else{
+          fprintf(stderr, "unknown mode: %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'n':
+        nworkers = atoi(optarg);
+        if(nworkers < 1){
+          fprintf(stderr, "invalid worker count: %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'q':
+        qdepth = atoi(optarg);
+        if(qdepth < 1){
+          fprintf(stderr, "invalid queue depth: %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'o':
+        if(!strcasecmp(optarg, "block")) overload = OVERLOAD_BLOCK;
+        else if(!strcasecmp(optarg, "reject")) overload = OVERLOAD_REJECT;
+        else{
+          fprintf(stderr, "unknown overload behavior: %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'r':
+        reuseport = true;
+        break;
+      case 'C':
+      case 'O':
+      case 'S':
+        if(!parse_size(optarg)){
+          fprintf(stderr, "invalid size: %s\n", optarg);
+          exit(1);
+        }
+        if(opt == 'C') g_max_cache = parse_size(optarg);
+        else if(opt == 'O') g_max_object = parse_size(optarg);
+        else g_disk_max = parse_size(optarg);
+        break;
+      case 'D':
+        g_disk.enabled = true;
+        snprintf(g_disk.dir, sizeof(g_disk.dir), "%s", optarg);
+        break;
+      case 'M':
+        g_count_meta = true;
+        break;
+      case 't':
+        g_default_ttl = atol(optarg);
+        if(g_default_ttl < 0 || (g_default_ttl == 0 && strcmp(optarg, "0"))){
+          fprintf(stderr, "invalid default ttl: %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'w':
+        g_default_swr = atol(optarg);
+        if(g_default_swr < 0 || (g_default_swr == 0 && strcmp(optarg, "0"))){
+          fprintf(stderr, "invalid stale-while-revalidate window: %s\n", optarg);
+          exit(1);
+        }
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-c lru|clock|tinylfu] [-m thread|pool|epoll] [-n workers] [-q depth] [-o block|reject] [-r] [-C cache_bytes] [-O object_bytes] [-M] [-t ttl] [-w swr] [-D dir] [-S disk_bytes] <port>\n", argv[0]);
+        exit(1);
+    }
+  }
+  // -c: 캐시 정책 선택(lru | clock | tinylfu). 같은 트래픽으로 정책끼리 히트율을 비교할 수 있게 옵션으로 둔다.
+  // -m: 동시성 모델 선택
+    // thread(기본): 연결마다 스레드 하나
+    // pool: 미리 만든 -n개의 워커 스레드가 깊이 -q의 연결 큐에서 fd를 꺼내 처리. 큐가 차면 -o에 따라 대기/503
+    // epoll: -n개의 이벤트 루프 스레드가 논블로킹 소켓을 다중화(기본값은 CPU 수)
+  // -r: SO_REUSEPORT 다중 acceptor. 워커(pool)/루프(epoll)마다 자기 리스닝 소켓을 열고 CPU 하나에 고정한다.
+    // 커널이 새 연결을 소켓들에 나눠 주므로 accept 큐 하나를 모든 스레드가 두고 다투지 않는다.
+  // -C/-O: 캐시 전체 / 오브젝트 하나 한도(바이트, K/M/G 접미사 가능). 기본값은 MAX_CACHE_SIZE / MAX_OBJECT_SIZE
+  // -M: 캐시 용량에 엔트리 메타데이터(구조체, 키, 세그먼트 배열)도 센다(작은 오브젝트가 많을 때 실제 메모리에 가깝게)
+  // -t: 신선도 정보가 없는 응답의 기본 캐시 시간(초, 기본 CACHE_DEFAULT_TTL). 0이면 명시한 응답만 캐시
+  // -w: 기본 stale-while-revalidate 창(초, 기본 0 = 만료되면 항상 원서버 확인을 기다린다)
+  // -D: 디스크 계층 디렉터리(없으면 만든다). 메모리에서 밀려난 오브젝트를 두고, 재시작해도 이어서 쓴다(thread/pool 모드)
+  // -S: 디스크 계층 용량(바이트, K/M/G, 기본 DISK_DEFAULT_SIZE)
 
-  if(argc != 2){
+  if(argc - optind != 1){
     // 포트가 없으면 즉시 종료
-    fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    fprintf(stderr, "usage: %s [-c lru|clock|tinylfu] [-m thread|pool|epoll] [-n workers] [-q depth] [-o block|reject] [-r] [-C cache_bytes] [-O object_bytes] [-M] [-t ttl] [-w swr] [-D dir] [-S disk_bytes] <port>\n", argv[0]);
+    exit(1);
+  }
+  if(reuseport && mode == MODE_THREAD){
+    fprintf(stderr, "-r requires -m pool or -m epoll\n");
+    exit(1);
+  }
+  // 연결당 스레드 모드는 acceptor가 원래 하나뿐이라 -r을 받지 않는다.
+  if(g_disk.enabled && mode == MODE_EPOLL){
+    fprintf(stderr, "-D requires -m thread or -m pool\n");
+    exit(1);
+  }
+  // 이벤트 루프 모드는 디스크 계층에 쓰지도 읽지도 않는다 -> 받아 주면 인덱스만 건드리고 아무 일도 안 하는 계층이 된다.
+  if(g_max_object > FILL_MAX_SIZE || g_max_cache / CACHE_SHARDS < g_max_object){
+    fprintf(stderr, "object limit must be <= %d and <= cache limit / %d\n", FILL_MAX_SIZE, CACHE_SHARDS);
+    exit(1);
+  }
+  // 샤드 하나(-C / 샤드 수)에 최대 크기 오브젝트가 들어가야 하고, 캐시 사본을 모으는 fill도 그만큼 담을 수 있어야 한다.
+  if(g_disk.enabled && (g_disk_max < 2 * DISK_SEG_MIN || g_disk_max / DISK_SEG_MAX > DISK_MAX_SEGS / 2)){
+    fprintf(stderr, "disk size must be between %lu and %lu bytes\n", 2 * DISK_SEG_MIN, (unsigned long)DISK_MAX_SEGS / 2 * DISK_SEG_MAX);
     exit(1);
   }
+  // 세그먼트 크기를 용량의 1/8(1MB ~ 64MB)로 잡으므로 살아 있는 세그먼트 수가 파일 디스크립터 링에 들어가야 한다.
 
   signal(SIGPIPE, SIG_IGN); // write 중 상대가 끊어도 죽지 않게
   // SIGPIPE 무시: 상대가 먼저 연결을 끊은 뒤 write하면 기본은 프로세스가 죽음 -> 무시해서 각 연결만 실패로 처리
+
+  sigset_t stats_mask;
+  sigemptyset(&stats_mask);
+  sigaddset(&stats_mask, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &stats_mask, NULL);
+  pthread_t stats_tid;
+  pthread_create(&stats_tid, NULL, stats_thread, NULL);
+  pthread_detach(stats_tid);
+  // SIGUSR1을 받으면 정책별 캐시 통계를 출력한다(kill -USR1 <pid>).
+  // 모든 스레드에서 SIGUSR1을 막아 두고(이후 만드는 스레드도 마스크를 물려받음) 통계 스레드만 sigwait로 받는다.
+  // 시그널 핸들러 안에서 printf를 부르면 안전하지 않기 때문에 전용 스레드에서 평범한 코드로 출력한다.
+  slab_init();
+  //세그먼트 슬랩 초기화(캐시 본문과 채우는 중인 응답이 여기서 세그먼트를 받는다)
+  key_init();
+  //키 인터닝 테이블 초기화
   cache_init();
   //캐시 초기화: 전역 캐시(g_cache)를 0으로 초기화하고 RW-lock 준비
+  upstream_init();
+  //원서버 연결 풀 초기화(thread/pool 모드의 미스가 원서버 연결을 재사용한다)
+  flight_init();
+  //진행 중인 미스 테이블 초기화(같은 키의 동시 미스를 원서버 요청 하나로 합친다)
+  if(g_disk.enabled) disk_init(g_disk.dir);
+  //디스크 계층(-D): 인덱스를 mmap으로 다시 붙이고(없거나 안 맞으면 세그먼트를 훑어 재구성) 이어서 쓸 세그먼트를 연다.
+
+  if(mode == MODE_EPOLL){
+    run_event_loops(argv[optind], nworkers, reuseport);
+    // 이벤트 루프 모드는 여기서 돌아오지 않는다.
+  }
+  if(reuseport){
+    run_reuseport_workers(argv[optind], nworkers);
+    // pool + -r: 워커가 각자 리스너에서 직접 accept하므로 공유 큐(-q/-o)를 거치지 않는다. 돌아오지 않음
+  }
 
-  listenfd = Open_listenfd(argv[1]);
+  listenfd = Open_listenfd(argv[optind]);
   //Open_listenfd는 socket -> bind -> listen까지 해결해주는 헬퍼(에러 처리 포함)
   //여기서 만들어진 소켓은 수동 대기(listening) 상태
 
+  if(mode == MODE_POOL){
+    sbuf_init(&g_sbuf, qdepth ? qdepth : nworkers * SBUF_DEFAULT_PER_WORKER);
+    for(int i = 0; i < nworkers; i++){
+      pthread_t tid;
+      pthread_create(&tid, NULL, pool_worker, NULL);
+      pthread_detach(tid);
+    }
+    // 워커 스레드를 시작할 때 한 번만 만든다 -> 요청 지연 경로에서 pthread_create가 빠진다.
+
+    while(1){
+      clientlen = sizeof(clientaddr);
+      int connfd = Accept(listenfd, (SA*)&clientaddr, &clientlen);
+      if(overload == OVERLOAD_BLOCK){
+        sbuf_insert(&g_sbuf, connfd);
+      }
+      else if(sbuf_try_insert(&g_sbuf, connfd) < 0){
+        clienterror(connfd, "proxy", "503", "Service Unavailable", "Proxy is overloaded, try again later");
+        Close(connfd);
+      }
+    }
+    // 메인 스레드는 accept만 하는 생산자. fd를 큐에 넣으면 쉬고 있는 워커 하나가 꺼내 간다.
+    // 큐 깊이만큼만 연결을 붙잡아 두므로 연결 폭주가 와도 스레드 수와 메모리가 고정된다.
+    // reject 모드에서는 큐가 꽉 차 있으면 요청을 읽지도 않고 바로 503으로 돌려보낸다.
+  }
+
   while(1){ // 무한 루프로 새 클라이언트 연결을 수락
     clientlen = sizeof(clientaddr);
     connfdp = Malloc(sizeof(int));
@@ -126,26 +1017,55 @@ int main(int argc, char** argv){
   }
 }
 
+//######################################################################################################################################################
+static void handle_client(int fd){
+  rio_t rio;
+  Rio_readinitb(&rio, fd);
+  //Rio_readinitb(&rio, fd): fd(클라이언트 소켓)를 RIO 버퍼와 연결해서 줄 단위 읽기 준비
+  // rio는 연결이 끝날 때까지 하나를 계속 쓴다 -> 파이프라이닝으로 한꺼번에 도착한 다음 요청들이 버퍼에 남아 있다가 차례로 읽힌다.
+
+  struct timeval tv = { .tv_sec = CLIENT_IDLE_TIMEOUT, .tv_usec = 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  // 유휴 타임아웃: 읽기가 이 시간 안에 안 끝나면 EAGAIN으로 실패 -> 연결 종료
+
+  arena_t arena;
+  arena_init(&arena);
+  for(int i = 1; i <= CLIENT_MAX_REQUESTS; i++){
+    bool more = handle_request(fd, &rio, i < CLIENT_MAX_REQUESTS, &arena);
+    arena_reset(&arena);
+    if(!more) break;
+  }
+  arena_destroy(&arena);
+  // 클라이언트가 연결 유지를 원하고 응답 끝을 알릴 수 있는 동안 같은 연결로 요청을 계속 처리한다.
+  // 응답은 요청 순서대로 하나씩 끝까지 쓰므로 파이프라인 요청도 순서가 지켜진다.
+  // 요청 하나 동안 쓴 임시 버퍼는 요청이 끝날 때마다 아레나째 비운다(첫 블록은 다음 요청이 그대로 다시 쓴다)
+}
+
 //######################################################################################################################################################
 /*
 * method, uri, version: 요청라인의 3요소 저장용
 * header[MAX_HEADERS][MAXLINE]: 클라이언트가 보낸 요청 헤더들을 한 줄씩 보관
 * host, port, path: 원서버(오리진)에 접속할 때 필요할 주소 3종
+* may_keep: 이 요청 뒤에 연결을 더 써도 되는지(요청 수 한도에 닿았으면 false)
+* arena: 이 요청 동안만 쓰는 버퍼를 받는 연결의 아레나(호출자가 요청마다 비운다)
+* 반환: 이 연결로 다음 요청을 받아도 되면 true
 */
-static void handle_client(int fd){
+static bool handle_request(int fd, rio_t* rio, bool may_keep, arena_t* arena){
 
   int num_headers = 0;
   char method[MAXLINE], buf[MAXLINE], uri[MAXLINE], version[MAXLINE], header[MAX_HEADERS][MAXLINE];
   char host[MAXLINE], port[16], path[MAXLINE];
-  rio_t rio;
-  // rio 초기화
-
-  Rio_readinitb(&rio, fd);
-  //Rio_readinitb(&rio, fd): fd(클라이언트 소켓)를 RIO 버퍼와 연결해서 줄 단위 읽기 준비
+  ssize_t n;
 
-  Rio_readlineb(&rio, buf, MAXLINE);
+  do{
+    n = rio_readlineb(rio, buf, MAXLINE);
+  } while(n > 0 && (!strcmp(buf, "\r\n") || !strcmp(buf, "\n")));
+  if(n <= 0) return false;
+  // 요청 사이의 빈 줄은 건너뛴다.
+  // EOF(클라이언트가 닫음)나 유휴 타임아웃이면 조용히 끝낸다(프로세스를 죽이는 Rio_readlineb 대신 rio_readlineb)
   printf("Request headers:\n");
   printf("%s", buf);
+  method[0] = uri[0] = version[0] = '\0';
   sscanf(buf, "%s %s %s", method, uri, version);
   /*
   * 예: GET http://example.com/index.html HTTP/1.1
@@ -156,92 +1076,63 @@ static void handle_client(int fd){
   //GET만 허용(아니면 간단한 에러 응답 후 리턴)
   if(strcasecmp(method, "GET")){
     clienterror(fd, method, "501", "Not implemented", "Tiny does not implement this method");
-    return;
+    return false;
   }
   // 전부 똑같으면 0을 출력하기 때문에 이렇게 진행
+  // 본문이 있을지 모르는 다른 메서드는 다음 요청의 시작을 알 수 없으므로 연결도 닫는다.
 
   //요청 헤더를 빈 줄(CRLF, \r\n)까지 한 줄씩 읽어 벡터/배열에 보관
-  read_request_headers(&rio, header, &num_headers);
+  if(read_request_headers(rio, header, &num_headers) < 0) return false;
   // 빈 줄(\r\n) 나올 때까지 한 줄씩 읽어 header[i]에 저장
   // 나중에 원서버로 재전달(필요한 것만) 하기 위해 쌓아둔다.
 
+  bool http11 = !strcasecmp(version, "HTTP/1.1");
+  bool keepalive = http11;
+  for(int i = 0; i < num_headers; i++){
+    const char* v = NULL;
+    if(!strncasecmp(header[i], "Connection:", 11)) v = header[i] + 11;
+    else if(!strncasecmp(header[i], "Proxy-Connection:", 17)) v = header[i] + 17;
+    if(!v) continue;
+    if(header_has_token(v, "close")) keepalive = false;
+    else if(header_has_token(v, "keep-alive")) keepalive = true;
+  }
+  keepalive = keepalive && may_keep;
+  // 연결 유지 여부: HTTP/1.1은 기본 유지, HTTP/1.0은 Connection(또는 Proxy-Connection): keep-alive가 있어야 유지
+  // close가 오면 유지하지 않는다.
+
 
   // 목적지(host/port)와 경로 결정
   // 프록시로 오는 요청 URI는 두 형태가 올 수 있다.
     //absolute-form: http://host:port/path(브라우저가 프록시로 말할 때 자주 사용)
     //origin-form: /path(curl이나 일부 상황에서 사용) -> 이떄는 반드시 Host: 헤더로 호스트를 알아내야 한다.
-  // 헤더에서 Host: 가 있는지 찾기
-  int host_idx = -1;
-  for(int i = 0; i < num_headers; i++){
-    if(!strncasecmp(header[i], "Host:", 5)) {host_idx = i; break;}
-    //strncasecmp는 대소문자 구분없이 header[i] 앞의 5글자와 "Host"를 비교하며 같을 경우 0을 반환.
-    // 클라이언트가 프록시에 보낼 때 요청라인이 /path 형태(origin-form)이면 원 서버 호스트는 반드시 Host: 헤더에서 얻어야 한다.(HTTP/1.1 규칙)
-    // 전체 헤더 배열에서 Host: 라인을 찾아 위치(host_idx)를 기록한다.
-  }
-  
-
-  if(uri[0] == '/') {
-    if(host_idx < 0) {clienterror(fd, uri, "400", "Bad Request", "Host header missing"); return;}
-    char hostline[MAXLINE];
-    strncpy(hostline, header[host_idx] + 5, sizeof(hostline) - 1);
-    hostline[sizeof(hostline) - 1] = '\0';
-    // header[host_idx] + 5는 "Host:" 딱 5글자를 건너뛴 다음을 가리킴(보통 공백이 따라옴)
-
-    char* h = hostline;
-    while(*h == ' ' || *h == '\t') h++;
-    // 공백 제거
-    // 이제 h는 "example.com" 또는 "example.com:8080"의 시작을 가리킴
-
-    char* colon = strchr(h, ':');
-    if(colon){
-      *colon = '\0'; // host 문자열을 여기서 끊는다.
-      strncpy(host, h, MAXLINE-1); //host = "example.com"
-      host[MAXLINE-1] = '\0'; 
-      strncpy(port, colon+1, 15); // port = "8080"
-      port[15] = '\0';
-    }
-    else{
-      strncpy(host, h, MAXLINE-1); // host = "example.com"
-      host[MAXLINE - 1] = '\0'; 
-      strcpy(port, "80"); // 포트가 없으면 기본 80
-    }
-
-    strncpy(path, uri, MAXLINE - 1);
-    path[MAXLINE - 1] = '\0';
+  const char* errmsg;
+  if(resolve_target(uri, header, num_headers, host, port, path, &errmsg) < 0){
+    clienterror(fd, uri, "400", "Bad Request", (char*)errmsg);
+    return false;
   }
-  // uri가 /... 로 시작하면 origin-form이다. 예: GET /index.html HTTP/1.1
-  // 이 경우 호스트 정보가 요청라인에 없으므로 반드시 Host:헤더가 있어야 하고 없으면 400으로 거절
-  // path는 그냥 uri를 그대로 사용
-
-  else{
-    if(parse_uri(uri, host, port, path) < 0){
-      clienterror(fd, uri, "400", "Bad Request", "Proxy couldn't parse URI");
-      return;
-    }
-  }
-  // uri가 http://example.com:8080/index.html 같은 absolute-form이면
-  // parse_uri가 알아서 host="example.com", port = "8080"(없으면 "80"), path = "/index.html"로 분해
-  // 여기서는 Host: 헤더가 없더라도 요청라인에 이미 호스트가 있으므로 포워딩에 필요한 정보가 채워짐
-  // (그래도 나중에 원 서버로 보낼 때는 Host: 헤더를 넣어줘야 하니까, 후단에서 have_host 검사하고 추가함)
+  // 요청라인의 URI와 Host: 헤더로 원서버 host/port/path를 결정(실패하면 400)
+  // 이벤트 루프 모드(-m epoll)도 같은 함수를 써서 두 모드의 파싱 규칙이 똑같이 유지된다.
 
   // 원 서버로 요청 포워딩 + 응답 릴레이
-  if(forward_request_to_origin(fd, host, port, path, header, num_headers) < 0){
+  if(forward_request_to_origin(fd, host, port, path, header, num_headers, http11, &keepalive, arena) < 0){
     clienterror(fd, host, "502", "Bad Gateway", "Proxy failed to connect to origin");
-    return;
+    return false;
   }
-  // 여기서 실제로 원 서버에 TCP 연결 -> HTTP 요청 재작성/전송 -> 응답 받아서 클라이언트로 그대로 흘려보내기를 수행
+  // 에러 응답(400/501/502)은 HTTP/1.0 응답이라 보낸 뒤 연결을 닫는다.
+  // 여기서 실제로 원 서버 연결(풀에서 재사용하거나 새로 연결) -> HTTP 요청 재작성/전송 -> 응답 받아서 클라이언트로 흘려보내기를 수행
   // 내부에서:
-    // 요청라인을 GET <path> HTTP/1.0\r\n으로 표준화(원 서버와는 짧은 연결로 간단하게)
-    // 필수/권장 헤더 채움: Host, 고정된 User-Agent, Connection: close, Proxy-Connection: close
+    // 요청라인을 GET <path> HTTP/1.1\r\n으로 표준화하고 Connection: keep-alive로 원서버 연결을 유지
+    // 필수/권장 헤더 채움: Host, 고정된 User-Agent
     // 클라이언트가 보낸 헤더 중 hop-by-hop 헤더(Connection 류, TE, Upgrade 등)는 제거하고 나머지는 전달
     // 헤더 끝 \r\n 추가 후 바디(있다면) 처리
-    // 원 서버 응답을 읽어 클라이언트 소켓으로 그대로 write
-    // 응답은 읽어서 그대로 클라이언트 fd로 릴레이
-  
+    // 원 서버 응답의 끝을 Content-Length / chunked로 정확히 찾아서 클라이언트로 릴레이
+    // 응답을 끝까지 읽었고 원서버가 연결 유지를 허락했으면 연결을 풀에 반납
+    // 클라이언트에게도 응답 끝을 알릴 수 있으면(Content-Length/chunked) keepalive를 유지, 아니면 false
+  return keepalive;
 }
 
 //######################################################################################################################################################
-static void read_request_headers(rio_t* rio, char header[][MAXLINE], int* num_headers){
+static int read_request_headers(rio_t* rio, char header[][MAXLINE], int* num_headers){
   // rio: RIO 구조체 포인터, 클라이언트 소켓과 연결된 버퍼.
   // header: 문자열 배열. 요청 헤더를 한 줄 씩 저장할 공간
   // num_headers: 지금까지 읽은 헤더 줄 수를 기록하는 변수(포인터)
@@ -249,11 +1140,11 @@ static void read_request_headers(rio_t* rio, char header[][MAXLINE], int* num_he
   // 각 줄 끝엔 CRLF가 포함될 수 있으니 필요하면 정리(개행 제거)
   char buf[MAXLINE];
 
-  while(Rio_readlineb(rio, buf, MAXLINE) > 0){
-    // Rio_readlineb: 소켓 스트림에서 줄 단위(최대 MAXLINE까지) 읽기.
+  while(rio_readlineb(rio, buf, MAXLINE) > 0){
+    // rio_readlineb: 소켓 스트림에서 줄 단위(최대 MAXLINE까지) 읽기.
     // > 0: 한 줄 이상 읽어왔으면 계속 반복
-    // 0 이면 EOF, 즉 클라이언트가 연결을 끊었음
-    if(!strcmp(buf, "\r\n")) break;
+    // 0 이면 EOF, 즉 클라이언트가 연결을 끊었음(-1이면 에러나 유휴 타임아웃)
+    if(!strcmp(buf, "\r\n") || !strcmp(buf, "\n")) return 0;
     // HTTP 헤더는 빈 줄(\r\n)이 나오면 끝난다
     // 루프 종료
     if(*num_headers < MAX_HEADERS){
@@ -268,8 +1159,8 @@ static void read_request_headers(rio_t* rio, char header[][MAXLINE], int* num_he
       printf("%s", buf); //디버깅을 위해 읽은 헤더줄을 출력
     }
   }
-  return;
-  
+  return -1;
+  // 빈 줄을 보기 전에 끊김 -> 요청이 완전하지 않으므로 -1
 }
 
 //######################################################################################################################################################
@@ -282,31 +1173,107 @@ void clienterror(int fd, char* cause, char* errnum, char* shortmsg, char* longms
   * longmsg: 상테 메시지 (예: "Tiny couldn't find this file")
   * 이 함수는 fd로 연결된 클라이언틍게 에러 응답을 만들어 보낸다.
   */
-  
-  char buf[MAXLINE], body[MAXLINE];
 
-  sprintf(body, "<html><title>Tiny Error</title>");
-  sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-  sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-  sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-  sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
+  char buf[MAXBUF];
+  size_t n = build_clienterror(buf, sizeof(buf), cause, errnum, shortmsg, longmsg);
+  rio_writen(fd, buf, n);
+  // 응답 전체(상태줄 + 헤더 + 본문)를 한 버퍼에 만들어 한 번에 보낸다.
+  // 클라이언트가 이미 끊었으면 쓰기만 실패하고 넘어간다(프로세스를 죽이는 Rio_writen 대신 rio_writen)
+}
+
+//######################################################################################################################################################
+static size_t build_clienterror(char* out, size_t outsz, const char* cause, const char* errnum, const char* shortmsg, const char* longmsg){
+  char body[MAXLINE];
+  int blen = snprintf(body, sizeof(body),
+    "<html><title>Tiny Error</title>"
+    "<body bgcolor=""ffffff"">\r\n"
+    "%s: %s\r\n"
+    "<p>%s: %s\r\n"
+    "<hr><em>The Tiny Web server</em>\r\n",
+    errnum, shortmsg, longmsg, cause);
+  if(blen >= (int)sizeof(body)) blen = sizeof(body) - 1;
   //에러 응답 본문 생성
   //body라는 문자열 버퍼에 간단한 HTML 페이지를 만든다
   //페이지 배경을 흰색으로 지정하고, 에러 코드와 메시지, 에러 원인(cause), 그리고 서버 서명을 출력한다
+  //(sprintf(body, "%s...", body)처럼 자기 자신을 인자로 넘기면 정의되지 않은 동작이라 한 번에 만든다)
 
-  sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-  Rio_writen(fd, buf, strlen(buf));
+  int n = snprintf(out, outsz,
+    "HTTP/1.0 %s %s\r\n"
+    "Content-type: text/html\r\n"
+    "Content-length: %d\r\n\r\n"
+    "%s",
+    errnum, shortmsg, blen, body);
   //첫 줄(Response line): "HTTP/1.0 404 Not Found\r\n"
-  sprintf(buf, "Content-type: text/html\r\n");
-  Rio_writen(fd, buf, strlen(buf));
   //헤더 1: 콘텐츠 타입을 HTML로 지정
-  sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-  Rio_writen(fd, buf, strlen(buf));
-  //헤더 2: 본문 길이를 지정(Content-length)
-  //마지막 \r\n으로 헤더 종료
-  Rio_writen(fd, body, strlen(body));
-  //본문(에러 페이지) 전송
-  //앞에서 만든 HTML 문자열 body를 클라이언트에 전송한다
+  //헤더 2: 본문 길이를 지정(Content-length), 마지막 \r\n으로 헤더 종료
+  //그 뒤에 본문(에러 페이지)
+  return (size_t)n < outsz ? (size_t)n : outsz - 1;
+}
+// 에러 응답 바이트를 out에 만들어 길이를 돌려준다.
+// 블로킹 소켓에 바로 쓰는 clienterror와, 논블로킹 소켓에 나눠 써야 하는 이벤트 루프가 같은 응답을 공유한다.
+
+//######################################################################################################################################################
+static int resolve_target(const char* uri, char header[][MAXLINE], int num_headers,
+  char* host, char* port, char* path, const char** errmsg){
+  // 목적지(host/port)와 경로 결정
+  // 프록시로 오는 요청 URI는 두 형태가 올 수 있다.
+    //absolute-form: http://host:port/path(브라우저가 프록시로 말할 때 자주 사용)
+    //origin-form: /path(curl이나 일부 상황에서 사용) -> 이떄는 반드시 Host: 헤더로 호스트를 알아내야 한다.
+  // 실패하면 -1을 돌려주고 *errmsg에 400 응답에 넣을 설명을 담는다.
+  // 헤더에서 Host: 가 있는지 찾기
+  int host_idx = -1;
+  for(int i = 0; i < num_headers; i++){
+    if(!strncasecmp(header[i], "Host:", 5)) {host_idx = i; break;}
+    //strncasecmp는 대소문자 구분없이 header[i] 앞의 5글자와 "Host"를 비교하며 같을 경우 0을 반환.
+    // 클라이언트가 프록시에 보낼 때 요청라인이 /path 형태(origin-form)이면 원 서버 호스트는 반드시 Host: 헤더에서 얻어야 한다.(HTTP/1.1 규칙)
+    // 전체 헤더 배열에서 Host: 라인을 찾아 위치(host_idx)를 기록한다.
+  }
+
+  if(uri[0] == '/') {
+    if(host_idx < 0) {*errmsg = "Host header missing"; return -1;}
+    char hostline[MAXLINE];
+    strncpy(hostline, header[host_idx] + 5, sizeof(hostline) - 1);
+    hostline[sizeof(hostline) - 1] = '\0';
+    // header[host_idx] + 5는 "Host:" 딱 5글자를 건너뛴 다음을 가리킴(보통 공백이 따라옴)
+
+    char* h = hostline;
+    while(*h == ' ' || *h == '\t') h++;
+    h[strcspn(h, "\r\n")] = '\0';
+    // 공백 제거, 줄 끝의 CRLF 제거
+    // 이제 h는 "example.com" 또는 "example.com:8080"의 시작을 가리킴
+
+    char* colon = strchr(h, ':');
+    if(colon){
+      *colon = '\0'; // host 문자열을 여기서 끊는다.
+      strncpy(host, h, MAXLINE-1); //host = "example.com"
+      host[MAXLINE-1] = '\0';
+      strncpy(port, colon+1, 15); // port = "8080"
+      port[15] = '\0';
+    }
+    else{
+      strncpy(host, h, MAXLINE-1); // host = "example.com"
+      host[MAXLINE - 1] = '\0';
+      strcpy(port, "80"); // 포트가 없으면 기본 80
+    }
+
+    strncpy(path, uri, MAXLINE - 1);
+    path[MAXLINE - 1] = '\0';
+  }
+  // uri가 /... 로 시작하면 origin-form이다. 예: GET /index.html HTTP/1.1
+  // 이 경우 호스트 정보가 요청라인에 없으므로 반드시 Host:헤더가 있어야 하고 없으면 400으로 거절
+  // path는 그냥 uri를 그대로 사용
+
+  else{
+    if(parse_uri(uri, host, port, path) < 0){
+      *errmsg = "Proxy couldn't parse URI";
+      return -1;
+    }
+  }
+  // uri가 http://example.com:8080/index.html 같은 absolute-form이면
+  // parse_uri가 알아서 host="example.com", port = "8080"(없으면 "80"), path = "/index.html"로 분해
+  // 여기서는 Host: 헤더가 없더라도 요청라인에 이미 호스트가 있으므로 포워딩에 필요한 정보가 채워짐
+  // (그래도 나중에 원 서버로 보낼 때는 Host: 헤더를 넣어줘야 하니까, 후단에서 have_host 검사하고 추가함)
+  return 0;
 }
 
 //######################################################################################################################################################
@@ -374,288 +1341,3177 @@ static int parse_uri(const char* uri, char* host, char* port, char* path){
 static int forward_request_to_origin(
   int clientfd,
   const char* host, const char* port, const char* path,
-  char header[][MAXLINE], int num_headers)
+  char header[][MAXLINE], int num_headers, bool http11, bool* keepalive, arena_t* arena)
   {
     char cache_key[KEYMAX];
-    snprintf(cache_key, sizeof(cache_key), "%s:%s%s", host, port, path);
+    make_cache_key(cache_key, sizeof(cache_key), host, port, path);
+    uint64_t cache_key_hash = cache_hash(cache_key);
+    // 키 해시는 요청당 한 번만 계산해서 조회와 삽입에 같이 쓴다.
 
-    char* cached = NULL; size_t cached_sz = 0;
-    if(cache_lookup(cache_key, &cached, &cached_sz)){
-      Rio_writen(clientfd, cached, cached_sz);
-      Free(cached);
-      return 0;
+    int state;
+    cache_obj_t* cached = cache_lookup(cache_key, cache_key_hash, &state);
+    if(cached && state == CACHE_STALE_SWR){
+      atomic_fetch_add_explicit(&g_policy -> swr_served, 1, memory_order_relaxed);
+      refresh_in_background(host, port, path, cached);
+      state = CACHE_FRESH;
     }
+    // 만료됐지만 stale-while-revalidate 창 안이면 낡은 사본을 바로 보내고, 갱신은 뒤에서 한 번만 돌린다.
 
-    // 원서버에 TCP 연결
-    int serverfd = Open_clientfd(host, port);
-    if(serverfd < 0) return -1;
-    rio_t s_rio;
-    Rio_readinitb(&s_rio, serverfd);
-    // host: port로 outbound 소켓을 열어 원서버에 접속
-    // 이 소켓을 RIO 버퍼에 묶어서 이후 응답을 편하게 읽도록 준비
-
-    // 원서버로 보낼 요청라인 작성
-    char out[MAXBUF];
-    int n = snprintf(out, sizeof(out), "GET %s HTTP/1.0\r\n", path);
-    Rio_writen(serverfd, out, n);
-    // 프록시는 항상 원서버로 HTTP/1.0을 사용해 단순화(keep-alive, chunked 등 회피)
-    // GET <path> HTTP/1.0\r\n처럼 절대 URI가 아닌 경로(path)로 보낸다.(프록시가 이미 Host로 목적지 알려줄 것)
-
-    // 필수/표준화 헤더 구성
-    bool have_host = false;
-    for(int i = 0; i < num_headers; i++){
-      if(!strncasecmp(header[i], "Host:", 5)){
-        have_host = true;
-        break;
+    flight_t* fill = NULL;
+    bool personal = request_is_personal(header, num_headers);
+    if(personal && (!cached || state == CACHE_STALE)){
+      if(cached) cache_release(cached);
+      cached = NULL;
+      fill = flight_new(cache_key, cache_key_hash);
+    }
+    // Range/If-*/Authorization이 붙은 미스는 테이블에 올리지 않은 전용 fill로 혼자 가져온다(아래에서 캐시에도 넣지 않음).
+    // 만료 사본도 검증자로 쓰지 않는다 -> 클라이언트의 헤더가 그대로 원서버로 가서 그 클라이언트에 맞는 응답(206, 304 등)이 온다.
+    else if(!cached || state == CACHE_STALE){
+      bool leader;
+      fill = flight_join(cache_key, cache_key_hash, &leader);
+      if(!leader){
+        relay_t fr = { .clientfd = clientfd, .client_ok = true, .http11 = http11, .keepalive = *keepalive,
+          .chunk_out = false, .fill = NULL, .sharing = false, .cacheable = false, .complete = false };
+        int frc = flight_stream(fill, &fr);
+        flight_put(fill);
+        if(frc == 0){
+          if(cached) cache_release(cached);
+          *keepalive = fr.keepalive && fr.client_ok;
+          return 0;
+        }
+        cache_obj_t* again = cache_lookup(cache_key, cache_key_hash, NULL);
+        if(again){
+          if(cached) cache_release(cached);
+          cached = again;
+          state = CACHE_FRESH;
+          fill = NULL;
+        }
+        else fill = flight_new(cache_key, cache_key_hash);
       }
     }
-    if(!have_host){
-      if(*port && strcmp(port, "80")){
-        n = snprintf(out, sizeof(out), "Host: %s:%s\r\n", host, port);
+    // 미스거나 만료(원서버 확인 필요)면 같은 키를 이미 가져오고 있는 스레드(리더)가 있는지 본다.
+      // 없으면 내가 리더가 되어 원서버에서 가져오면서 받는 바이트를 fill에 이어 붙인다.
+      // 있으면 팔로워로서 리더가 채우는 중인 응답을 도착하는 대로 따라 읽어 보낸다(원서버 요청 없음, 리더가 끝날 때까지 기다리지도 않음)
+    // 리더가 아무것도 안 채우고 끝났으면(실패했거나 304로 엔트리를 갱신만 함) 팔로워는 -1을 받는다.
+      // 캐시를 한 번 더 보고 신선해졌으면 그걸 보내고, 아니면 테이블에 올리지 않은 자기 전용 fill로 아래에서 직접 가져온다.
+
+    if(fill && !cached && !personal && g_disk.enabled && (cached = disk_load(cache_key, cache_key_hash))){
+      cached = cache_insert(cache_key, cache_key_hash, cached);
+      time_t now = upstream_now();
+      state = cached -> expires > now ? CACHE_FRESH : now < cached -> expires + (time_t)cached -> swr ? CACHE_STALE_SWR : CACHE_STALE;
+      if(state != CACHE_STALE){
+        flight_finish(fill, false);
+        fill = NULL;
       }
-      else{
-        n = snprintf(out, sizeof(out), "Host: %s\r\n", host);
+      if(state == CACHE_STALE_SWR){
+        atomic_fetch_add_explicit(&g_policy -> swr_served, 1, memory_order_relaxed);
+        refresh_in_background(host, port, path, cached);
+        state = CACHE_FRESH;
       }
-      Rio_writen(serverfd, out, n);
-    }
-    // host 헤더 보장
-    // HTTP/1.1 클라이언트가 보냈다면 보통 Host가 있음
-    // 만약 없으면(HTTP/1.0 클라일 수도) 프록시가 필수 Host 헤더를 추가해 원서버가 가상호스트를 식별하도록 함
-
-    n = snprintf(out, sizeof(out), "%s", user_agent_hdr);
-    Rio_writen(serverfd, out, n);
-    n = snprintf(out, sizeof(out), "Connection: close\r\n");
-    Rio_writen(serverfd, out, n);
-    n = snprintf(out, sizeof(out), "Proxy-Connection: close\r\n");
-    Rio_writen(serverfd, out, n);
-    // 표준화 강제 헤더 3종
-    // User-Agent를 과제에서 주어진 표준 문자열로 강제
-    // Connection: close, Proxy-Connection: close로 양쪽 모두 연결을 요청-응답 후 끊도록 만들어
-    // 응답 경계 판단을 간단히(EOF가 응답 끝) 하고
-    // 동시연결 누수를 막는다.
-
-    // 나머지 헤더 전달("hop-by-hop" 및 중복/문제 헤더 제거)
-    for(int i = 0; i < num_headers; i++){
-      if (!strncasecmp(header[i], "Connection:", 11)) continue;
-      if (!strncasecmp(header[i], "Proxy-Connection:", 17)) continue;
-      if (!strncasecmp(header[i], "Keep-Alive:", 11)) continue;
-      if (!strncasecmp(header[i], "Transfer-Encoding:", 18)) continue;
-      if (!strncasecmp(header[i], "TE:", 3)) continue;
-      if (!strncasecmp(header[i], "Trailer:", 8)) continue;
-      if (!strncasecmp(header[i], "Upgrade:", 8)) continue;
-      if (!strncasecmp(header[i], "User-Agent:", 11)) continue;
-      Rio_writen(serverfd, header[i], strlen(header[i]));
-    }
-    Rio_writen(serverfd, "\r\n", 2);
-    // hop-by-hop 헤더(Connection, Proxy-Connection, Keep-Alive, TE, Trailer, Upgrade)는 프록시 구간을 넘기면 안 됨 -> 드롭
-    // Transfer-Encoding도 드롭(HTTP/1.0로 단순화하려고 chunked 등을 피함)
-    // User-Agent는 이미 위에서 우리가 보낸 값이 있으니 중복 방지로 드롭
-    // 나머지는 그대로 원서버로 전달
-    // 나머지 \r\n은 헤더 종료 빈 줄
+    }
+    // 메모리에 없으면(리더만) 디스크 계층을 본다. 있으면 메모리로 올리고(promotion) 메모리 히트처럼 보낸다.
+      // 리더 자리는 내려놓는다 -> 기다리던 팔로워들은 캐시를 다시 보고 방금 올린 엔트리를 받는다.
+      // 디스크 사본도 만료됐으면 리더로 남아 그 사본을 검증자로 원서버에 조건부 요청을 보낸다.
 
+    if(cached && state == CACHE_FRESH){
+      struct iovec* iov = arena_alloc(arena, (cached -> nsegs + 3) * sizeof(struct iovec));
+      int cnt = cache_obj_iov(cached, *keepalive, iov);
+      if(writev_all(clientfd, iov, cnt) < 0) *keepalive = false;
+      cache_release(cached);
+      return 0;
+    }
+    // 히트면 캐시 엔트리를 참조 카운트로 붙잡아 둔 채 헤더와 본문 세그먼트들을 복사 없이 바로 클라이언트에 쓴다.
+    // 헤더 끝에 Connection 헤더만 끼워서 writev 한 번으로 보낸다(캐시된 응답은 항상 Content-Length가 있어 연결을 유지할 수 있음)
+    // 쓰는 도중 다른 스레드가 이 엔트리를 축출해도 우리가 release하기 전까지는 해제되지 않는다.
+
+    relay_t r = { .clientfd = clientfd, .client_ok = true, .http11 = http11, .keepalive = *keepalive,
+      .chunk_out = false, .fill = fill, .sharing = !personal, .cacheable = !personal, .complete = false, .stale = cached };
+    int rc = fetch_from_origin(host, port, path, header, num_headers, cache_key, cache_key_hash, &r, arena);
+    if(rc == 1){
+      struct iovec* iov = arena_alloc(arena, (cached -> nsegs + 3) * sizeof(struct iovec));
+      int cnt = cache_obj_iov(cached, *keepalive, iov);
+      if(writev_all(clientfd, iov, cnt) < 0) r.client_ok = false;
+    }
+    if(cached) cache_release(cached);
+    // 만료 엔트리를 원서버가 304로 확인해 줬으면(rc == 1) 방금 갱신한 캐시 사본을 보낸다(본문은 원서버에서 다시 받지 않음)
+    // 200 등 새 응답이 왔으면 이미 클라이언트로 중계됐고 새 엔트리가 옛 엔트리를 교체했다.
+
+    if(rc < 0) return -1;
+    // 새 연결도 실패(접속 불가/응답 없음) -> 호출자가 502
+    *keepalive = r.keepalive && r.client_ok;
+    return 0;
+}
+
+//######################################################################################################################################################
+static int fetch_from_origin(const char* host, const char* port, const char* path,
+  char header[][MAXLINE], int num_headers, const char* key, uint64_t hash, relay_t* r, arena_t* arena)
+  {
+    size_t req_len;
+    char* req = build_origin_request(host, port, path, header, num_headers, true, r -> stale, arena, &req_len);
+    // 원서버로 보낼 요청(요청라인 + 표준화한 헤더 + 빈 줄)을 아레나의 한 버퍼로 만든다(요청이 끝나면 같이 비워짐)
+    // 만료 엔트리를 확인하는 중이면(r -> stale) 조건부 요청이 된다.
+
+    int rc = -1;
+    bool use_idle = true;
+    while(rc < 0){
+      bool reused;
+      upstream_t* u = upstream_acquire(host, port, use_idle, &reused);
+      if(!u) break;
+      bool reusable = false;
+      if(rio_writen(u -> fd, req, req_len) == (ssize_t)req_len)
+        rc = relay_origin_response(u, r, &reusable);
+      upstream_release(u, reusable);
+      if(!reused) break;
+      use_idle = false;
+    }
+    if(!arena) Free(req);
+    // 풀에 host:port의 유휴 연결이 있으면 재사용하고(연결 수립 왕복과 getaddrinfo 생략), 없으면 새로 연결한다.
+    // 재사용한 연결은 상태 검사를 통과해도 원서버가 바로 그 순간 닫았을 수 있다.
+      // 그래서 클라이언트에 아직 아무것도 안 보낸 채 실패하면(rc < 0) 새 연결로 한 번만 다시 시도한다(GET이라 재전송해도 안전)
+    // 응답을 끝까지 읽었고 원서버가 연결 유지를 허락했으면(reusable) 풀에 반납, 아니면 닫는다.
+
+    flight_t* fill = r -> fill;
+    if(rc == 0 && r -> complete && r -> sharing && r -> cacheable && fill -> len > 0){
+      cache_obj_t* made = cache_insert(key, hash, cache_make_object(fill -> segs, fill -> len));
+      if(made){
+        if(g_disk.enabled) disk_enqueue(made);
+        else cache_release(made);
+      }
+    }
+    // 다 받은 응답을 캐시 형식(Connection 헤더 없음 + Content-Length 보장)으로 정리해서 넣는다.
+    // 디스크 계층이 있으면 들어올 때 한 번 디스크에도 쓴다. 그러면 메모리에서 밀려날 때(demotion) 따로 쓸 게 없고,
+      // 재시작이나 비정상 종료 뒤에도 지금 메모리에 있던 오브젝트까지 디스크에 남아 있다.
+      // 쓰기는 disk_writer 스레드에 넘긴다(내 참조도 같이 넘김) -> 이 요청도, 따라 읽던 팔로워도 디스크 쓰기를 기다리지 않는다.
+
+    flight_finish(fill, rc == 0 && r -> complete && r -> sharing);
+    // 캐시에 넣은 뒤에 테이블에서 빼야, 그 사이에 미스가 난 요청이 원서버로 한 번 더 가지 않는다.
+    // 실패해도 반드시 끝내야 따라 읽던 팔로워들이 깨어난다(304면 팔로워들은 갱신된 캐시를 다시 조회한다)
+    return rc;
+}
+// 리더로서 원서버에 요청하고 응답을 r로 중계한다(클라이언트 + fill), 다 받았으면 캐시에 넣는다.
+// 반환: -1 = 응답을 못 받음(아무것도 안 보냄), 0 = 중계함, 1 = 304로 r -> stale을 갱신함(아무것도 안 보냄)
+
+//######################################################################################################################################################
+static void refresh_in_background(const char* host, const char* port, const char* path, cache_obj_t* o){
+  if(atomic_exchange(&o -> refreshing, 1)) return;
+  // 이미 이 엔트리를 갱신하는 스레드가 있으면 그걸로 충분하다(낡은 사본을 받는 요청이 몰려도 원서버 요청은 하나)
+
+  refresh_arg_t* a = Malloc(sizeof(refresh_arg_t));
+  strcpy(a -> host, host);
+  strcpy(a -> port, port);
+  strcpy(a -> path, path);
+  a -> o = o;
+  atomic_fetch_add(&o -> refcnt, 1);
+  pthread_t tid;
+  if(pthread_create(&tid, NULL, refresh_thread, a)){
+    atomic_store(&o -> refreshing, 0);
+    cache_release(o);
+    Free(a);
+    return;
+  }
+  pthread_detach(tid);
+  // 갱신 스레드가 엔트리 참조를 하나 따로 잡는다(요청 스레드가 사본을 다 보내고 release해도 갱신이 끝날 때까지 유지)
+}
+// stale-while-revalidate: 요청은 낡은 사본으로 바로 응답하고, 원서버 확인은 분리된(detached) 스레드가 한다.
+
+//######################################################################################################################################################
+static void* refresh_thread(void* arg){
+  refresh_arg_t* a = arg;
+  cache_obj_t* o = a -> o;
+  bool leader;
+  flight_t* fill = flight_join(o -> key -> str, o -> hash, &leader);
+  if(leader){
+    relay_t r = { .clientfd = -1, .client_ok = false, .http11 = false, .keepalive = false,
+      .chunk_out = false, .fill = fill, .sharing = true, .cacheable = true, .complete = false, .stale = o };
+    fetch_from_origin(a -> host, a -> port, a -> path, NULL, 0, o -> key -> str, o -> hash, &r, NULL);
+  }
+  else flight_put(fill);
+  // 같은 키를 이미 다른 요청이 가져오고 있으면 그 결과가 엔트리를 교체하므로 따로 가져오지 않는다.
+  // 리더가 되면 클라이언트 없이(client_ok = false) 조건부 요청을 보낸다:
+    // 304면 엔트리의 신선도만 늘리고, 200이면 fill로 받아 새 엔트리로 교체한다(그 사이 미스가 난 요청은 팔로워로 따라 읽는다)
+  // 클라이언트 헤더는 없으므로 build_origin_request가 Host와 표준 헤더만 만든다.
+
+  atomic_store(&o -> refreshing, 0);
+  cache_release(o);
+  Free(a);
+  return NULL;
+}
+// 백그라운드 갱신 스레드(엔트리당 하나)
+
+//######################################################################################################################################################
+static int relay_origin_response(upstream_t* u, relay_t* r, bool* reusable){
+  char line[MAXLINE];
+  ssize_t n;
+  int minor, status;
+  *reusable = false;
+
+  do{
+    if((n = rio_readlineb(&u -> rio, line, MAXLINE)) <= 0) return -1;
+    if(sscanf(line, "HTTP/1.%d %d", &minor, &status) != 2) return -1;
+    if(status / 100 == 1){
+      while((n = rio_readlineb(&u -> rio, line, MAXLINE)) > 0 && strcmp(line, "\r\n") && strcmp(line, "\n"));
+      if(n <= 0) return -1;
+    }
+  } while(status / 100 == 1);
+  // 상태줄 "HTTP/1.x NNN ..." 읽기. 1xx(중간 응답)는 헤더까지 버리고 다음 상태줄을 읽는다.
+  // 여기까지는 클라이언트에 아무것도 안 보냈으므로 실패하면 -1(호출자가 새 연결로 재시도하거나 502)
+  if(r -> stale && status == 304) return relay_not_modified(u, r -> stale, minor, reusable);
+  // 조건부 요청에 304: 캐시 사본이 아직 유효하다(클라이언트에는 호출자가 캐시 사본을 보낸다)
+
+  bool saw_close = false, saw_keepalive = false, chunked = false, other_te = false, no_store = false;
+  long long clen = -1;
+  relay_out(r, line, n);
+  while((n = rio_readlineb(&u -> rio, line, MAXLINE)) > 0){
+    if(!strcmp(line, "\r\n") || !strcmp(line, "\n")) break;
+    if(!strncasecmp(line, "Content-Length:", 15)){
+      char* end;
+      long long v = strtoll(line + 15, &end, 10);
+      while(*end == ' ' || *end == '\t') end++;
+      if(v < 0 || end == line + 15 || (*end != '\r' && *end != '\n') || (clen >= 0 && clen != v)) saw_close = true, clen = -1;
+      else clen = v;
+      // 숫자가 아니거나 서로 다른 값이 여러 번 오면 길이를 믿을 수 없으니 EOF까지 읽고 연결은 버린다.
+    }
+    else if(!strncasecmp(line, "Transfer-Encoding:", 18)){
+      chunked = header_has_token(line + 18, "chunked");
+      if(!chunked) saw_close = true, other_te = true;
+      else continue;
+      // chunked는 프록시가 풀어서(de-chunk) 보내므로 헤더를 뺀다. 모르는 인코딩은 그대로 두고 EOF까지 읽는다.
+    }
+    else if(!strncasecmp(line, "Connection:", 11)){
+      if(header_has_token(line + 11, "close")) saw_close = true;
+      if(header_has_token(line + 11, "keep-alive")) saw_keepalive = true;
+      continue;
+    }
+    else if(is_hop_header(line)){
+      continue;
+    }
+    else if(!strncasecmp(line, "Cache-Control:", 14)){
+      cache_control_t cc = { .max_age = -1, .s_maxage = -1, .swr = -1 };
+      parse_cache_control(line + 14, &cc);
+      if(cc.no_store || cc.priv) no_store = true;
+    }
+    relay_out(r, line, n);
+  }
+  // 응답 헤더를 한 줄씩 읽으며 프레이밍 정보(Content-Length, chunked, Connection)를 뽑고
+  // 원서버-프록시 구간에만 의미 있는 hop-by-hop 헤더는 클라이언트로 넘기지 않는다.
+  // 캐시에 넣을 수 없다고 밝힌 응답(no-store/private)인지도 봐 둔다(본문을 splice로 넘길 수 있는지 판단)
+  if(n <= 0){
+    r -> cacheable = false;
+    r -> keepalive = false;
+    return 0;
+  }
+  // 헤더 도중에 끊김: 상태줄은 이미 보냈으니 그대로 끝낸다(연결은 버림)
+
+  bool no_body = status == 204 || status == 304;
+  bool framed = no_body || clen >= 0;
+  if(r -> sharing && status != 200) flight_detach(r -> fill);
+  else if(r -> sharing) flight_header(r -> fill, r -> fill -> len, framed, !other_te);
+  // 헤더를 다 받았으니 팔로워들이 헤더를 보내기 시작할 수 있게 헤더 끝 위치와 프레이밍을 알린다.
+  // 200이 아니면(206, 304, 401, 에러 등) 팔로워에게 나눠 주지 않는다: 따라 읽던 팔로워는 떼어 내 각자 가져가게 하고
+  // fill에는 계속 모은다(404/301처럼 캐시할 수 있는 응답이면 끝나고 캐시에 들어간다).
+  relay_finish_headers(r, framed, !other_te);
+  relay_out(r, "\r\n", 2);
+  // Connection / Transfer-Encoding 헤더는 클라이언트에게만 보내고 캐시 사본에는 넣지 않는다(보낼 때마다 연결에 맞게 붙임)
+
+  bool persistent = !saw_close && (minor >= 1 || saw_keepalive);
+  // HTTP/1.1은 Connection: close가 없으면 유지, HTTP/1.0은 Connection: keep-alive가 있어야 유지
+
+  bool zero_copy = !no_body && !chunked && !r -> chunk_out && r -> client_ok &&
+    (!r -> sharing || no_store || (clen >= 0 && r -> fill -> len + (size_t)clen > g_max_object));
+  if(zero_copy && r -> sharing){
+    zero_copy = flight_unshare(r -> fill);
+    if(zero_copy) r -> sharing = r -> cacheable = false;
+  }
+  // 본문을 캐시에 넣지 않을 응답(no-store/private, Content-Length가 오브젝트 한도를 넘음)이고 따라 읽는 팔로워도 없으면
+  // fill에 모으지 않고 splice로 소켓에서 소켓으로 바로 넘긴다(본문이 사용자 공간 버퍼를 거치지 않음)
+  // 팔로워가 있으면 그들이 fill에서 읽어야 하므로 기존 복사 경로를 쓴다. 클라이언트에게 청크로 다시 묶어야 하는 본문도 복사 경로
+
+  int rc = 0;
+  if(no_body){
+    // 본문 없음
+  }
+  else if(zero_copy){
+    rc = relay_splice(u, r, clen);
+    if(clen < 0) persistent = false;
+  }
+  else if(chunked){
+    rc = relay_chunked_body(u, r);
+  }
+  else if(clen >= 0){
+    rc = relay_body(u, r, (size_t)clen);
+  }
+  else{
+    char buf[MAXBUF];
+    while(relay_wanted(r) && (n = rio_readnb(&u -> rio, buf, sizeof(buf))) > 0) relay_body_out(r, buf, n);
+    if(n != 0) rc = -1;
+    persistent = false;
+  }
+  if(rc == 0 && r -> chunk_out) relay_send(r, "0\r\n\r\n", 5);
+  // 본문의 끝 찾기: Content-Length면 그 바이트 수만큼, chunked면 길이 0인 청크까지, 둘 다 없으면 원서버가 닫을 때(EOF)까지
+  // EOF로 끝나는 응답은 연결을 다시 쓸 수 없다.
+  // 클라이언트가 먼저 끊어도 팔로워가 따라 읽고 있거나 캐시에 넣을 수 있으면 끝까지 받는다(relay_wanted)
+
+  if(rc < 0){
+    r -> cacheable = false;
+    r -> keepalive = false;
+    return 0;
+  }
+  // 원서버가 본문 중간에 끊었거나 더 받을 이유가 없어 멈춤 -> 캐시에 넣지 않고 원서버 연결도 버린다(응답을 다 안 읽었으므로)
+  r -> complete = true;
+  if(!r -> client_ok) r -> keepalive = false;
+  *reusable = persistent;
+  return 0;
+}
+// 원서버 응답 하나를 정확히 그 끝까지 읽어 클라이언트로 중계한다.
+// 응답 경계를 알아야 같은 연결로 다음 요청을 보낼 수 있으므로(EOF에 기대지 않음) 여기서 HTTP/1.1 프레이밍을 처리한다.
+// 반환: -1 = 클라이언트에 아무것도 안 보낸 채 실패, 0 = 중계함(*reusable: 연결을 풀에 돌려도 되는지)
+
+//######################################################################################################################################################
+static int relay_body(upstream_t* u, relay_t* r, size_t n){
+  char buf[MAXBUF];
+  while(n > 0 && relay_wanted(r)){
+    ssize_t m = rio_readnb(&u -> rio, buf, n < sizeof(buf) ? n : sizeof(buf));
+    if(m <= 0) return -1;
+    relay_body_out(r, buf, (size_t)m);
+    n -= (size_t)m;
+  }
+  return n == 0 ? 0 : -1;
+}
+// 본문 n바이트를 정확히 읽어 중계(그 전에 EOF가 오거나 더 받을 이유가 없어 멈추면 -1)
+
+//######################################################################################################################################################
+static int relay_splice(upstream_t* u, relay_t* r, long long n){
+  size_t have = u -> rio.rio_cnt;
+  if(n >= 0 && have > (size_t)n) have = (size_t)n;
+  if(have > 0){
+    relay_send(r, u -> rio.rio_bufptr, have);
+    u -> rio.rio_bufptr += have;
+    u -> rio.rio_cnt -= have;
+    if(n >= 0) n -= have;
+  }
+  // 헤더를 읽으면서 rio 버퍼에 이미 들어온 본문 앞부분은 버퍼에서 바로 보낸다(splice는 소켓에 남은 바이트만 옮긴다)
+  if(!r -> client_ok) return -1;
+
+  int p[2];
+  if(pipe(p) < 0){
+    if(n >= 0) return relay_body(u, r, (size_t)n);
     char buf[MAXBUF];
     ssize_t m;
+    while(r -> client_ok && (m = rio_readnb(&u -> rio, buf, sizeof(buf))) > 0) relay_send(r, buf, m);
+    return m == 0 ? 0 : -1;
+  }
+  // 소켓 -> 소켓은 직접 안 되므로 파이프를 사이에 둔다(파이프 버퍼의 페이지를 옮길 뿐 데이터는 복사하지 않음)
+  // 응답마다 만들고 닫는다(splice 대상은 큰 응답이라 파이프 두 개 만드는 비용은 무시할 만하다)
 
-    char* obj = Malloc(MAX_OBJECT_SIZE);
-    size_t obj_sz = 0;
-    int cacheable = 1;
+  int rc = 0;
+  uint64_t moved = have;
+  while(n != 0){
+    size_t want = n >= 0 && n < SPLICE_CHUNK ? (size_t)n : SPLICE_CHUNK;
+    ssize_t k = syscall(SYS_splice, u -> fd, NULL, p[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if(k < 0 && errno == EINTR) continue;
+    if(k <= 0){
+      rc = k == 0 && n < 0 ? 0 : -1;
+      break;
+    }
+    // 원서버 소켓 -> 파이프. 0이면 원서버가 닫음(길이 없는 본문이면 정상 끝, 길이가 남았으면 잘린 응답)
 
-    while((m = Rio_readnb(&s_rio, buf, sizeof(buf))) > 0){
-      if(rio_writen(clientfd, buf, m) < 0){ 
-        cacheable = 0;
+    if(n > 0) n -= k;
+    moved += k;
+    while(k > 0){
+      ssize_t w = syscall(SYS_splice, p[0], NULL, r -> clientfd, NULL, (size_t)k, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if(w < 0 && errno == EINTR) continue;
+      if(w <= 0){
+        r -> client_ok = false;
         break;
-      } 
-    //EPIPE 등 발생 시 해당 연결만 종료
-    // 원서버 응답을 클라이언트로 그대로 중계
-    // 원서버 응답(헤더+바디)을 그대로 스트리밍 복사
-    // 위에서 Connection: close를 강제했기 때문에 원서버가 응답을 보내고 연결을 닫으면(EOF) 루프가 종료
-    // -> 응답 끝을 쉽게 인지한다.
-    
-    if(cacheable){
-      if(obj_sz + (size_t)m <= MAX_OBJECT_SIZE){
-        memcpy(obj + obj_sz, buf, (size_t)m);
-        obj_sz += (size_t)m;
-      }
-      else{
-        cacheable = 0;
       }
+      k -= w;
     }
+    if(!r -> client_ok){
+      rc = -1;
+      break;
+    }
+    // 파이프 -> 클라이언트 소켓. 클라이언트가 끊으면 더 받을 이유가 없으니 멈춘다(원서버 연결은 호출자가 버린다)
+  }
+  close(p[0]);
+  close(p[1]);
+  atomic_fetch_add_explicit(&g_upstream.spliced, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&g_upstream.spliced_bytes, moved, memory_order_relaxed);
+  return rc;
+}
+// 본문을 splice로 중계한다(n < 0이면 원서버가 닫을 때까지). 캐시에도 팔로워에게도 안 가는 본문 전용(r -> sharing == false)
+// 반환: relay_body와 같다(0 = 끝까지 넘김, -1 = 잘렸거나 클라이언트가 끊음)
+
+//######################################################################################################################################################
+static int relay_chunked_body(upstream_t* u, relay_t* r){
+  char line[MAXLINE];
+  ssize_t n;
+  while(1){
+    if((n = rio_readlineb(&u -> rio, line, MAXLINE)) <= 0) return -1;
+    char* end;
+    unsigned long long sz = strtoull(line, &end, 16);
+    if(end == line) return -1;
+    if(sz == 0) break;
+    if(relay_body(u, r, (size_t)sz) < 0) return -1;
+    if((n = rio_readlineb(&u -> rio, line, MAXLINE)) <= 0) return -1;
+    if(strcmp(line, "\r\n") && strcmp(line, "\n")) return -1;
+  }
+  // "<16진수 길이>[;확장]\r\n<데이터>\r\n"을 반복. 청크 틀은 벗겨내고 데이터만 넘긴다.
 
-    // Close(serverfd);
-    // return 0;
-    // // 원서버 소켓 닫고 종료(클라이언트 소켓은 바깥 handle_client에서 닫음)
+  while((n = rio_readlineb(&u -> rio, line, MAXLINE)) > 0){
+    if(!strcmp(line, "\r\n") || !strcmp(line, "\n")) return 0;
   }
-  if(cacheable && obj_sz > 0){
-    cache_insert(cache_key, obj, obj_sz);
+  return -1;
+  // 길이 0 청크 뒤의 트레일러 헤더는 버리고 빈 줄까지 읽어야 다음 응답의 시작에 정확히 맞춰진다.
+}
+// chunked 본문을 풀어서(de-chunk) 중계한다.
+// 클라이언트에게 다시 chunked로 보낼지(chunk_out)는 relay_body_out이 정하고, 캐시 사본에는 푼 본문만 남는다.
+
+//######################################################################################################################################################
+static int relay_not_modified(upstream_t* u, cache_obj_t* o, int minor, bool* reusable){
+  char line[MAXLINE], expires[64] = "", date[64] = "";
+  ssize_t n;
+  cache_control_t cc = { .max_age = -1, .s_maxage = -1, .swr = -1 };
+  long age = 0;
+  bool saw_close = false, saw_keepalive = false;
+  while((n = rio_readlineb(&u -> rio, line, MAXLINE)) > 0){
+    if(!strcmp(line, "\r\n") || !strcmp(line, "\n")) break;
+    if(!strncasecmp(line, "Cache-Control:", 14)) parse_cache_control(line + 14, &cc);
+    else if(!strncasecmp(line, "Expires:", 8)) snprintf(expires, sizeof(expires), "%s", line + 8);
+    else if(!strncasecmp(line, "Date:", 5)) snprintf(date, sizeof(date), "%s", line + 5);
+    else if(!strncasecmp(line, "Age:", 4)) age = atol(line + 4);
+    else if(!strncasecmp(line, "Connection:", 11)){
+      if(header_has_token(line + 11, "close")) saw_close = true;
+      if(header_has_token(line + 11, "keep-alive")) saw_keepalive = true;
+    }
+  }
+  if(n <= 0) return -1;
+  // 304의 헤더를 읽으며 새 신선도 정보만 뽑는다(줄 버퍼를 재사용하므로 Expires/Date는 복사해 둔다)
+  // 헤더 도중에 끊겨도 클라이언트에는 아직 아무것도 안 보냈으니 -1(새 연결로 재시도)
+
+  *reusable = !saw_close && (minor >= 1 || saw_keepalive);
+  cache_refresh(o, &cc, expires[0] ? expires : NULL, date[0] ? date : NULL, age);
+  atomic_fetch_add_explicit(&g_policy -> revalidated, 1, memory_order_relaxed);
+  return 1;
+  // 304는 본문이 없으므로 헤더 뒤에 바로 연결을 풀에 돌려줄 수 있다.
+}
+// 조건부 요청에 대한 304 처리: 캐시 엔트리를 제자리에서 갱신한다(본문을 다시 받지 않음). 반환 1
+
+//######################################################################################################################################################
+static void relay_out(relay_t* r, const char* buf, size_t n){
+  relay_keep(r, buf, n);
+  relay_send(r, buf, n);
+}
+// fill에 붙이고(팔로워들이 먼저 가져갈 수 있게) 클라이언트로 쓴다(스레드 모드 중계의 기본 단위)
+
+//######################################################################################################################################################
+static void relay_send(relay_t* r, const char* buf, size_t n){
+  if(r -> client_ok && rio_writen(r -> clientfd, (void*)buf, n) < 0){
+    r -> client_ok = false;
+  }
+  //EPIPE 등 발생 시 해당 연결만 종료(원서버에서 받는 것은 relay_wanted가 정한다)
+}
+// 클라이언트로만 쓴다(연결마다 달라지는 Connection/Transfer-Encoding 헤더, 청크 틀)
+
+//######################################################################################################################################################
+static void relay_keep(relay_t* r, const char* buf, size_t n){
+  if(!r -> sharing) return;
+  if(r -> fill -> len + n > g_max_object){
+    r -> cacheable = false;
+    if(atomic_load(&g_flights.fill_bytes) > FILL_BUDGET && flight_unshare(r -> fill)) r -> sharing = false;
+  }
+  // 캐시 한도를 넘으면 더는 캐시할 수 없다. 그래도 늦게 온 같은 키의 요청이 합류할 수 있게 계속 붙이되,
+  // 채우기 메모리가 예산을 넘었고 따라 읽는 팔로워도 없으면 테이블에서 빼고 붙이기를 그만둔다(큰 응답을 괜히 붙잡지 않게)
+  if(r -> sharing && flight_append(r -> fill, buf, n) < 0) r -> sharing = false;
+  // FILL_MAX_SIZE를 넘으면 flight_append가 채우기를 중단시킨다(팔로워는 연결을 닫고, 리더 자신은 계속 중계)
+}
+// fill(팔로워가 따라 읽고 캐시 사본이 될 응답)에만 붙인다.
+
+//######################################################################################################################################################
+static void relay_body_out(relay_t* r, const char* buf, size_t n){
+  if(!r -> chunk_out){
+    relay_out(r, buf, n);
+    return;
+  }
+  char head[32];
+  int hl = snprintf(head, sizeof(head), "%zx\r\n", n);
+  struct iovec iov[3] = { { head, (size_t)hl }, { (void*)buf, n }, { "\r\n", 2 } };
+  relay_keep(r, buf, n);
+  if(r -> client_ok && writev_all(r -> clientfd, iov, 3) < 0){
+    r -> client_ok = false;
+  }
+  // 청크 하나("<길이>\r\n<데이터>\r\n")를 writev 한 번으로 보낸다(작은 write 여러 번으로 패킷이 쪼개지지 않게)
+}
+// 본문 바이트 중계. chunk_out이면 클라이언트에게는 청크로 묶어 보내고 fill에는 데이터만 넣는다.
+
+//######################################################################################################################################################
+static void relay_finish_headers(relay_t* r, bool framed, bool can_chunk){
+  if(!framed){
+    if(can_chunk && r -> http11 && r -> keepalive){
+      r -> chunk_out = true;
+      relay_send(r, "Transfer-Encoding: chunked\r\n", 28);
+    }
+    else{
+      r -> keepalive = false;
+    }
+  }
+  if(r -> keepalive) relay_send(r, "Connection: keep-alive\r\n", 24);
+  else relay_send(r, "Connection: close\r\n", 19);
+}
+// 클라이언트 쪽 응답 끝 알리기(리더와 팔로워가 같이 쓴다, 뒤에 빈 줄은 호출자가 보낸다)
+  // 본문이 없거나 Content-Length가 있으면 그대로 유지 가능
+  // 길이를 모르는 본문(원서버의 chunked, EOF까지)은 HTTP/1.1 클라이언트에게 chunked로 다시 묶어서 보내고(유지 가능)
+  // HTTP/1.0 클라이언트거나 모르는 Transfer-Encoding이면 닫아서 끝을 알린다.
+
+//######################################################################################################################################################
+static bool relay_wanted(relay_t* r){
+  if(r -> client_ok) return true;
+  return r -> sharing && (r -> cacheable || atomic_load(&r -> fill -> refs) > 1);
+}
+// 원서버에서 계속 받을 이유가 있는지: 내 클라이언트가 살아 있거나, 캐시에 넣을 수 있거나, 따라 읽는 팔로워가 있으면
+
+//######################################################################################################################################################
+static bool header_has_token(const char* value, const char* token){
+  size_t tlen = strlen(token);
+  const char* v = value;
+  while(1){
+    while(*v == ' ' || *v == '\t' || *v == ',') v++;
+    const char* end = v;
+    while(*end && *end != ',' && *end != '\r' && *end != '\n') end++;
+    const char* e = end;
+    while(e > v && (e[-1] == ' ' || e[-1] == '\t')) e--;
+    if((size_t)(e - v) == tlen && !strncasecmp(v, token, tlen)) return true;
+    if(*end != ',') return false;
+    v = end;
+  }
+}
+// "Connection: keep-alive, Upgrade"처럼 쉼표로 나열된 헤더 값에 token이 있는지(대소문자 무시)
+
+//######################################################################################################################################################
+static bool is_hop_header(const char* line){
+  return !strncasecmp(line, "Connection:", 11) || !strncasecmp(line, "Proxy-Connection:", 17) ||
+    !strncasecmp(line, "Keep-Alive:", 11) || !strncasecmp(line, "TE:", 3) ||
+    !strncasecmp(line, "Trailer:", 8) || !strncasecmp(line, "Upgrade:", 8);
+}
+// hop-by-hop 헤더(연결 한 구간에만 의미가 있어 프록시가 넘기면 안 되는 헤더)인지
+// 요청을 원서버로 넘길 때, 응답을 클라이언트로 넘길 때, 캐시에 넣을 때 같은 목록을 쓴다.
+
+//######################################################################################################################################################
+static bool request_is_personal(char header[][MAXLINE], int num_headers){
+  for(int i = 0; i < num_headers; i++){
+    if(!strncasecmp(header[i], "Range:", 6) || !strncasecmp(header[i], "If-", 3) ||
+      !strncasecmp(header[i], "Authorization:", 14)) return true;
+  }
+  return false;
+}
+// 원서버 응답이 이 클라이언트의 요청에만 맞을 수 있는지(Range -> 206, If-* -> 304/412, Authorization -> 그 사용자만 볼 수 있는 응답)
+// 이런 미스는 다른 클라이언트와 합치지도(리더/팔로워), 캐시에 넣지도 않고 혼자 가져온다.
+
+//######################################################################################################################################################
+static int writev_all(int fd, struct iovec* iov, int cnt){
+  while(cnt > 0){
+    ssize_t n = writev(fd, iov, cnt < IOV_MAX ? cnt : IOV_MAX);
+    if(n < 0){
+      if(errno == EINTR) continue;
+      return -1;
+    }
+    iov_advance(iov, &cnt, (size_t)n);
   }
-  Free(obj);
-  
-  Close(serverfd);
   return 0;
 }
+// iov 조각들을 끝까지 쓴다(rio_writen의 writev 버전, iov 배열은 쓴 만큼 앞으로 당겨진다)
 
 //######################################################################################################################################################
-static void* worker(void* arg){
-  int connfd = *((int*)arg);
-  // pthread_create로 스레드를 만들때 connfdp(클라이언트 소켓 fd를 답은 int*)를 넘겨줬다.
-  // arg는 void* 타입으로 넘어오므로 (int*)로 캐스팅해서 역참조(*)하면 실제 fd 값이 나온다.
-  // connfd에 클라이언트와 연결된 소켓 번호가 들어간다.
-  Free(arg);
-  //Malloc으로 동적 할당했던 arg를 더 이상 안쓰니까 Free로 해제해준다. -> 메모리 누수 방지
+static void iov_advance(struct iovec* iov, int* cnt, size_t n){
+  int i = 0;
+  while(i < *cnt && n >= iov[i].iov_len){
+    n -= iov[i].iov_len;
+    i++;
+  }
+  memmove(iov, iov + i, (*cnt - i) * sizeof(struct iovec));
+  *cnt -= i;
+  if(*cnt > 0){
+    iov[0].iov_base = (char*)iov[0].iov_base + n;
+    iov[0].iov_len -= n;
+  }
+}
+// writev가 n바이트만 썼을 때 다 쓴 조각은 빼고 걸친 조각은 앞부분을 잘라 낸다(블로킹/논블로킹 쓰기가 같이 사용)
 
-  handle_client(connfd);
-  // 클라이언트의 HTTP 요청을 읽고 원 서버에 요청을 전달하고 응답을 받아 클라이언트에 다시 보내주는 역할
-  // 프록시 서버의 핵심 로직이 들어있는 부분
-  // worker 스레드가 맡은 하나의 연결 처리가 여기서 이뤄진다.
-  Close(connfd);
-  // 클라이언트 요청이 다 처리되면 소켓을 닫아서 연결을 정리
-  // 소켓이 계속 열려있을 경우 발생하는 파일 스크립터 누수 방지
+//######################################################################################################################################################
+static void upstream_init(void){
+  memset(&g_upstream, 0, sizeof(g_upstream));
+  pthread_mutex_init(&g_upstream.lock, NULL);
+  g_upstream.last_sweep = upstream_now();
+}
+
+//######################################################################################################################################################
+static time_t upstream_now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+// 유휴 시간 계산용 시계(초). 벽시계(time)는 시스템 시간 변경에 따라 되돌아갈 수 있어서 단조 시계를 쓴다.
+
+//######################################################################################################################################################
+static upstream_host_t** upstream_host_slot(const char* key, uint64_t hash){
+  upstream_host_t** hp = &g_upstream.buckets[hash % UPSTREAM_BUCKETS];
+  while(*hp && ((*hp) -> hash != hash || strcmp((*hp) -> key, key))) hp = &(*hp) -> next;
+  return hp;
+}
+// key의 풀을 가리키는 링크(없으면 체인 끝의 NULL 링크)를 돌려준다 -> 찾기/추가/삭제를 같은 포인터로 처리(락 잡고 호출)
+
+//######################################################################################################################################################
+static upstream_t* upstream_acquire(const char* host, const char* port, bool use_idle, bool* reused){
+  char key[MAXLINE + 16];
+  snprintf(key, sizeof(key), "%s:%s", host, port);
+  uint64_t hash = cache_hash(key);
+  *reused = false;
+
+  while(use_idle){
+    upstream_t* u = NULL;
+    pthread_mutex_lock(&g_upstream.lock);
+    upstream_host_t** hp = upstream_host_slot(key, hash);
+    upstream_host_t* h = *hp;
+    if(h){
+      upstream_prune(h, upstream_now());
+      u = h -> idle;
+      if(u){
+        h -> idle = u -> next;
+        h -> nidle--;
+        g_upstream.nidle--;
+      }
+      if(!h -> idle){
+        *hp = h -> next;
+        Free(h -> key);
+        Free(h);
+      }
+    }
+    pthread_mutex_unlock(&g_upstream.lock);
+    if(!u) break;
+
+    if(upstream_alive(u)){
+      atomic_fetch_add(&g_upstream.reused, 1);
+      *reused = true;
+      return u;
+    }
+    atomic_fetch_add(&g_upstream.expired, 1);
+    upstream_close(u);
+  }
+  // 가장 최근에 반납된 유휴 연결부터 꺼내서 상태 검사(락 밖에서). 죽은 연결이면 닫고 다음 것을 본다.
+
+  int fd = open_clientfd((char*)host, (char*)port);
+  if(fd < 0) return NULL;
+  upstream_t* u = Malloc(sizeof(upstream_t));
+  u -> fd = fd;
+  Rio_readinitb(&u -> rio, fd);
+  u -> key = Malloc(strlen(key) + 1);
+  strcpy(u -> key, key);
+  u -> hash = hash;
+  u -> next = NULL;
+  atomic_fetch_add(&g_upstream.opened, 1);
+  return u;
+  // 쓸 만한 유휴 연결이 없으면 새로 연결한다.
+  // 프로세스를 끝내 버리는 Open_clientfd 대신 open_clientfd를 써서 접속 실패는 이 요청의 502로만 끝나게 한다.
+}
+// host:port로 가는 연결 하나를 얻는다(use_idle이 false면 풀을 건너뛰고 항상 새 연결)
+// *reused: 풀에서 꺼낸 연결인지(재시도 판단에 사용)
+
+//######################################################################################################################################################
+static void upstream_release(upstream_t* u, bool reusable){
+  if(!reusable || u -> rio.rio_cnt > 0){
+    upstream_close(u);
+    return;
+  }
+  // 응답을 끝까지 정확히 못 읽었거나 응답 뒤에 읽지 않은 바이트가 남아 있으면 다음 응답과 섞이므로 버린다.
+
+  time_t now = upstream_now();
+  bool keep = false;
+  pthread_mutex_lock(&g_upstream.lock);
+  if(now != g_upstream.last_sweep){
+    upstream_sweep(now);
+    g_upstream.last_sweep = now;
+  }
+  upstream_host_t** hp = upstream_host_slot(u -> key, u -> hash);
+  upstream_host_t* h = *hp;
+  if((h ? h -> nidle : 0) < UPSTREAM_MAX_IDLE_PER_HOST && g_upstream.nidle < UPSTREAM_MAX_IDLE){
+    if(!h){
+      h = Calloc(1, sizeof(upstream_host_t));
+      h -> key = Malloc(strlen(u -> key) + 1);
+      strcpy(h -> key, u -> key);
+      h -> hash = u -> hash;
+      *hp = h;
+    }
+    u -> idle_since = now;
+    u -> next = h -> idle;
+    h -> idle = u;
+    h -> nidle++;
+    g_upstream.nidle++;
+    keep = true;
+  }
+  pthread_mutex_unlock(&g_upstream.lock);
+  if(!keep) upstream_close(u);
+  // 한도 안이면 host:port 풀의 맨 앞에 넣고, 넘치면 닫는다.
+  // 반납할 때 초당 한 번 전체 풀을 훑어 만료된 연결을 닫는다(다시 요청이 안 오는 원서버의 연결도 정리되게)
+}
+// 연결을 다 쓰고 돌려준다(reusable이면 풀에 보관, 아니면 닫기)
+
+//######################################################################################################################################################
+static void upstream_prune(upstream_host_t* h, time_t now){
+  upstream_t** pp = &h -> idle;
+  while(*pp && now - (*pp) -> idle_since < UPSTREAM_IDLE_TIMEOUT) pp = &(*pp) -> next;
+  upstream_t* u = *pp;
+  *pp = NULL;
+  while(u){
+    upstream_t* next = u -> next;
+    h -> nidle--;
+    g_upstream.nidle--;
+    atomic_fetch_add(&g_upstream.expired, 1);
+    upstream_close(u);
+    u = next;
+  }
+}
+// 리스트는 반납 시각 역순이므로 처음으로 만료된 연결부터 끝까지 잘라서 닫는다(락 잡고 호출)
+
+//######################################################################################################################################################
+static void upstream_sweep(time_t now){
+  for(int i = 0; i < UPSTREAM_BUCKETS; i++){
+    upstream_host_t** hp = &g_upstream.buckets[i];
+    while(*hp){
+      upstream_host_t* h = *hp;
+      upstream_prune(h, now);
+      if(!h -> idle){
+        *hp = h -> next;
+        Free(h -> key);
+        Free(h);
+      }
+      else{
+        hp = &h -> next;
+      }
+    }
+  }
+}
+// 모든 원서버 풀의 만료 연결을 닫고 빈 풀은 해제한다(락 잡고 호출)
+
+//######################################################################################################################################################
+static bool upstream_alive(upstream_t* u){
+  char c;
+  ssize_t n = recv(u -> fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+// 재사용 전 상태 검사: 읽을 게 없어야(EAGAIN) 정상
+// 0이면 원서버가 이미 닫았고(FIN), 데이터가 있으면 요청도 안 보냈는데 온 바이트(타임아웃 에러 응답 등)이며, 그 밖은 리셋
+// MSG_PEEK라 소켓에서 아무것도 소비하지 않는다.
+
+//######################################################################################################################################################
+static void upstream_close(upstream_t* u){
+  Close(u -> fd);
+  Free(u -> key);
+  Free(u);
+}
+
+//######################################################################################################################################################
+static void* pool_worker(void* arg){
+  while(1){
+    int connfd = sbuf_remove(&g_sbuf);
+    // 큐에 fd가 들어올 때까지 잠들어 있다가 하나 꺼낸다.
+    handle_client(connfd);
+    Close(connfd);
+    // 처리 방식은 연결당 스레드 모드(worker)와 같고, 끝나면 종료하지 않고 다음 연결을 기다린다.
+  }
   return NULL;
 }
 
 //######################################################################################################################################################
-static void dll_push_front(cache_obj_t *o){
-  o -> prev = NULL;
-  // 새로 들어오는 노드 o는 리스트 맨 앞(head)에 붙일 예정
-  // 따라서 o -> prev는 NULL(앞쪽에 아무것도 없음)
-  o -> next = g_cache.head;
-  // o -> next는 기존의 head 노드를 가리킨다.
-  if(g_cache.head) g_cache.head -> prev = o;
-  // 기존에 head가 있었다면 그 head의 앞쪽(prev)이 새 노드 o를 가리키도록 수정한다.
-  // 새 노드와 기존 노드를 양방향으로 연결한다.
-  g_cache.head = o;
-  // 이제 캐시의 head를 새 노드 o로 교체한다.
-  // 새 노드가 리스트의 가장 앞(head)이 된다.
-  if(!g_cache.tail) g_cache.tail = o;
-  // 리스트가 비어 있었다면(tail == NULL) 새 노드가 리스트의 첫 노드이자 마지막 노드가 된다.
-  // 그래서 tail도 o로 설정한다.
+static void sbuf_init(sbuf_t *sp, int n){
+  sp -> buf = Calloc(n, sizeof(int));
+  sp -> n = n;
+  sp -> front = sp -> rear = 0;
+  Sem_init(&sp -> mutex, 0, 1);
+  Sem_init(&sp -> slots, 0, n);
+  Sem_init(&sp -> items, 0, 0);
 }
-// 이 함수는 새 캐시 객체를 리스트 맨 앞(head)에 삽입한다.
-// 이중 연결 리스트를 기반으로 LRU 캐시를 구현할 때 최근 사용된 객체를 항상 앞에 두기 위해 사용된다.
-// dll_push_front + dll_remove 조합을 쓰면 LRU 정책(최근 사용된 노드를 앞으로 당기기, 오래된 노드는 뒤에서 제거하기)을 쉽게 구현할 수 있다.
+// 비어 있는 n칸짜리 큐: 빈 칸 n개, 항목 0개
 
 //######################################################################################################################################################
-static void dll_remove(cache_obj_t *o){
-  if(o -> prev) o -> prev -> next = o -> next; else g_cache.head = o -> next;
-  // o 앞에 다른 노드가 있다면 그 노드의 next를 o -> next로 바꿔준다.
-  // o를 건너뛰고 앞 노드가 다음 노드를 가리키게 만든다.
-  // o가 head 라면 prev가 없으니 캐시의 head를 o -> next로 갱신한다.
-  if(o -> next) o -> next -> prev = o -> prev; else g_cache.tail = o -> prev;
-  // o 뒤에 다른 노드가 있다면 그 노드의 Prev를 o -> prev로 바꿔준다.
-  // o 를 건너뛰고 뒤 노드가 앞 노드를 가리키게 만든다.
-  // o가 tail이라면 next가 없으니 캐시의 tail을 o -> prev로 갱신한다.
-  o -> prev = o -> next = NULL;
-  // o의 포인터들을 끊어서 리스트에서 완전히 독립된 상태로 만든다.
+static void sbuf_insert(sbuf_t *sp, int item){
+  P(&sp -> slots);
+  P(&sp -> mutex);
+  sp -> buf[(++sp -> rear) % (sp -> n)] = item;
+  V(&sp -> mutex);
+  V(&sp -> items);
 }
+// 빈 칸이 생길 때까지 기다렸다가(P slots) 뒤에 넣고 항목 수를 올린다(V items)
 
 //######################################################################################################################################################
-static void cache_init(void){
-  memset(&g_cache, 0, sizeof(g_cache));
-  // g_cache 구조체 전체를 0으로 초기화한다.
-  // 큰 구조체를 간단히 초기화할때 memset으로 0을 넣는 방식이 흔히 사용된다.
-  pthread_rwlock_init(&g_cache.rwlock, NULL);
-  // 캐시 접근을 동시성 안전(thread-safe) 하게 만들기 위해 rwlock을 초기화한다.
-  // rwlock의 지원
-    // 여러 스레드가 동시에 읽기(read lock) 가능
-    // 단 하나의 스레드만 쓰기(write lock) 가능
-    // 읽기와 쓰기는 동시에 불가능
-  // NULL은 기본 속성으로 초기화 한다는 뜻
+static int sbuf_try_insert(sbuf_t *sp, int item){
+  if(sem_trywait(&sp -> slots) < 0) return -1;
+  P(&sp -> mutex);
+  sp -> buf[(++sp -> rear) % (sp -> n)] = item;
+  V(&sp -> mutex);
+  V(&sp -> items);
+  return 0;
 }
-// 캐시를 빈 상태로 만든다.
+// sbuf_insert의 기다리지 않는 버전. 빈 칸이 없으면 바로 -1(과부하)
+
+//######################################################################################################################################################
+static int sbuf_remove(sbuf_t *sp){
+  int item;
+  P(&sp -> items);
+  P(&sp -> mutex);
+  item = sp -> buf[(++sp -> front) % (sp -> n)];
+  V(&sp -> mutex);
+  V(&sp -> slots);
+  return item;
+}
+// 항목이 생길 때까지 기다렸다가(P items) 앞에서 꺼내고 빈 칸 수를 올린다(V slots)
 
 //######################################################################################################################################################
-static cache_obj_t* cache_find_unlocked(const char* key){
-  for(cache_obj_t* p = g_cache.head; p; p = p -> next)
-  // g_cache.head부터 시작해서 이중 연결 리스트(doubly linked list)를 순차 탐색
-  // p가 NULL이 될 때까지 한 칸씩(next 포인터를 따라) 진행
-    if(strcmp(p -> key, key) == 0) return p;
-    // strcmp == 0이면 문자열이 동일하다는 뜻 -> 같은 웹 객체 
+static void run_reuseport_workers(char* port, int nworkers){
+  int ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  for(int i = 0; i < nworkers; i++){
+    acceptor_arg_t* a = Malloc(sizeof(acceptor_arg_t));
+    a -> port = port;
+    a -> cpu = ncpu > 0 ? i % ncpu : -1;
+    if(i == nworkers - 1) reuseport_worker(a);
+    // 마지막 워커는 main 스레드가 직접 돌린다(돌아오지 않음)
+    pthread_t tid;
+    pthread_create(&tid, NULL, reuseport_worker, a);
+    pthread_detach(tid);
+  }
+}
+// pool 모드 + -r: 워커 스레드마다 SO_REUSEPORT 리스너 하나, CPU 하나
+
+//######################################################################################################################################################
+static void* reuseport_worker(void* arg){
+  acceptor_arg_t* a = arg;
+  int listenfd = Open_listenfd_reuseport(a -> port);
+  if(a -> cpu >= 0) pin_to_cpu(a -> cpu);
+  Free(a);
+  // 자기 리스닝 소켓을 열고 CPU에 고정(인자는 Malloc으로 넘겨받았으니 다 쓰고 Free)
+
+  while(1){
+    struct sockaddr_storage clientaddr;
+    socklen_t clientlen = sizeof(clientaddr);
+    int connfd = Accept(listenfd, (SA*)&clientaddr, &clientlen);
+    handle_client(connfd);
+    Close(connfd);
+  }
+  // 커널이 이 소켓으로 나눠 준 연결만 받아서 바로 처리한다(공유 accept 큐도, 워커 간 fd 큐도 없음)
   return NULL;
 }
-// 캐시 안에서 주어진 key에 해당하는 객체(cache_obj_t)를 찾는다
-// unlocked라는 이름처럼 락을 걸지 않은 상태에서만 사용해야 하는 함수임을 의미한다.
-// 락 제어는 바깥쪽 cache_lookup이나 cache_insert 같은 함수에서 처리한다.
+
 //######################################################################################################################################################
-static int cache_lookup(const char* key, char** out, size_t* out_sz){
-  int hit = 0;
-  cache_obj_t* obj = NULL;
-  // 반환값 hit: 1이면 캐시 히트, 0이면 미스
-  // out/out_sz: 데이터 복사본과 그 크기를 돌려주는 출력 파라미터
+static void pin_to_cpu(int cpu){
+  unsigned long mask[1024 / (8 * sizeof(unsigned long))];
+  memset(mask, 0, sizeof(mask));
+  mask[cpu / (8 * sizeof(unsigned long))] |= 1UL << (cpu % (8 * sizeof(unsigned long)));
+  syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask);
+}
+// 호출한 스레드를 CPU 하나에 고정한다(pid 0 = 호출 스레드 자신).
+// CPU_SET/pthread_setaffinity_np는 _GNU_SOURCE가 필요한데, 그러면 csapp.h의 gai_error가 glibc 선언과 충돌해서
+// 비트마스크를 직접 만들어 시스템 콜로 부른다. 실패해도(권한/CPU 없음) 고정만 안 될 뿐 동작에는 지장 없다.
 
-  pthread_rwlock_rdlock(&g_cache.rwlock);
-  // 읽기 락(rdlock)으로 캐시를 보호하며 검색 -> 동시 다중 조회 허용
-  obj = cache_find_unlocked(key);
-  if(obj){
-    *out_sz = obj -> size;
-    *out = Malloc(obj -> size);
-    memcpy(*out, obj -> data, obj -> size);
-    hit = 1;
-  }
-  pthread_rwlock_unlock(&g_cache.rwlock);
-  // 찾으면(히트) 복사본을 만들어서 *out에 넣어줌
-  // 락을 오래 잡은 채로 네트워크 I/O(클라로 write)까지 하면 병목/교착 위험
-  // 복사만 하고 바로 락을 풀어서 동시성을 높임
-  // 여기서 반환하는 버퍼는 호출자가 Free(*out)로 해제해야 한다.
-
-  if(hit){
-    pthread_rwlock_wrlock(&g_cache.rwlock);
-    // 히트라면 쓰기 락(wrlock)을 걸어 LRU 리스트 갱신
-    obj = cache_find_unlocked(key);
-    // 방금 락을 풀었다가 다시 잡았기 때문에 그 사이에 리스트가 바뀌었을 수 있어 안전하게 다시 찾아서 작업
-    if(obj && obj != g_cache.head){
-      dll_remove(obj);
-      dll_push_front(obj);
-    }
-    // obj != head면 dll_remove로 떼고 dll_push_front로 MRU(앞)에 붙임 -> LRU 근사 정책 유지
-    pthread_rwlock_unlock(&g_cache.rwlock);
-  }  
-  return hit;
+//######################################################################################################################################################
+static void make_cache_key(char* key, size_t keysz, const char* host, const char* port, const char* path){
+  snprintf(key, keysz, "%s:%s%s", host, port, path);
 }
-// 쓰기 락 구간을 아주 짧게 유지하므로 여러 리더 동시성 + 최소한의 라이터 충돌을 달성
+// 캐시 키 "<host>:<port><path>"를 만든다(스레드 모드와 이벤트 루프 모드가 같은 키를 쓰도록 한 곳에서)
 
 //######################################################################################################################################################
-static void cache_insert(const char *key, const char *data, size_t sz){
-  if(sz > MAX_OBJECT_SIZE) return;
+static char* build_origin_request(const char* host, const char* port, const char* path,
+  char header[][MAXLINE], int num_headers, bool keepalive, const cache_obj_t* validate, arena_t* arena, size_t* out_len){
+  size_t cap = strlen(path) + strlen(host) + strlen(port) + strlen(user_agent_hdr) + 128;
+  for(int i = 0; i < num_headers; i++) cap += strlen(header[i]);
+  if(validate) cap += validate -> hdr_len + 48;
+  char* out = arena ? arena_alloc(arena, cap) : Malloc(cap);
+  size_t n = 0;
+  // 필요한 최대 길이를 먼저 계산해 한 번에 할당(요청라인/Host/고정 헤더 여유분 128바이트 + 전달할 헤더들)
+  // 아레나가 있으면(스레드 모드) 거기서 받고, 없으면(이벤트 루프 모드) Malloc -> 호출자가 Free
 
-  pthread_rwlock_wrlock(&g_cache.rwlock);
-  // 쓰기 락: 캐시 구조(head/tail/total, 노드 연결)를 바꾸므로 단일 라이터만 허용
+  // 원서버로 보낼 요청라인 작성
+  n += snprintf(out + n, cap - n, "GET %s HTTP/1.%d\r\n", path, keepalive ? 1 : 0);
+  // keepalive: 연결 풀을 쓰는 스레드 모드는 HTTP/1.1로 보내고 응답 끝을 Content-Length/chunked로 찾는다.
+  // 아니면(이벤트 루프 모드) HTTP/1.0으로 단순화해서 원서버가 닫는 것(EOF)을 응답 끝으로 본다.
+  // GET <path> HTTP/1.0\r\n처럼 절대 URI가 아닌 경로(path)로 보낸다.(프록시가 이미 Host로 목적지 알려줄 것)
 
-  cache_obj_t* ex = cache_find_unlocked(key);
-  if(ex){
-    dll_remove(ex);
-    g_cache.total -= ex -> size;
-    Free(ex -> data);
-    Free(ex);
-  }
-  // 동일 키가 이미 있다면: 기존 엔트리를 제거(리스트에서 떼고 메모리 해제, 총량 감소)
-  // 이렇게 하면 업데이트가 되어 최신 데이터로 교체 가능
-
-  while(g_cache.total + sz > MAX_CACHE_SIZE && g_cache.tail){
-    cache_obj_t* v = g_cache.tail;
-    dll_remove(v);
-    g_cache.total -= v -> size;
-    Free(v -> data);
-    Free(v);
-  }
-  // 용량 확보: 총 1MiB 한도를 벗어나지 않도록 꼬리(LRU)부터 반복 추출
-  // while인 이유: 한 번 축출로 충분치 않을 수 있어서 여러 개를 제거할 수도 있음
+  // 필수/표준화 헤더 구성
+  bool have_host = false;
+  for(int i = 0; i < num_headers; i++){
+    if(!strncasecmp(header[i], "Host:", 5)){
+      have_host = true;
+      break;
+    }
+  }
+  if(!have_host){
+    if(*port && strcmp(port, "80")){
+      n += snprintf(out + n, cap - n, "Host: %s:%s\r\n", host, port);
+    }
+    else{
+      n += snprintf(out + n, cap - n, "Host: %s\r\n", host);
+    }
+  }
+  // host 헤더 보장
+  // HTTP/1.1 클라이언트가 보냈다면 보통 Host가 있음
+  // 만약 없으면(HTTP/1.0 클라일 수도) 프록시가 필수 Host 헤더를 추가해 원서버가 가상호스트를 식별하도록 함
 
-  cache_obj_t* o = Malloc(sizeof(cache_obj_t));
-  strncpy(o -> key, key, sizeof(o -> key) - 1); o -> key[sizeof(o -> key) - 1] = '\0';
-  o -> data = Malloc(sz);
-  memcpy(o -> data, data, sz);
-  o -> size = sz;
-  o -> prev = o -> next = NULL;
-  dll_push_front(o);
-  g_cache.total += sz;
-  // 새 노드 생성 후:
-    // 키 복사(널 종료 보장)
-    // 데이터 sz 바이트를 새로 할당해 복사(헤더 + 바디 포함 전체 응답을 저장)
-    // 사이즈 기록, 링크 초기화
-    // 리스트 앞(head, MRU)에 삽입 -> 가장 최근 사용으로 표시
-    // 총량 갱신(스펙
+  n += snprintf(out + n, cap - n, "%s", user_agent_hdr);
+  if(keepalive){
+    n += snprintf(out + n, cap - n, "Connection: keep-alive\r\n");
+  }
+  else{
+    n += snprintf(out + n, cap - n, "Connection: close\r\n");
+    n += snprintf(out + n, cap - n, "Proxy-Connection: close\r\n");
+  }
+  // 표준화 강제 헤더
+  // User-Agent를 과제에서 주어진 표준 문자열로 강제
+  // keepalive면 Connection: keep-alive로 응답 뒤에도 연결을 유지해 달라고 요청(풀에 반납해서 다음 미스가 재사용)
+  // 아니면 Connection: close, Proxy-Connection: close로 요청-응답 후 끊도록 만들어
+  // 응답 경계 판단을 간단히(EOF가 응답 끝) 하고 동시연결 누수를 막는다.
+
+  if(validate){
+    size_t vlen;
+    const char* v = cache_obj_header(validate, "ETag:", &vlen);
+    if(v) n += snprintf(out + n, cap - n, "If-None-Match: %.*s\r\n", (int)vlen, v);
+    v = cache_obj_header(validate, "Last-Modified:", &vlen);
+    if(v) n += snprintf(out + n, cap - n, "If-Modified-Since: %.*s\r\n", (int)vlen, v);
+  }
+  // 만료된 엔트리를 확인하는 요청이면 캐시된 검증자(ETag, Last-Modified)로 조건부 헤더를 단다.
+  // 바뀌지 않았으면 원서버는 본문 없이 304만 보낸다.
+
+  // 나머지 헤더 전달("hop-by-hop" 및 중복/문제 헤더 제거)
+  for(int i = 0; i < num_headers; i++){
+    if (is_hop_header(header[i])) continue;
+    if (!strncasecmp(header[i], "Transfer-Encoding:", 18)) continue;
+    if (!strncasecmp(header[i], "User-Agent:", 11)) continue;
+    if (validate && (!strncasecmp(header[i], "If-None-Match:", 14) || !strncasecmp(header[i], "If-Modified-Since:", 18))) continue;
+    size_t len = strlen(header[i]);
+    memcpy(out + n, header[i], len);
+    n += len;
+  }
+  memcpy(out + n, "\r\n", 2);
+  n += 2;
+  // hop-by-hop 헤더(Connection, Proxy-Connection, Keep-Alive, TE, Trailer, Upgrade)는 프록시 구간을 넘기면 안 됨 -> 드롭
+  // Transfer-Encoding도 드롭(GET이라 요청 본문이 없음)
+  // User-Agent는 이미 위에서 우리가 보낸 값이 있으니 중복 방지로 드롭
+  // 조건부 요청이면 클라이언트의 조건부 헤더도 드롭(304는 프록시가 받고 클라이언트에는 캐시 사본 전체를 보낸다)
+  // 나머지는 그대로 원서버로 전달
+  // 나머지 \r\n은 헤더 종료 빈 줄
+
+  *out_len = n;
+  return out;
+}
+// 원서버로 보낼 요청 전체를 Malloc한 버퍼에 만들어 돌려준다(호출자가 Free)
+// 스레드 모드는 이걸 한 번에 풀의 연결로 쓰고, 이벤트 루프 모드는 논블로킹으로 나눠 쓴다.
 
-  pthread_rwlock_unlock(&g_cache.rwlock);
+//######################################################################################################################################################
+static void* worker(void* arg){
+  int connfd = *((int*)arg);
+  // pthread_create로 스레드를 만들때 connfdp(클라이언트 소켓 fd를 답은 int*)를 넘겨줬다.
+  // arg는 void* 타입으로 넘어오므로 (int*)로 캐스팅해서 역참조(*)하면 실제 fd 값이 나온다.
+  // connfd에 클라이언트와 연결된 소켓 번호가 들어간다.
+  Free(arg);
+  //Malloc으로 동적 할당했던 arg를 더 이상 안쓰니까 Free로 해제해준다. -> 메모리 누수 방지
+
+  handle_client(connfd);
+  // 클라이언트의 HTTP 요청을 읽고 원 서버에 요청을 전달하고 응답을 받아 클라이언트에 다시 보내주는 역할
+  // 프록시 서버의 핵심 로직이 들어있는 부분
+  // worker 스레드가 맡은 하나의 연결 처리가 여기서 이뤄진다.
+  Close(connfd);
+  // 클라이언트 요청이 다 처리되면 소켓을 닫아서 연결을 정리
+  // 소켓이 계속 열려있을 경우 발생하는 파일 스크립터 누수 방지
+  return NULL;
+}
+
+//######################################################################################################################################################
+static void run_event_loops(char* port, int nloops, bool reuseport){
+  int shared_fd = -1;
+  int ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if(!reuseport){
+    shared_fd = Open_listenfd(port);
+    set_nonblocking(shared_fd);
+  }
+  // 기본: 리스닝 소켓 하나를 모든 루프가 같이 기다린다.
+  // 먼저 깬 루프가 가져가고 나머지는 EAGAIN으로 빠져나오도록 논블로킹
+
+  ev_loop_t* loops = Calloc(nloops, sizeof(ev_loop_t));
+  for(int i = 0; i < nloops; i++){
+    ev_loop_t* lp = &loops[i];
+    lp -> epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(lp -> epfd < 0) unix_error("epoll_create1 error");
+    lp -> lh.kind = EV_LISTEN;
+    lp -> lh.c = NULL;
+    lp -> rh.kind = EV_RESOLVED;
+    lp -> rh.c = NULL;
+    if(pipe(lp -> resolved) < 0) unix_error("pipe error");
+    set_nonblocking(lp -> resolved[0]);
+    struct epoll_event rev = { .events = EPOLLIN, .data.ptr = &lp -> rh };
+    if(epoll_ctl(lp -> epfd, EPOLL_CTL_ADD, lp -> resolved[0], &rev) < 0) unix_error("epoll_ctl error");
+    // 리졸버가 해석을 끝낸 연결을 이 파이프로 돌려준다(읽는 쪽만 논블로킹, 루프가 비울 때까지 읽는다)
+    lp -> header = Malloc(MAX_HEADERS * MAXLINE);
+    // 요청 헤더 파싱용 배열(약 800KB)은 연결마다가 아니라 루프마다 하나만 둔다(한 번에 한 연결만 파싱하므로)
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &lp -> lh };
+    lp -> accept_resume = 0;
+    lp -> idle_head = lp -> idle_tail = NULL;
+    if(reuseport){
+      lp -> listenfd = Open_listenfd_reuseport(port);
+      set_nonblocking(lp -> listenfd);
+      lp -> cpu = ncpu > 0 ? i % ncpu : -1;
+    }
+    else{
+      lp -> listenfd = shared_fd;
+      lp -> cpu = -1;
+      ev.events |= EPOLLEXCLUSIVE;
+    }
+    lp -> listen_events = ev.events;
+    if(epoll_ctl(lp -> epfd, EPOLL_CTL_ADD, lp -> listenfd, &ev) < 0) unix_error("epoll_ctl error");
+    // -r: 루프마다 자기 SO_REUSEPORT 리스너를 가진다. 커널이 연결을 나눠 주므로 이 소켓은 이 루프만 기다린다.
+    // 공유 리스너: EPOLLEXCLUSIVE로 새 연결 하나에 모든 루프가 한꺼번에 깨어나는(thundering herd) 대신 일부만 깨운다.
+  }
+
+  for(int i = 0; i < RESOLVER_THREADS; i++){
+    pthread_t tid;
+    pthread_create(&tid, NULL, resolver_thread, NULL);
+    pthread_detach(tid);
+  }
+  for(int i = 1; i < nloops; i++){
+    pthread_t tid;
+    pthread_create(&tid, NULL, ev_loop_thread, &loops[i]);
+    pthread_detach(tid);
+  }
+  ev_loop_thread(&loops[0]);
+  // 루프 0은 main 스레드가 직접 돌리고 나머지는 스레드 하나에 루프 하나
+}
+// 이벤트 루프 모드(-m epoll): 적은 수의 루프 스레드가 각자 epoll로 많은 클라이언트/원서버 소켓을 다중화한다.
+// 연결마다 스레드/스택을 만들지 않으므로 동시 연결이 수만 개여도 스레드 수는 루프 수(-n)로 고정된다.
+
+//######################################################################################################################################################
+static void* ev_loop_thread(void* arg){
+  ev_loop_t* lp = arg;
+  struct epoll_event events[EPOLL_MAX_EVENTS];
+  if(lp -> cpu >= 0) pin_to_cpu(lp -> cpu);
+  // 자기 리스너를 가진 루프는 CPU 하나에 고정 -> 연결의 accept부터 중계까지 같은 코어(같은 캐시)에서 처리
+
+  while(1){
+    int n = epoll_wait(lp -> epfd, events, EPOLL_MAX_EVENTS, ev_expire(lp));
+    if(n < 0){
+      if(errno == EINTR) continue;
+      unix_error("epoll_wait error");
+    }
+    for(int i = 0; i < n; i++){
+      ev_handle_t* h = events[i].data.ptr;
+      if(h -> kind == EV_LISTEN) ev_accept(lp);
+      else if(h -> kind == EV_RESOLVED) ev_resolved(lp);
+      else if(h -> kind == EV_CLIENT) conn_on_client(h -> c, events[i].events);
+      else conn_on_origin(h -> c, events[i].events);
+    }
+    // 준비된 fd마다 종류(리스닝/클라이언트/원서버)에 맞는 핸들러로 보낸다.
+    // 핸들러는 블로킹하지 않고 할 수 있는 만큼만 진행한 뒤 다음에 기다릴 이벤트를 등록하고 돌아온다.
+    // epoll_wait는 가장 가까운 마감(헤더 읽기 타임아웃, 리스너 복귀)까지만 기다린다.
+  }
+  return NULL;
+}
+
+//######################################################################################################################################################
+static long ev_now_ms(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+// 이벤트 루프의 마감 계산용 단조 시계(ms)
+
+//######################################################################################################################################################
+static void ev_idle_remove(conn_t* c){
+  if(!c -> deadline) return;
+  ev_loop_t* lp = c -> loop;
+  if(c -> iprev) c -> iprev -> inext = c -> inext; else lp -> idle_head = c -> inext;
+  if(c -> inext) c -> inext -> iprev = c -> iprev; else lp -> idle_tail = c -> iprev;
+  c -> iprev = c -> inext = NULL;
+  c -> deadline = 0;
+}
+// 연결을 루프의 idle 리스트에서 뺀다(요청 헤더를 다 받았거나 연결을 닫을 때, 이미 빠져 있으면 아무것도 안 함)
+
+//######################################################################################################################################################
+static int ev_expire(ev_loop_t* lp){
+  long now = ev_now_ms();
+  while(lp -> idle_head && lp -> idle_head -> deadline <= now){
+    conn_t* c = lp -> idle_head;
+    c -> cacheable = 0;
+    conn_close(c);
+  }
+  // 헤더 블록을 CLIENT_IDLE_TIMEOUT 안에 다 보내지 않은 연결을 닫는다(스레드/pool 모드의 SO_RCVTIMEO에 해당)
+  // 조금씩만 보내며 버티는 연결도 마감은 accept 때 정해지므로 같이 정리된다. conn_close가 리스트에서도 뺀다.
+
+  if(lp -> accept_resume && lp -> accept_resume <= now){
+    struct epoll_event ev = { .events = lp -> listen_events, .data.ptr = &lp -> lh };
+    epoll_ctl(lp -> epfd, EPOLL_CTL_ADD, lp -> listenfd, &ev);
+    lp -> accept_resume = 0;
+  }
+  // fd 부족으로 빼 둔 리스너를 다시 등록한다(아직 부족하면 ev_accept가 또 빼 둔다)
+
+  long next = -1;
+  if(lp -> idle_head) next = lp -> idle_head -> deadline;
+  if(lp -> accept_resume && (next < 0 || lp -> accept_resume < next)) next = lp -> accept_resume;
+  return next < 0 ? -1 : (int)(next - now);
+}
+// 마감이 지난 일을 처리하고 다음 마감까지 남은 시간(ms, 없으면 -1)을 돌려준다 -> epoll_wait의 timeout
+
+//######################################################################################################################################################
+static void ev_accept(ev_loop_t* lp){
+  while(1){
+    struct sockaddr_storage clientaddr;
+    socklen_t clientlen = sizeof(clientaddr);
+    int fd = accept(lp -> listenfd, (SA*)&clientaddr, &clientlen);
+    if(fd < 0){
+      if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM){
+        epoll_ctl(lp -> epfd, EPOLL_CTL_DEL, lp -> listenfd, NULL);
+        lp -> accept_resume = ev_now_ms() + EPOLL_ACCEPT_BACKOFF_MS;
+      }
+      return;
+    }
+    set_nonblocking(fd);
+    // EAGAIN이면 대기 중인 연결을 다 받은 것(다른 루프가 먼저 가져갔을 수도 있음)
+    // fd가 바닥나서 실패하면 대기 중인 연결이 그대로 남아 레벨 트리거 리스너가 계속 깨우므로(CPU 100%)
+    // 잠깐 리스너를 epoll에서 빼 두고 ev_expire가 다시 넣는다. 그 사이 기다리는 연결은 커널 backlog에 남는다.
+    // 받은 소켓은 논블로킹으로 바꿔서 read/write가 루프를 멈추지 않게 한다.
+
+    conn_t* c = Calloc(1, sizeof(conn_t));
+    c -> loop = lp;
+    c -> state = CONN_READ_REQ;
+    c -> cfd = fd;
+    c -> sfd = -1;
+    c -> ch.kind = EV_CLIENT; c -> ch.c = c;
+    c -> sh.kind = EV_ORIGIN; c -> sh.c = c;
+    c -> cacheable = 1;
+    // 연결 상태를 힙에 만든다. epoll에는 fd별 핸들(ch/sh)의 주소를 넣어 이벤트가 오면 연결과 fd 종류를 바로 알 수 있게 한다.
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &c -> ch };
+    if(epoll_ctl(lp -> epfd, EPOLL_CTL_ADD, fd, &ev) < 0){
+      Close(fd);
+      Free(c);
+      continue;
+    }
+    // 첫 상태(요청 읽기)는 클라이언트 소켓의 읽기 이벤트를 기다린다.
+
+    c -> deadline = ev_now_ms() + CLIENT_IDLE_TIMEOUT * 1000L;
+    c -> iprev = lp -> idle_tail;
+    if(lp -> idle_tail) lp -> idle_tail -> inext = c; else lp -> idle_head = c;
+    lp -> idle_tail = c;
+    // 헤더 블록을 다 받을 때까지 idle 리스트 맨 뒤에 건다(마감이 가장 늦으므로 정렬 유지)
+  }
+}
+
+//######################################################################################################################################################
+static void* resolver_thread(void* arg){
+  while(1){
+    pthread_mutex_lock(&g_resolver.lock);
+    while(!g_resolver.head) pthread_cond_wait(&g_resolver.cond, &g_resolver.lock);
+    conn_t* c = g_resolver.head;
+    g_resolver.head = c -> rnext;
+    if(!g_resolver.head) g_resolver.tail = NULL;
+    pthread_mutex_unlock(&g_resolver.lock);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    c -> gai_err = getaddrinfo(c -> host, c -> port, &hints, &c -> ai_list);
+    if(c -> gai_err) c -> ai_list = NULL;
+    // 주소 해석은 open_clientfd와 같은 힌트로 한다.
+
+    while(write(c -> loop -> resolved[1], &c, sizeof(c)) < 0 && errno == EINTR);
+    // 연결을 그 연결의 루프로 돌려준다. 포인터 하나는 PIPE_BUF보다 작아서 여러 리졸버가 동시에 써도 섞이지 않는다.
+  }
+  return NULL;
+}
+// 대기열에서 연결을 하나씩 꺼내 블로킹 getaddrinfo를 대신 부른다. 그동안 연결은 CONN_RESOLVE라 루프가 건드리지 않는다.
+
+//######################################################################################################################################################
+static void ev_resolved(ev_loop_t* lp){
+  conn_t* c;
+  while(read(lp -> resolved[0], &c, sizeof(c)) == sizeof(c)){
+    if(c -> gone) conn_close(c);
+    else if(c -> gai_err) conn_reply_error(c, c -> host, "502", "Bad Gateway", "Proxy failed to connect to origin");
+    else{
+      c -> ai = c -> ai_list;
+      conn_connect_next(c);
+    }
+  }
+  // 해석 중에 클라이언트가 끊었으면 이제 정리하고, 실패면 502, 성공이면 논블로킹 connect를 시작한다.
+}
+
+//######################################################################################################################################################
+static void conn_watch(conn_t* c, uint32_t cev, uint32_t sev){
+  struct epoll_event ev = { .events = cev, .data.ptr = &c -> ch };
+  epoll_ctl(c -> loop -> epfd, EPOLL_CTL_MOD, c -> cfd, &ev);
+  if(c -> sfd >= 0){
+    ev.events = sev;
+    ev.data.ptr = &c -> sh;
+    epoll_ctl(c -> loop -> epfd, EPOLL_CTL_MOD, c -> sfd, &ev);
+  }
+}
+// 이 연결이 다음에 기다릴 이벤트를 클라이언트(cev)/원서버(sev) 소켓 각각에 설정한다(0이면 아무것도 안 기다림)
+// 레벨 트리거라서 조건이 남아 있으면 다음 epoll_wait에서 다시 알려 준다.
+
+//######################################################################################################################################################
+static void conn_close(conn_t* c){
+  if(c -> cacheable && c -> state == CONN_DONE && c -> obj.len > 0){
+    cache_obj_t* o = cache_insert(c -> key, c -> hash, cache_make_object(c -> obj.segs, c -> obj.len));
+    if(o) cache_release(o);
+  }
+  // 원서버 응답을 끝(EOF)까지 다 중계했고 크기 제한 안이면 스레드 모드와 똑같이 캐시에 넣는다.
+  // 원서버 응답을 그대로 모은 사본이므로 cache_make_object가 hop-by-hop 헤더를 빼고 Content-Length를 채운다.
+  if(c -> hit) cache_release(c -> hit);
+  ev_idle_remove(c);
+  if(c -> sfd >= 0) Close(c -> sfd);
+  Close(c -> cfd);
+  // fd를 닫으면 epoll 등록도 같이 사라진다.
+  if(c -> ai_list) freeaddrinfo(c -> ai_list);
+  Free(c -> in);
+  Free(c -> out);
+  Free(c -> wv);
+  seglist_free(&c -> obj);
+  Free(c -> key);
+  Free(c -> host);
+  Free(c);
+}
+// 연결 하나를 정리한다(스레드 모드 worker의 Close(connfd)에 해당)
+
+//######################################################################################################################################################
+static void conn_reply_error(conn_t* c, const char* cause, const char* errnum, const char* shortmsg, const char* longmsg){
+  ev_idle_remove(c);
+  Free(c -> out);
+  c -> out = Malloc(MAXBUF);
+  c -> out_len = build_clienterror(c -> out, MAXBUF, cause, errnum, shortmsg, longmsg);
+  Free(c -> wv);
+  c -> wv = Malloc(sizeof(struct iovec));
+  c -> wv[0].iov_base = c -> out;
+  c -> wv[0].iov_len = c -> out_len;
+  c -> wv_cnt = 1;
+  c -> cacheable = 0;
+  if(c -> sfd >= 0){
+    Close(c -> sfd);
+    c -> sfd = -1;
+  }
+  c -> state = CONN_WRITE;
+  conn_watch(c, EPOLLOUT, 0);
+}
+// clienterror의 논블로킹 버전: 에러 응답을 버퍼에 만들어 두고 쓰기 상태로 넘어간다.
+
+//######################################################################################################################################################
+static void conn_on_client(conn_t* c, uint32_t events){
+  if(c -> state == CONN_READ_REQ){
+    if(events & (EPOLLERR | EPOLLHUP) && !(events & EPOLLIN)){ conn_close(c); return; }
+    while(1){
+      if(c -> in_len + 1 >= c -> in_cap){
+        if(c -> in_cap >= MAX_HEADERS * MAXLINE){
+          conn_reply_error(c, "request", "400", "Bad Request", "Request header too large");
+          return;
+        }
+        c -> in_cap = c -> in_cap ? c -> in_cap * 2 : MAXLINE;
+        c -> in = Realloc(c -> in, c -> in_cap);
+      }
+      ssize_t n = read(c -> cfd, c -> in + c -> in_len, c -> in_cap - c -> in_len - 1);
+      if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+      if(n <= 0){ conn_close(c); return; }
+      size_t from = c -> in_len > 3 ? c -> in_len - 3 : 0;
+      c -> in_len += n;
+      c -> in[c -> in_len] = '\0';
+      if(strstr(c -> in + from, "\r\n\r\n")){
+        conn_start_request(c);
+        return;
+      }
+    }
+    // 요청 헤더 블록(빈 줄 \r\n\r\n까지)이 다 모일 때까지 읽을 수 있는 만큼 읽어 누적한다.
+    // 새로 읽은 부분 바로 앞 3바이트부터만 찾으면 경계에 걸친 \r\n\r\n도 놓치지 않는다.
+    // 한도(MAX_HEADERS * MAXLINE)를 넘는 헤더는 스레드 모드에서도 담을 수 없으므로 400으로 거절
+  }
+
+  if(c -> state == CONN_RESOLVE){
+    c -> gone = true;
+    epoll_ctl(c -> loop -> epfd, EPOLL_CTL_DEL, c -> cfd, NULL);
+    return;
+  }
+  // 주소 해석 중에 끊김: 연결은 아직 리졸버가 쥐고 있으므로 표시만 하고 돌아왔을 때 닫는다
+  // (레벨 트리거라 등록을 빼 두지 않으면 그때까지 같은 HUP이 계속 온다)
+
+  if(events & (EPOLLERR | EPOLLHUP) && !(events & EPOLLOUT)){
+    c -> cacheable = 0;
+    conn_close(c);
+    return;
+  }
+  // 중계/쓰기 도중 클라이언트가 끊으면 스레드 모드처럼 캐시에 넣지 않고 정리
+
+  if(c -> state == CONN_WRITE){
+    while(c -> wv_cnt > 0){
+      ssize_t n = writev(c -> cfd, c -> wv, c -> wv_cnt < IOV_MAX ? c -> wv_cnt : IOV_MAX);
+      if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+      if(n <= 0) break;
+      iov_advance(c -> wv, &c -> wv_cnt, (size_t)n);
+    }
+    conn_close(c);
+    // 캐시 히트 또는 에러 응답을 다 쓰면 연결 종료(스레드 모드와 같이 요청 하나 처리 후 닫음)
+    return;
+  }
+
+  if(c -> state == CONN_RELAY) conn_relay(c);
+  // 중계 중 클라이언트 소켓이 다시 쓸 수 있게 되면 밀린 바이트부터 이어서 보낸다.
+}
+
+//######################################################################################################################################################
+static void conn_start_request(conn_t* c){
+  char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+  char host[MAXLINE], port[16], path[MAXLINE];
+  char (*header)[MAXLINE] = c -> loop -> header;
+  int num_headers = 0;
+  ev_idle_remove(c);
+  // 헤더를 다 받았으니 읽기 마감에서 뺀다
+
+  char* line = c -> in;
+  char* eol = strstr(line, "\r\n");
+  *eol = '\0';
+  printf("Request headers:\n");
+  printf("%s\r\n", line);
+  method[0] = uri[0] = version[0] = '\0';
+  sscanf(line, "%s %s %s", method, uri, version);
+  // 첫 줄(요청라인)에서 method/uri/version 분리(handle_client와 같음)
+
+  if(strcasecmp(method, "GET")){
+    conn_reply_error(c, method, "501", "Not implemented", "Tiny does not implement this method");
+    return;
+  }
+
+  for(line = eol + 2; (eol = strstr(line, "\r\n")) != NULL && eol != line; line = eol + 2){
+    if(num_headers < MAX_HEADERS){
+      size_t len = eol + 2 - line;
+      if(len > MAXLINE - 1) len = MAXLINE - 1;
+      memcpy(header[num_headers], line, len);
+      header[num_headers][len] = '\0';
+      printf("%s", header[num_headers]);
+      num_headers++;
+    }
+  }
+  // 빈 줄이 나올 때까지 헤더를 한 줄씩(CRLF 포함) header[]에 옮긴다 -> read_request_headers와 같은 모양이 되어
+  // 이후 resolve_target / build_origin_request를 스레드 모드와 그대로 공유한다.
+
+  const char* errmsg;
+  if(resolve_target(uri, header, num_headers, host, port, path, &errmsg) < 0){
+    conn_reply_error(c, uri, "400", "Bad Request", errmsg);
+    return;
+  }
+
+  char cache_key[KEYMAX];
+  make_cache_key(cache_key, sizeof(cache_key), host, port, path);
+  c -> hash = cache_hash(cache_key);
+  c -> hit = cache_lookup(cache_key, c -> hash, NULL);
+  if(c -> hit){
+    c -> wv = Malloc((c -> hit -> nsegs + 3) * sizeof(struct iovec));
+    c -> wv_cnt = cache_obj_iov(c -> hit, false, c -> wv);
+    c -> state = CONN_WRITE;
+    conn_watch(c, EPOLLOUT, 0);
+    return;
+  }
+  // 히트면 엔트리를 참조로 붙잡은 채 헤더와 본문 세그먼트들을 그대로 클라이언트에 쓴다(연결을 닫을 때 release)
+  // 이벤트 루프 모드는 요청 하나 뒤에 닫으므로 Connection: close를 끼운다.
+
+  c -> key = Malloc(strlen(cache_key) + 1);
+  strcpy(c -> key, cache_key);
+  c -> host = Malloc(strlen(host) + 1);
+  strcpy(c -> host, host);
+  snprintf(c -> port, sizeof(c -> port), "%s", port);
+  c -> out = build_origin_request(host, port, path, header, num_headers, false, NULL, NULL, &c -> out_len);
+  c -> out_off = 0;
+  if(request_is_personal(header, num_headers)) c -> cacheable = 0;
+  // Range/If-*/Authorization 요청의 응답(206, 304, 인증된 사용자 전용)은 같은 키의 다른 클라이언트에게 줄 수 없으니 캐시에 넣지 않는다.
+  // 미스: 키(캐시 삽입용)와 원서버 요청을 연결 상태에 저장해 두고 원서버 접속을 시작한다.
+
+  c -> state = CONN_RESOLVE;
+  conn_watch(c, 0, 0);
+  pthread_mutex_lock(&g_resolver.lock);
+  c -> rnext = NULL;
+  if(g_resolver.tail) g_resolver.tail -> rnext = c;
+  else g_resolver.head = c;
+  g_resolver.tail = c;
+  pthread_cond_signal(&g_resolver.cond);
+  pthread_mutex_unlock(&g_resolver.lock);
+  // 주소 해석(getaddrinfo)은 블로킹이라 리졸버 스레드에 넘긴다. 끝나면 ev_resolved가 접속을 이어 간다.
+  // 그동안 클라이언트 소켓은 아무것도 기다리지 않는다(끊김은 EPOLLHUP으로 알 수 있음).
+}
+
+//######################################################################################################################################################
+static void conn_connect_next(conn_t* c){
+  for(; c -> ai; c -> ai = c -> ai -> ai_next){
+    int fd = socket(c -> ai -> ai_family, c -> ai -> ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, c -> ai -> ai_protocol);
+    if(fd < 0) continue;
+    if(connect(fd, c -> ai -> ai_addr, c -> ai -> ai_addrlen) < 0 && errno != EINPROGRESS){
+      Close(fd);
+      continue;
+    }
+    c -> sfd = fd;
+    c -> state = CONN_CONNECT;
+    struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = &c -> sh };
+    epoll_ctl(c -> loop -> epfd, EPOLL_CTL_ADD, fd, &ev);
+    conn_watch(c, 0, EPOLLOUT);
+    return;
+  }
+  // 주소 후보를 차례로 논블로킹 connect. 연결이 끝나면(성공이든 실패든) 소켓이 쓰기 가능으로 알려진다.
+  // 그동안 클라이언트 소켓은 아무것도 기다리지 않는다(끊김은 EPOLLHUP으로 알 수 있음).
+
+  conn_reply_error(c, c -> host, "502", "Bad Gateway", "Proxy failed to connect to origin");
+  // 모든 주소가 실패하면 502
+}
+
+//######################################################################################################################################################
+static void conn_on_origin(conn_t* c, uint32_t events){
+  if(c -> state == CONN_CONNECT){
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(c -> sfd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if(err){
+      Close(c -> sfd);
+      c -> sfd = -1;
+      c -> ai = c -> ai -> ai_next;
+      conn_connect_next(c);
+      return;
+    }
+    c -> state = CONN_SEND_REQ;
+    // connect 결과는 SO_ERROR로 확인. 실패면 다음 주소로 재시도
+  }
+
+  if(c -> state == CONN_SEND_REQ){
+    while(c -> out_off < c -> out_len){
+      ssize_t n = write(c -> sfd, c -> out + c -> out_off, c -> out_len - c -> out_off);
+      if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+      if(n <= 0){
+        conn_reply_error(c, c -> host, "502", "Bad Gateway", "Proxy failed to connect to origin");
+        return;
+      }
+      c -> out_off += n;
+    }
+    Free(c -> out);
+    c -> out = NULL;
+    c -> state = CONN_RELAY;
+    conn_watch(c, 0, EPOLLIN);
+    return;
+    // 요청을 다 보냈으면 응답 중계 상태로 넘어가 원서버 읽기를 기다린다.
+  }
+
+  if(c -> state == CONN_RELAY) conn_relay(c);
+}
+
+//######################################################################################################################################################
+static void conn_relay(conn_t* c){
+  for(int rounds = 0; rounds < EPOLL_RELAY_ROUNDS; rounds++){
+    if(c -> buf_off < c -> buf_len){
+      ssize_t n = write(c -> cfd, c -> buf + c -> buf_off, c -> buf_len - c -> buf_off);
+      if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+        conn_watch(c, EPOLLOUT, 0);
+        return;
+      }
+      if(n <= 0){
+        c -> cacheable = 0;
+        conn_close(c);
+        return;
+      }
+      c -> buf_off += n;
+      continue;
+    }
+    // 버퍼에 남은 바이트를 먼저 클라이언트에 쓴다. 클라이언트가 느리면(EAGAIN) 원서버 읽기를 멈추고 클라이언트 쓰기를 기다린다.
+    // -> 느린 클라이언트 때문에 메모리가 무한히 쌓이지 않는다(연결당 버퍼 하나).
+    // EPIPE 등 쓰기 실패면 스레드 모드처럼 캐시에 넣지 않고 연결만 종료
+
+    ssize_t n = read(c -> sfd, c -> buf, sizeof(c -> buf));
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+      conn_watch(c, 0, EPOLLIN);
+      return;
+    }
+    if(n <= 0){
+      if(n < 0) c -> cacheable = 0;
+      c -> state = CONN_DONE;
+      conn_close(c);
+      return;
+    }
+    // 원서버가 EOF(Connection: close)를 보내면 응답 끝 -> 완료 상태로 닫으면서 캐시에 넣는다.
+
+    c -> buf_len = n;
+    c -> buf_off = 0;
+    if(c -> cacheable){
+      if(c -> obj.len + (size_t)n <= g_max_object) seglist_append(&c -> obj, c -> buf, n);
+      else c -> cacheable = 0;
+    }
+    // 스레드 모드와 같은 규칙으로 오브젝트 한도(-O)까지만 캐시용 사본을 세그먼트에 모은다(응답이 작으면 세그먼트도 적게 쓴다)
+  }
+  conn_watch(c, c -> buf_off < c -> buf_len ? EPOLLOUT : 0, c -> buf_off < c -> buf_len ? 0 : EPOLLIN);
+  // 한 연결이 루프를 독점하지 않도록 정해진 횟수만 돌고 양보한다(레벨 트리거라 남은 일은 다음 epoll_wait에서 이어짐)
+}
+// 원서버 -> 클라이언트 중계 상태. 읽기 한 번, 쓰기 한 번씩 번갈아 가며 버퍼 하나로 흘려보낸다.
+
+//######################################################################################################################################################
+static void set_nonblocking(int fd){
+  int flags = fcntl(fd, F_GETFL, 0);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+//######################################################################################################################################################
+static void dll_push_front(cache_shard_t *s, cache_obj_t *o){
+  o -> prev = NULL;
+  // 새로 들어오는 노드 o는 리스트 맨 앞(head)에 붙일 예정
+  // 따라서 o -> prev는 NULL(앞쪽에 아무것도 없음)
+  o -> next = s -> head;
+  // o -> next는 기존의 head 노드를 가리킨다.
+  if(s -> head) s -> head -> prev = o;
+  // 기존에 head가 있었다면 그 head의 앞쪽(prev)이 새 노드 o를 가리키도록 수정한다.
+  // 새 노드와 기존 노드를 양방향으로 연결한다.
+  s -> head = o;
+  // 이제 샤드의 head를 새 노드 o로 교체한다.
+  // 새 노드가 리스트의 가장 앞(head)이 된다.
+  if(!s -> tail) s -> tail = o;
+  // 리스트가 비어 있었다면(tail == NULL) 새 노드가 리스트의 첫 노드이자 마지막 노드가 된다.
+  // 그래서 tail도 o로 설정한다.
+}
+// 이 함수는 새 캐시 객체를 샤드 리스트 맨 앞(head)에 삽입한다.
+// 이중 연결 리스트를 기반으로 LRU 캐시를 구현할 때 최근 사용된 객체를 항상 앞에 두기 위해 사용된다.
+// dll_push_front + dll_remove 조합을 쓰면 LRU 정책(최근 사용된 노드를 앞으로 당기기, 오래된 노드는 뒤에서 제거하기)을 쉽게 구현할 수 있다.
+
+//######################################################################################################################################################
+static void dll_remove(cache_shard_t *s, cache_obj_t *o){
+  if(o -> prev) o -> prev -> next = o -> next; else s -> head = o -> next;
+  // o 앞에 다른 노드가 있다면 그 노드의 next를 o -> next로 바꿔준다.
+  // o를 건너뛰고 앞 노드가 다음 노드를 가리키게 만든다.
+  // o가 head 라면 prev가 없으니 샤드의 head를 o -> next로 갱신한다.
+  if(o -> next) o -> next -> prev = o -> prev; else s -> tail = o -> prev;
+  // o 뒤에 다른 노드가 있다면 그 노드의 Prev를 o -> prev로 바꿔준다.
+  // o 를 건너뛰고 뒤 노드가 앞 노드를 가리키게 만든다.
+  // o가 tail이라면 next가 없으니 샤드의 tail을 o -> prev로 갱신한다.
+  o -> prev = o -> next = NULL;
+  // o의 포인터들을 끊어서 리스트에서 완전히 독립된 상태로 만든다.
+}
+
+//######################################################################################################################################################
+static uint64_t cache_hash(const char* key){
+  uint64_t h = 14695981039346656037ULL;
+  for(const unsigned char* p = (const unsigned char*)key; *p; p++){
+    h ^= *p;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+// 64비트 FNV-1a 해시: 바이트마다 xor 후 FNV prime을 곱한다.
+// "host:port/path" 키는 앞부분(host:port)이 대부분 같으므로 뒷부분까지 고르게 섞이는 해시가 필요하다.
+
+//######################################################################################################################################################
+static cache_shard_t* cache_shard_of(uint64_t hash){
+  return &g_cache.shards[(hash >> 32) % CACHE_SHARDS];
+}
+// 샤드는 해시 상위 32비트로 고른다.
+// 버킷은 하위 비트(hash & (nbuckets - 1))로 고르므로, 같은 비트를 쓰면 샤드 안에서 버킷이 한쪽으로 몰린다.
+
+//######################################################################################################################################################
+static void ht_insert(cache_shard_t *s, cache_obj_t *o){
+  cache_obj_t **b = &s -> buckets[o -> hash & (s -> nbuckets - 1)];
+  o -> hnext = *b;
+  *b = o;
+  // 버킷 체인 맨 앞에 끼워 넣는다(순서는 의미 없음)
+  if(++s -> count > s -> nbuckets) ht_grow(s);
+  // 엔트리 수가 버킷 수를 넘으면 테이블을 두 배로 키운다.
+}
+
+//######################################################################################################################################################
+static void ht_remove(cache_shard_t *s, cache_obj_t *o){
+  cache_obj_t **pp = &s -> buckets[o -> hash & (s -> nbuckets - 1)];
+  while(*pp && *pp != o) pp = &(*pp) -> hnext;
+  // 이전 노드의 hnext(또는 버킷 슬롯) 자체를 가리키는 포인터로 따라가면 head 특수 처리가 필요 없다.
+  if(*pp){
+    *pp = o -> hnext;
+    s -> count--;
+  }
+  o -> hnext = NULL;
+}
+
+//######################################################################################################################################################
+static void ht_grow(cache_shard_t *s){
+  size_t nb = s -> nbuckets * 2;
+  cache_obj_t **nbk = Calloc(nb, sizeof(cache_obj_t*));
+  for(size_t i = 0; i < s -> nbuckets; i++){
+    cache_obj_t *p = s -> buckets[i];
+    while(p){
+      cache_obj_t *nx = p -> hnext;
+      cache_obj_t **b = &nbk[p -> hash & (nb - 1)];
+      p -> hnext = *b;
+      *b = p;
+      p = nx;
+    }
+  }
+  // 저장해 둔 hash로 재배치하므로 키 문자열을 다시 해시할 필요가 없다.
+  Free(s -> buckets);
+  s -> buckets = nbk;
+  s -> nbuckets = nb;
+}
+// 쓰기 락을 잡은 cache_insert 안에서만 불린다. 두 배씩 늘리므로 삽입 비용은 분할 상환 O(1)
+
+//######################################################################################################################################################
+static void cache_init(void){
+  memset(&g_cache, 0, sizeof(g_cache));
+  // g_cache 구조체 전체를 0으로 초기화한다.
+  // 큰 구조체를 간단히 초기화할때 memset으로 0을 넣는 방식이 흔히 사용된다.
+  for(int i = 0; i < CACHE_SHARDS; i++){
+    cache_shard_t *s = &g_cache.shards[i];
+    s -> budget = g_max_cache / CACHE_SHARDS + (i < g_max_cache % CACHE_SHARDS ? 1 : 0);
+    // 나머지 바이트는 앞쪽 샤드에 1바이트씩 나눠 줘서 budget 합이 정확히 g_max_cache가 되게 한다.
+    s -> nbuckets = CACHE_INIT_BUCKETS;
+    s -> buckets = Calloc(s -> nbuckets, sizeof(cache_obj_t*));
+    // 해시 버킷 배열은 모두 NULL(빈 체인)로 시작
+    if(g_policy -> init_shard) g_policy -> init_shard(s);
+    // 정책 전용 상태(TinyLFU의 sketch 등) 준비
+    pthread_rwlock_init(&s -> rwlock, NULL);
+    // 샤드 접근을 동시성 안전(thread-safe) 하게 만들기 위해 rwlock을 초기화한다.
+    // rwlock의 지원
+      // 여러 스레드가 동시에 읽기(read lock) 가능
+      // 단 하나의 스레드만 쓰기(write lock) 가능
+      // 읽기와 쓰기는 동시에 불가능
+    // NULL은 기본 속성으로 초기화 한다는 뜻
+  }
+}
+// 캐시를 빈 상태로 만든다.
+
+//######################################################################################################################################################
+static cache_obj_t* cache_find_unlocked(cache_shard_t *s, const char* key, size_t len, uint64_t hash){
+  for(cache_obj_t* p = s -> buckets[hash & (s -> nbuckets - 1)]; p; p = p -> hnext)
+  // 해시로 고른 버킷 체인만 따라간다(load factor <= 1이라 평균 한두 칸)
+    if(p -> hash == hash && key_equal(p -> key, key, len, hash)) return p;
+    // 64비트 해시가 다르면 키를 따라가지도 않고 바로 건너뛴다 -> 긴 키 비교는 사실상 적중할 때 한 번만
+  return NULL;
+}
+// 샤드 안에서 주어진 key에 해당하는 객체(cache_obj_t)를 찾는다
+// unlocked라는 이름처럼 락을 걸지 않은 상태에서만 사용해야 하는 함수임을 의미한다.
+// 락 제어는 바깥쪽 cache_lookup이나 cache_insert 같은 함수에서 처리한다.
+//######################################################################################################################################################
+static cache_obj_t* cache_make_object(char* const* src, size_t sz){
+  size_t body_off = 0, line_start = 0;
+  for(size_t i = 0; i < sz && !body_off; i++){
+    if(src[i / CACHE_SEG_SIZE][i % CACHE_SEG_SIZE] != '\n') continue;
+    size_t len = i + 1 - line_start;
+    if(line_start > 0 && (len == 1 || (len == 2 && src[line_start / CACHE_SEG_SIZE][line_start % CACHE_SEG_SIZE] == '\r')))
+      body_off = i + 1;
+    line_start = i + 1;
+  }
+  if(!body_off) return NULL;
+  // 세그먼트에 나뉘어 있는 응답에서 헤더를 끝내는 빈 줄을 찾는다(상태줄 다음부터). body_off = 본문 시작 위치
+
+  char* raw = slab_alloc(body_off + 1);
+  seg_copy_out(src, 0, raw, body_off);
+  raw[body_off] = '\0';
+  char* out = slab_alloc(body_off + 64);
+  size_t n = 0, off = 0;
+  bool have_len = false;
+  int status = 0;
+  cache_control_t cc = { .max_age = -1, .s_maxage = -1, .swr = -1 };
+  const char *expires = NULL, *date = NULL;
+  long age = 0;
+  bool validator = false;
+  // 헤더 블록만 연속 메모리로 모아서 줄 단위로 고친다(본문은 아래에서 세그먼트째 옮긴다)
+  // raw는 NUL로 끝낸다: 상태줄/Date/Expires/Age를 읽는 sscanf/atol은 공백(마지막 CRLF 포함)을 건너뛰므로 값이 이상하면 블록 끝을 넘어 읽는다.
+
+  const char* nl = memchr(raw, '\n', body_off);
+  off = nl - raw + 1;
+  memcpy(out, raw, off);
+  n = off;
+  sscanf(raw, "HTTP/%*d.%*d %d", &status);
+  // 상태줄은 그대로(상태 코드는 저장 가능한 응답인지 판단하는 데 쓴다)
+
+  while(1){
+    nl = memchr(raw + off, '\n', body_off - off);
+    const char* line = raw + off;
+    size_t len = nl - line + 1;
+    off += len;
+    if(line[0] == '\r' || line[0] == '\n') break;
+    if(!strncasecmp(line, "Transfer-Encoding:", 18)) goto fail;
+    if(is_hop_header(line)) continue;
+    if(!strncasecmp(line, "Content-Length:", 15)) have_len = true;
+    else if(!strncasecmp(line, "Cache-Control:", 14)) parse_cache_control(line + 14, &cc);
+    else if(!strncasecmp(line, "Expires:", 8)) expires = line + 8;
+    else if(!strncasecmp(line, "Date:", 5)) date = line + 5;
+    else if(!strncasecmp(line, "Age:", 4)) age = atol(line + 4);
+    else if(!strncasecmp(line, "ETag:", 5) || !strncasecmp(line, "Last-Modified:", 14)) validator = true;
+    else if(!strncasecmp(line, "Vary:", 5) && header_has_token(line + 5, "*")) goto fail;
+    memcpy(out + n, line, len);
+    n += len;
+  }
+  // 헤더를 빈 줄까지 옮기면서 hop-by-hop 헤더는 뺀다.
+  // 청크를 안 푼 본문(Transfer-Encoding)은 다시 보낼 때 프레이밍을 맞출 수 없으므로 캐시하지 않는다.
+  // 신선도에 필요한 헤더(Cache-Control, Expires, Date, Age)와 검증자(ETag, Last-Modified)가 있는지는 옮기면서 같이 읽어 둔다
+    // (값은 raw 안을 가리키므로 raw를 풀기 전에 쓴다)
+  // Vary: *는 요청마다 다른 응답이라는 뜻이라 캐시하지 않는다.
+
+  long ttl = response_ttl(status, &cc, expires, date, age);
+  if(ttl < 0 || (ttl == 0 && !validator)) goto fail;
+  // 저장하면 안 되는 응답(no-store/private, 에러 상태 등)이면 캐시하지 않는다.
+  // 받자마자 낡은 응답(no-cache, max-age=0 등)은 검증자가 있을 때만 둔다(다음 요청이 조건부 요청으로 본문 없이 확인할 수 있으므로)
+
+  size_t body = sz - body_off;
+  if(!have_len) n += snprintf(out + n, 64, "Content-Length: %zu\r\n", body);
+  if(n + 2 + body > g_max_object) goto fail;
+  // 길이 없이 끝난 응답(EOF/chunked)은 다 받은 지금 본문 길이를 알 수 있으므로 Content-Length를 채운다.
+  // -> 캐시 히트는 항상 길이를 아는 응답이라 keep-alive 연결로도 보낼 수 있다.
+
+  cache_obj_t* o = slab_alloc(sizeof(cache_obj_t));
+  memset(o, 0, sizeof(cache_obj_t));
+  o -> hdr = slab_alloc(n);
+  memcpy(o -> hdr, out, n);
+  o -> hdr_len = n;
+  o -> body_len = body;
+  o -> size = n + 2 + body;
+  o -> expires = upstream_now() + ttl;
+  o -> swr = response_swr(&cc);
+  o -> nsegs = (int)((body + CACHE_SEG_SIZE - 1) / CACHE_SEG_SIZE);
+  o -> segs = o -> nsegs ? slab_alloc(o -> nsegs * sizeof(char*)) : NULL;
+  for(int k = 0; k < o -> nsegs; k++){
+    size_t at = (size_t)k * CACHE_SEG_SIZE;
+    size_t len = body - at < CACHE_SEG_SIZE ? body - at : CACHE_SEG_SIZE;
+    o -> segs[k] = slab_alloc(len);
+    seg_copy_out(src, body_off + at, o -> segs[k], len);
+  }
+  slab_free(raw, body_off + 1);
+  slab_free(out, body_off + 64);
+  return o;
+  // 엔트리, 헤더 블록, 세그먼트 포인터 배열, 본문 세그먼트 모두 크기 클래스 슬랩에서 받는다.
+  // 헤더 블록은 정리된 길이에 맞는 클래스로 옮기고, 본문의 마지막 세그먼트는 남은 길이에 맞는 작은 클래스를 쓴다
+  // (300바이트 본문이 16KB 세그먼트를 통째로 잡지 않게)
+
+fail:
+  slab_free(raw, body_off + 1);
+  slab_free(out, body_off + 64);
+  return NULL;
+}
+// 중계하면서 세그먼트에 모은 응답 사본(src, sz바이트)을 캐시 엔트리로 만든다(형식이 이상하거나 한도를 넘거나 캐시하면 안 되는 응답이면 NULL)
+// 캐시 형식: Connection 류 헤더 없음 + Content-Length 있음, 헤더 블록(hdr)과 본문 세그먼트(segs)를 따로 들고 있다.
+// 키와 참조 카운트는 cache_insert가 채운다.
+
+//######################################################################################################################################################
+static void parse_cache_control(const char* v, cache_control_t* cc){
+  const char* p = v;
+  while(1){
+    while(*p == ' ' || *p == '\t' || *p == ',') p++;
+    if(!*p || *p == '\r' || *p == '\n') return;
+    const char* name = p;
+    while(*p && *p != '=' && *p != ',' && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+    size_t nlen = p - name;
+    // 지시자 이름(대소문자 무시)
+
+    long val = -1;
+    while(*p == ' ' || *p == '\t') p++;
+    if(*p == '='){
+      p++;
+      char* end;
+      const char* num = *p == '"' ? p + 1 : p;
+      val = strtol(num, &end, 10);
+      if(end == num || val < 0) val = -1;
+      while(*p && *p != ',' && *p != '\r' && *p != '\n'){
+        if(*p == '"'){
+          p++;
+          while(*p && *p != '"' && *p != '\r' && *p != '\n') p++;
+          if(*p == '"') p++;
+        }
+        else p++;
+      }
+    }
+    // "=값"이 있으면 숫자로 읽고(따옴표로 감싼 것도 허용), 따옴표 안의 쉼표(private="Set-Cookie, X")에 속지 않게 값 끝까지 건너뛴다.
+
+    if(nlen == 8 && !strncasecmp(name, "no-store", 8)) cc -> no_store = true;
+    else if(nlen == 8 && !strncasecmp(name, "no-cache", 8)) cc -> no_cache = true;
+    else if(nlen == 7 && !strncasecmp(name, "private", 7)) cc -> priv = true;
+    else if(nlen == 7 && !strncasecmp(name, "max-age", 7)) cc -> max_age = val;
+    else if(nlen == 8 && !strncasecmp(name, "s-maxage", 8)) cc -> s_maxage = val;
+    else if(nlen == 22 && !strncasecmp(name, "stale-while-revalidate", 22)) cc -> swr = val;
+    else if((nlen == 15 && !strncasecmp(name, "must-revalidate", 15)) || (nlen == 16 && !strncasecmp(name, "proxy-revalidate", 16)))
+      cc -> must_revalidate = true;
+    // 모르는 지시자는 무시한다.
+  }
+}
+// Cache-Control 헤더 값 하나를 읽어 cc에 더한다(헤더가 여러 줄이면 줄마다 불러서 합친다)
+
+//######################################################################################################################################################
+static time_t parse_http_date(const char* s){
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  char wkday[4], mon[4];
+  int d, y, hh, mm, ss;
+  while(*s == ' ' || *s == '\t') s++;
+  if(sscanf(s, "%3s, %d %3s %d %d:%d:%d GMT", wkday, &d, mon, &y, &hh, &mm, &ss) != 7) return -1;
+  const char* m = strstr(months, mon);
+  if(!m || (m - months) % 3 || strlen(mon) != 3) return -1;
+  int mo = (int)(m - months) / 3 + 1;
+  // HTTP 날짜(IMF-fixdate: "Sun, 06 Nov 1994 08:49:37 GMT")만 받는다. 다른 형식이나 "0" 같은 값은 -1
+
+  y -= mo <= 2;
+  long era = (y >= 0 ? y : y - 399) / 400;
+  long yoe = y - era * 400;
+  long doy = (153 * (mo + (mo > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  long days = era * 146097 + doe - 719468;
+  return (time_t)days * 86400 + hh * 3600 + mm * 60 + ss;
+  // 1970-01-01부터의 날 수(그레고리력, 3월을 한 해의 시작으로 보고 윤년을 400/100/4년 주기로 센다) -> UTC 초
+  // timegm/strptime은 _GNU_SOURCE가 필요해서(csapp.h와 충돌) 직접 계산한다.
+}
+// HTTP 날짜를 time_t(UTC 초)로. 못 읽으면 -1
+
+//######################################################################################################################################################
+static long response_ttl(int status, const cache_control_t* cc, const char* expires, const char* date, long age){
+  if(cc -> no_store || cc -> priv) return -1;
+  // no-store: 어디에도 저장 금지, private: 공유 캐시(프록시)는 저장 금지
+
+  bool cacheable_status = status == 200 || status == 203 || status == 204 || status == 300 || status == 301 ||
+    status == 308 || status == 404 || status == 405 || status == 410 || status == 414 || status == 501;
+  // 기본으로 캐시해도 되는 상태 코드(RFC 9110 heuristically cacheable). 원서버 에러(5xx)나 400 같은 응답은 캐시하지 않는다.
+
+  long life;
+  if(cc -> s_maxage >= 0) life = cc -> s_maxage;
+  else if(cc -> max_age >= 0) life = cc -> max_age;
+  else if(expires){
+    time_t e = parse_http_date(expires);
+    time_t d = date ? parse_http_date(date) : -1;
+    if(d < 0) d = time(NULL);
+    life = e < 0 ? 0 : (long)(e - d);
+  }
+  else{
+    if(!cacheable_status) return -1;
+    life = g_default_ttl;
+  }
+  // 신선 수명(freshness lifetime) 우선순위: s-maxage(공유 캐시 전용) > max-age > Expires - Date > 기본값(-t)
+  // 잘못된 Expires(예: "0")는 이미 만료된 것으로 본다.
+  if(!cacheable_status && status != 302 && status != 307) return -1;
+  // 신선도를 명시했으면 임시 리다이렉트도 캐시할 수 있다.
+  if(cc -> no_cache) return 0;
+  // no-cache: 저장은 되지만 쓸 때마다 원서버 확인이 필요하다 -> 받자마자 만료된 것으로 둔다.
+
+  life -= age > 0 ? age : 0;
+  return life > 0 ? life : 0;
+  // 원서버/상위 캐시에서 이미 흐른 시간(Age)만큼 뺀 남은 수명
+}
+// 응답을 캐시에 얼마나 둘 수 있는지(초). 저장하면 안 되면 -1, 이미 신선하지 않으면 0
+
+//######################################################################################################################################################
+static uint32_t response_swr(const cache_control_t* cc){
+  if(cc -> no_cache || cc -> must_revalidate) return 0;
+  long w = cc -> swr >= 0 ? cc -> swr : g_default_swr;
+  return w > UINT32_MAX ? UINT32_MAX : (uint32_t)w;
+}
+// 만료 뒤 낡은 사본을 바로 보내도 되는 시간(초): 원서버의 stale-while-revalidate, 없으면 -w 기본값
+// no-cache나 must-revalidate/proxy-revalidate면 항상 확인을 기다린다.
+
+//######################################################################################################################################################
+static int cache_obj_iov(cache_obj_t* o, bool keepalive, struct iovec* iov){
+  static const char ka[] = "Connection: keep-alive\r\n\r\n";
+  static const char cl[] = "Connection: close\r\n\r\n";
+  iov[0].iov_base = o -> hdr;
+  iov[0].iov_len = o -> hdr_len;
+  iov[1].iov_base = (void*)(keepalive ? ka : cl);
+  iov[1].iov_len = keepalive ? sizeof(ka) - 1 : sizeof(cl) - 1;
+  int cnt = 2;
+  for(int k = 0; k < o -> nsegs; k++){
+    size_t at = (size_t)k * CACHE_SEG_SIZE;
+    iov[cnt].iov_base = o -> segs[k];
+    iov[cnt].iov_len = o -> body_len - at < CACHE_SEG_SIZE ? o -> body_len - at : CACHE_SEG_SIZE;
+    cnt++;
+  }
+  return cnt;
+}
+// 캐시 엔트리를 보낼 조각들: 헤더 | Connection 헤더 + 빈 줄 | 본문 세그먼트들 (엔트리 데이터는 복사하지 않는다)
+// iov는 o -> nsegs + 3칸 이상이어야 한다.
+
+//######################################################################################################################################################
+static void key_init(void){
+  for(int i = 0; i < KEY_STRIPES; i++){
+    key_stripe_t* ks = &g_keys[i];
+    pthread_mutex_init(&ks -> lock, NULL);
+    ks -> nbuckets = KEY_INIT_BUCKETS;
+    ks -> buckets = Calloc(ks -> nbuckets, sizeof(cache_key_t*));
+    ks -> count = ks -> bytes = 0;
+  }
+}
+
+//######################################################################################################################################################
+static key_stripe_t* key_stripe_of(uint64_t hash){
+  return &g_keys[(hash >> 40) % KEY_STRIPES];
+}
+// 줄무늬는 샤드(>> 32)나 버킷(하위 비트)과 다른 비트로 고른다.
+
+//######################################################################################################################################################
+static bool key_equal(const cache_key_t* k, const char* str, size_t len, uint64_t hash){
+  return k -> hash == hash && k -> len == len && !memcmp(k -> str, str, len);
+}
+// 해시 -> 길이 -> 바이트 순서로 비교한다(앞의 두 개가 다르면 문자열은 읽지 않는다)
+
+//######################################################################################################################################################
+static cache_key_t* key_intern(const char* str, size_t len, uint64_t hash){
+  key_stripe_t* ks = key_stripe_of(hash);
+  pthread_mutex_lock(&ks -> lock);
+  cache_key_t* k = ks -> buckets[hash & (ks -> nbuckets - 1)];
+  while(k && !key_equal(k, str, len, hash)) k = k -> next;
+  if(k){
+    k -> refs++;
+    pthread_mutex_unlock(&ks -> lock);
+    return k;
+  }
+  // 이미 있으면 참조만 하나 늘려서 같은 키를 공유한다.
+
+  size_t sz = sizeof(cache_key_t) + len + 1;
+  k = slab_alloc(sz);
+  k -> hash = hash;
+  k -> refs = 1;
+  k -> len = (uint32_t)len;
+  memcpy(k -> str, str, len);
+  k -> str[len] = '\0';
+  cache_key_t** b = &ks -> buckets[hash & (ks -> nbuckets - 1)];
+  k -> next = *b;
+  *b = k;
+  ks -> bytes += sz;
+  if(++ks -> count > ks -> nbuckets) key_grow(ks);
+  pthread_mutex_unlock(&ks -> lock);
+  return k;
+  // 없으면 실제 길이만큼만(헤더 + 문자열) 슬랩에서 받아 테이블에 건다.
+}
+// 키 문자열의 공유 사본을 돌려준다(참조 하나를 잡은 채로, 다 쓰면 key_release)
+
+//######################################################################################################################################################
+static void key_release(cache_key_t* k){
+  key_stripe_t* ks = key_stripe_of(k -> hash);
+  pthread_mutex_lock(&ks -> lock);
+  if(--k -> refs > 0){
+    pthread_mutex_unlock(&ks -> lock);
+    return;
+  }
+  cache_key_t** pp = &ks -> buckets[k -> hash & (ks -> nbuckets - 1)];
+  while(*pp != k) pp = &(*pp) -> next;
+  *pp = k -> next;
+  ks -> count--;
+  ks -> bytes -= sizeof(cache_key_t) + k -> len + 1;
+  pthread_mutex_unlock(&ks -> lock);
+  slab_free(k, sizeof(cache_key_t) + k -> len + 1);
+}
+// 참조를 내려놓고 마지막이면 테이블에서 빼고 해제한다.
+// 감소와 제거를 같은 락 안에서 해야, 0이 된 키를 다른 스레드가 그 사이에 다시 인터닝해서 잡는 일이 없다.
+
+//######################################################################################################################################################
+static void key_grow(key_stripe_t* ks){
+  size_t nb = ks -> nbuckets * 2;
+  cache_key_t** nbk = Calloc(nb, sizeof(cache_key_t*));
+  for(size_t i = 0; i < ks -> nbuckets; i++){
+    cache_key_t* k = ks -> buckets[i];
+    while(k){
+      cache_key_t* next = k -> next;
+      cache_key_t** b = &nbk[k -> hash & (nb - 1)];
+      k -> next = *b;
+      *b = k;
+      k = next;
+    }
+  }
+  Free(ks -> buckets);
+  ks -> buckets = nbk;
+  ks -> nbuckets = nb;
+}
+// 줄무늬의 버킷 수를 두 배로(저장해 둔 해시로 재배치, ht_grow와 같은 방식)
+
+//######################################################################################################################################################
+static void slab_init(void){
+  memset(&g_slab, 0, sizeof(g_slab));
+  for(int i = 0; i < SLAB_CLASSES; i++){
+    g_slab.classes[i].size = (size_t)1 << (SLAB_MIN_SHIFT + i);
+    pthread_mutex_init(&g_slab.classes[i].lock, NULL);
+  }
+}
+// 클래스 크기(64B << i)와 클래스별 락 준비. 칸은 처음 요청이 올 때 잘라 낸다.
+
+//######################################################################################################################################################
+static int slab_class_of(size_t n){
+  int c = 0;
+  while(c < SLAB_CLASSES && g_slab.classes[c].size < n) c++;
+  return c;
+}
+// n바이트가 들어가는 가장 작은 클래스(없으면 SLAB_CLASSES = Malloc으로 보냄)
+
+//######################################################################################################################################################
+static void* slab_alloc(size_t n){
+  int c = slab_class_of(n);
+  if(c == SLAB_CLASSES){
+    atomic_fetch_add_explicit(&g_slab.large_allocs, 1, memory_order_relaxed);
+    return Malloc(n);
+  }
+  slab_class_t* sc = &g_slab.classes[c];
+  pthread_mutex_lock(&sc -> lock);
+  if(!sc -> free){
+    char* chunk = Malloc(sc -> size * SLAB_CHUNK_OBJS);
+    for(int i = SLAB_CHUNK_OBJS - 1; i >= 0; i--){
+      char* p = chunk + (size_t)i * sc -> size;
+      *(void**)p = sc -> free;
+      sc -> free = p;
+    }
+    sc -> nobjs += SLAB_CHUNK_OBJS;
+    sc -> nfree += SLAB_CHUNK_OBJS;
+  }
+  // free 리스트가 비면 큰 덩어리 하나를 받아 칸으로 잘라 넣는다(malloc 한 번으로 칸 64개)
+  void* p = sc -> free;
+  sc -> free = *(void**)p;
+  sc -> nfree--;
+  sc -> req_bytes += n;
+  sc -> allocs++;
+  pthread_mutex_unlock(&sc -> lock);
+  return p;
+}
+// n바이트 이상인 칸 하나를 꺼낸다. 해제할 때는 같은 n을 slab_free에 넘겨야 한다(칸 머리에 크기를 적어 두지 않으므로)
+
+//######################################################################################################################################################
+static void slab_free(void* p, size_t n){
+  int c = slab_class_of(n);
+  if(c == SLAB_CLASSES){
+    Free(p);
+    return;
+  }
+  slab_class_t* sc = &g_slab.classes[c];
+  pthread_mutex_lock(&sc -> lock);
+  *(void**)p = sc -> free;
+  sc -> free = p;
+  sc -> nfree++;
+  sc -> req_bytes -= n;
+  pthread_mutex_unlock(&sc -> lock);
+}
+// 칸을 클래스의 free 리스트 맨 앞에 돌려놓는다(방금 쓴 칸이 먼저 재사용돼 CPU 캐시에 남아 있을 가능성이 높다)
+
+//######################################################################################################################################################
+static char* seg_alloc(void){
+  return slab_alloc(CACHE_SEG_SIZE);
+}
+
+//######################################################################################################################################################
+static void seg_free(char* seg){
+  slab_free(seg, CACHE_SEG_SIZE);
+}
+// 꽉 채워 쓰는 16KB 세그먼트(채우는 중인 응답, 이벤트 루프 모드의 사본)
+
+//######################################################################################################################################################
+static void arena_init(arena_t* a){
+  a -> head = NULL;
+}
+
+//######################################################################################################################################################
+static void* arena_alloc(arena_t* a, size_t n){
+  n = (n + 15) & ~(size_t)15;
+  arena_block_t* b = a -> head;
+  if(!b || b -> cap - b -> used < n){
+    size_t cap = n > ARENA_BLOCK_SIZE ? n : ARENA_BLOCK_SIZE;
+    arena_block_t* nb = Malloc(sizeof(arena_block_t) + cap);
+    nb -> cap = cap;
+    nb -> used = 0;
+    nb -> next = b;
+    if(b) atomic_fetch_add_explicit(&g_arena_stats.overflow_blocks, 1, memory_order_relaxed);
+    a -> head = b = nb;
+  }
+  // 지금 블록에 자리가 없으면 새 블록을 앞에 붙인다(기본 크기보다 큰 요청은 그 크기에 맞춰서)
+  void* p = b -> data + b -> used;
+  b -> used += n;
+  return p;
+}
+// n바이트를 16바이트 정렬로 밀어 쓰기 할당한다(개별 해제 없음)
+
+//######################################################################################################################################################
+static void arena_reset(arena_t* a){
+  size_t used = 0;
+  while(a -> head && a -> head -> next){
+    arena_block_t* b = a -> head;
+    used += b -> used;
+    a -> head = b -> next;
+    Free(b);
+  }
+  if(a -> head){
+    used += a -> head -> used;
+    a -> head -> used = 0;
+  }
+  // 더 붙인 블록은 해제하고 첫 블록(맨 끝)만 비워서 남긴다.
+
+  atomic_fetch_add_explicit(&g_arena_stats.resets, 1, memory_order_relaxed);
+  size_t peak = atomic_load_explicit(&g_arena_stats.peak, memory_order_relaxed);
+  while(used > peak && !atomic_compare_exchange_weak(&g_arena_stats.peak, &peak, used));
+}
+// 요청 하나가 끝났을 때 그 요청이 쓴 버퍼를 한꺼번에 돌려받는다.
+
+//######################################################################################################################################################
+static void arena_destroy(arena_t* a){
+  arena_reset(a);
+  Free(a -> head);
+  a -> head = NULL;
+}
+// 연결이 끝날 때 남은 첫 블록까지 해제한다.
+
+//######################################################################################################################################################
+static void seg_copy_out(char* const* segs, size_t off, char* dst, size_t n){
+  while(n > 0){
+    size_t o = off % CACHE_SEG_SIZE;
+    size_t m = CACHE_SEG_SIZE - o < n ? CACHE_SEG_SIZE - o : n;
+    memcpy(dst, segs[off / CACHE_SEG_SIZE] + o, m);
+    dst += m;
+    off += m;
+    n -= m;
+  }
+}
+// 세그먼트에 나뉘어 있는 바이트 [off, off + n)을 dst로 복사한다.
+
+//######################################################################################################################################################
+static void seglist_append(seglist_t* sl, const char* buf, size_t n){
+  while(n > 0){
+    size_t o = sl -> len % CACHE_SEG_SIZE;
+    if(o == 0){
+      if(sl -> n == sl -> cap){
+        sl -> cap = sl -> cap ? sl -> cap * 2 : 4;
+        sl -> segs = Realloc(sl -> segs, sl -> cap * sizeof(char*));
+      }
+      sl -> segs[sl -> n++] = seg_alloc();
+    }
+    // 마지막 세그먼트가 꽉 찼으면(또는 처음이면) 새 세그먼트를 붙인다.
+    size_t m = CACHE_SEG_SIZE - o < n ? CACHE_SEG_SIZE - o : n;
+    memcpy(sl -> segs[sl -> n - 1] + o, buf, m);
+    sl -> len += m;
+    buf += m;
+    n -= m;
+  }
+}
+// 세그먼트 리스트 뒤에 n바이트를 붙인다.
+
+//######################################################################################################################################################
+static void seglist_free(seglist_t* sl){
+  for(int i = 0; i < sl -> n; i++) seg_free(sl -> segs[i]);
+  Free(sl -> segs);
+  memset(sl, 0, sizeof(*sl));
+}
+
+//######################################################################################################################################################
+static size_t parse_size(const char* s){
+  char* end;
+  unsigned long long v = strtoull(s, &end, 10);
+  if(end == s) return 0;
+  if(*end == 'k' || *end == 'K') v <<= 10, end++;
+  else if(*end == 'm' || *end == 'M') v <<= 20, end++;
+  else if(*end == 'g' || *end == 'G') v <<= 30, end++;
+  if(*end) return 0;
+  return (size_t)v;
+}
+// "512K", "8M" 같은 크기 인자를 바이트로 바꾼다(형식이 틀리거나 0이면 0)
+
+//######################################################################################################################################################
+static void flight_init(void){
+  memset(&g_flights, 0, sizeof(g_flights));
+  pthread_mutex_init(&g_flights.lock, NULL);
+}
+
+//######################################################################################################################################################
+static flight_t* flight_join(const char* key, uint64_t hash, bool* leader){
+  size_t len = strlen(key);
+  pthread_mutex_lock(&g_flights.lock);
+  flight_t** fp = &g_flights.buckets[hash % FLIGHT_BUCKETS];
+  while(*fp && !key_equal((*fp) -> key, key, len, hash)) fp = &(*fp) -> next;
+  flight_t* f = *fp;
+  if(f){
+    atomic_fetch_add(&f -> refs, 1);
+    *leader = false;
+    atomic_fetch_add(&g_flights.coalesced, 1);
+  }
+  else{
+    f = flight_new(key, hash);
+    f -> listed = true;
+    *fp = f;
+    *leader = true;
+    atomic_fetch_add(&g_flights.leaders, 1);
+  }
+  pthread_mutex_unlock(&g_flights.lock);
+  return f;
+}
+// 키의 진행 중인 미스에 합류한다. 아직 없으면 새로 만들고 내가 리더(*leader = true)
+// 리더가 끝나 테이블에서 빠진 직후에 미스가 난 요청은 새 리더가 된다(캐시 삽입이 거절된 경우에도 다시 가져오도록)
+
+//######################################################################################################################################################
+static flight_t* flight_new(const char* key, uint64_t hash){
+  flight_t* f = slab_alloc(sizeof(flight_t));
+  memset(f, 0, sizeof(flight_t));
+  f -> key = key_intern(key, strlen(key), hash);
+  f -> hash = hash;
+  atomic_init(&f -> refs, 1);
+  pthread_mutex_init(&f -> lock, NULL);
+  pthread_cond_init(&f -> cond, NULL);
+  f -> state = FILL_FILLING;
+  return f;
+}
+// 빈 항목 하나(참조는 만든 쪽 하나). 테이블에 올리지 않고 쓰면 리더가 실패해 직접 가져오는 팔로워의 전용 버퍼가 된다.
+// 키는 인터닝해 두므로 리더가 끝나고 캐시에 넣을 때 엔트리가 같은 키 문자열을 그대로 공유한다.
+
+//######################################################################################################################################################
+static int flight_append(flight_t* f, const char* buf, size_t n){
+  pthread_mutex_lock(&f -> lock);
+  if(f -> state != FILL_FILLING || f -> len + n > FILL_MAX_SIZE){
+    f -> state = FILL_ABORTED;
+    pthread_cond_broadcast(&f -> cond);
+    pthread_mutex_unlock(&f -> lock);
+    return -1;
+  }
+  // 붙잡아 둘 수 있는 크기를 넘으면 채우기를 중단하고 팔로워들을 깨운다.
+  while(n > 0){
+    size_t seg = f -> len / FILL_SEG_SIZE, off = f -> len % FILL_SEG_SIZE;
+    if(!f -> segs[seg]){
+      f -> segs[seg] = seg_alloc();
+      atomic_fetch_add(&g_flights.fill_bytes, FILL_SEG_SIZE);
+    }
+    size_t m = FILL_SEG_SIZE - off < n ? FILL_SEG_SIZE - off : n;
+    memcpy(f -> segs[seg] + off, buf, m);
+    f -> len += m;
+    buf += m;
+    n -= m;
+  }
+  // 조각이 차면 다음 조각을 할당해 이어 쓴다(이미 쓴 바이트는 옮기지 않으므로 팔로워가 락 없이 읽어도 된다)
+  pthread_cond_broadcast(&f -> cond);
+  pthread_mutex_unlock(&f -> lock);
+  return 0;
+}
+// 리더: 받은 바이트를 뒤에 붙이고 따라 읽는 팔로워들을 깨운다. 채우기가 중단됐으면 -1
+
+//######################################################################################################################################################
+static void flight_header(flight_t* f, size_t hdr_len, bool framed, bool can_chunk){
+  pthread_mutex_lock(&f -> lock);
+  f -> hdr_len = hdr_len;
+  f -> framed = framed;
+  f -> can_chunk = can_chunk;
+  pthread_cond_broadcast(&f -> cond);
+  pthread_mutex_unlock(&f -> lock);
+}
+// 리더: 헤더를 다 받았음을 알린다(hdr_len = 빈 줄 위치). 팔로워는 이것을 받아야 자기 클라이언트에 맞는 헤더를 보낼 수 있다.
+
+//######################################################################################################################################################
+static bool flight_unshare(flight_t* f){
+  bool alone = false;
+  pthread_mutex_lock(&g_flights.lock);
+  if(atomic_load(&f -> refs) == 1){
+    alone = true;
+    if(f -> listed){
+      flight_t** fp = &g_flights.buckets[f -> hash % FLIGHT_BUCKETS];
+      while(*fp != f) fp = &(*fp) -> next;
+      *fp = f -> next;
+      f -> listed = false;
+    }
+  }
+  pthread_mutex_unlock(&g_flights.lock);
+  return alone;
+}
+// 리더: 따라 읽는 팔로워가 없으면 테이블에서 빼고 true(이후로는 아무도 합류할 수 없으니 더 붙일 필요가 없다)
+// 팔로워 합류(refs 증가)도 테이블 락 안에서 일어나므로, 확인과 빼기 사이에 새 팔로워가 끼어들 수 없다.
+
+//######################################################################################################################################################
+static void flight_detach(flight_t* f){
+  pthread_mutex_lock(&g_flights.lock);
+  if(f -> listed){
+    flight_t** fp = &g_flights.buckets[f -> hash % FLIGHT_BUCKETS];
+    while(*fp != f) fp = &(*fp) -> next;
+    *fp = f -> next;
+    f -> listed = false;
+  }
+  pthread_mutex_unlock(&g_flights.lock);
+  // 테이블에서 빼면 새 미스는 더 합류하지 않는다.
+
+  pthread_mutex_lock(&f -> lock);
+  f -> detached = true;
+  pthread_cond_broadcast(&f -> cond);
+  pthread_mutex_unlock(&f -> lock);
+}
+// 리더: 헤더를 알리기 전에 팔로워들을 떼어 낸다. 헤더를 기다리던 팔로워는 아무것도 안 보낸 채 -1을 받고 직접 가져온다.
+// flight_unshare와 달리 팔로워가 있어도 된다. 리더는 같은 fill에 계속 붙여서 자기 클라이언트/캐시 사본으로 쓴다.
+
+//######################################################################################################################################################
+static void flight_finish(flight_t* f, bool ok){
+  pthread_mutex_lock(&g_flights.lock);
+  if(f -> listed){
+    flight_t** fp = &g_flights.buckets[f -> hash % FLIGHT_BUCKETS];
+    while(*fp != f) fp = &(*fp) -> next;
+    *fp = f -> next;
+    f -> listed = false;
+  }
+  pthread_mutex_unlock(&g_flights.lock);
+  // 테이블에서 빼면 이후 미스는 캐시를 보거나 새 리더가 된다.
+
+  pthread_mutex_lock(&f -> lock);
+  if(f -> state == FILL_FILLING) f -> state = ok ? FILL_COMPLETE : FILL_ABORTED;
+  pthread_cond_broadcast(&f -> cond);
+  pthread_mutex_unlock(&f -> lock);
+  flight_put(f);
+}
+// 리더: 채우기를 끝내고(ok = 응답을 끝까지 받음) 따라 읽던 팔로워들을 모두 깨운 뒤 내 참조를 내려놓는다.
+
+//######################################################################################################################################################
+static void flight_put(flight_t* f){
+  if(atomic_fetch_sub(&f -> refs, 1) != 1) return;
+  for(int i = 0; i < FILL_MAX_SEGS && f -> segs[i]; i++){
+    seg_free(f -> segs[i]);
+    atomic_fetch_sub(&g_flights.fill_bytes, FILL_SEG_SIZE);
+  }
+  pthread_mutex_destroy(&f -> lock);
+  pthread_cond_destroy(&f -> cond);
+  key_release(f -> key);
+  slab_free(f, sizeof(flight_t));
+}
+// 참조 하나를 내려놓고 마지막이면 받은 응답 조각들과 항목을 해제한다.
+// 테이블에 있는 동안은 리더가 참조를 쥐고 있으므로, 테이블 락 안에서 합류(refs 증가)하는 팔로워가 해제된 항목을 볼 일은 없다.
+
+//######################################################################################################################################################
+static int flight_stream(flight_t* f, relay_t* r){
+  size_t off = 0, end, hdr_len;
+  fill_state_t state;
+
+  pthread_mutex_lock(&f -> lock);
+  while(f -> hdr_len == 0 && f -> state == FILL_FILLING && !f -> detached) pthread_cond_wait(&f -> cond, &f -> lock);
+  hdr_len = f -> detached ? 0 : f -> hdr_len;
+  bool framed = f -> framed, can_chunk = f -> can_chunk;
+  pthread_mutex_unlock(&f -> lock);
+  if(hdr_len == 0) return -1;
+  // 헤더가 올 때까지 잠든다. 리더가 헤더도 못 받고 실패했거나 응답을 나눠 주지 않기로 했으면(detached)
+  // 아직 아무것도 안 보냈으니 -1(호출자가 직접 가져온다)
+
+  bool in_body = false;
+  while(r -> client_ok){
+    pthread_mutex_lock(&f -> lock);
+    while(f -> len == off && f -> state == FILL_FILLING) pthread_cond_wait(&f -> cond, &f -> lock);
+    end = f -> len;
+    state = f -> state;
+    pthread_mutex_unlock(&f -> lock);
+    // 새 바이트가 붙거나 채우기가 끝날 때까지 잠든다. [off, end)는 이미 쓰인 조각이라 락을 놓고 읽어도 된다.
+    if(state == FILL_ABORTED) break;
+
+    while(off < end && r -> client_ok){
+      if(!in_body && off == hdr_len){
+        relay_finish_headers(r, framed, can_chunk);
+        relay_send(r, "\r\n", 2);
+        off += 2;
+        in_body = true;
+        continue;
+      }
+      size_t seg = off / FILL_SEG_SIZE, o = off % FILL_SEG_SIZE;
+      size_t lim = in_body ? end : hdr_len;
+      size_t m = FILL_SEG_SIZE - o < lim - off ? FILL_SEG_SIZE - o : lim - off;
+      if(in_body) relay_body_out(r, f -> segs[seg] + o, m);
+      else relay_send(r, f -> segs[seg] + o, m);
+      off += m;
+    }
+    // 헤더(hop-by-hop을 뺀 것)는 그대로, 헤더 끝에서 내 연결에 맞는 Connection/Transfer-Encoding을 끼우고, 본문은 청크로 묶거나 그대로 보낸다.
+    if(state == FILL_COMPLETE && off == end){
+      if(r -> chunk_out) relay_send(r, "0\r\n\r\n", 5);
+      return 0;
+    }
+  }
+  r -> keepalive = false;
+  return 0;
+  // 리더가 중간에 실패했거나(응답이 잘림) 내 클라이언트가 끊김 -> 이미 헤더를 보냈으니 연결을 닫아 끝을 알린다.
+}
+// 팔로워: 리더가 채우는 응답을 처음부터 따라 읽으며 도착하는 대로 내 클라이언트에 보낸다(큰 응답도 리더가 다 받을 때까지 기다리지 않음)
+// 반환: -1 = 아무것도 안 보낸 채 리더가 실패, 0 = 보냄(r -> keepalive: 이 연결을 계속 쓸 수 있는지)
+
+//######################################################################################################################################################
+static cache_obj_t* cache_lookup(const char* key, uint64_t hash, int* state){
+  cache_obj_t* obj = NULL;
+  size_t len = strlen(key);
+  time_t now = upstream_now();
+  bool stale = false;
+  cache_shard_t* s = cache_shard_of(hash);
+  // 반환값: 히트면 참조 카운트를 하나 올린 엔트리, 미스면 NULL
+  // state가 NULL이면 신선한 엔트리만 돌려준다. 아니면 만료된 엔트리도 돌려주고 *state에 CACHE_FRESH/STALE_SWR/STALE를 알린다.
+  // 호출자는 엔트리의 헤더/본문을 다 쓴 뒤 반드시 cache_release(obj)를 불러야 한다.
+  // 이 키가 속한 샤드의 락만 잡는다. 다른 샤드를 조회하는 스레드와는 경쟁하지 않는다.
+
+  pthread_rwlock_rdlock(&s -> rwlock);
+  // 읽기 락(rdlock)으로 샤드를 보호하며 검색 -> 동시 다중 조회 허용
+  if(g_policy -> record) g_policy -> record(s, hash);
+  obj = cache_find_unlocked(s, key, len, hash);
+  if(state) *state = CACHE_FRESH;
+  if(obj && obj -> expires <= now){
+    stale = true;
+    if(state) *state = now < obj -> expires + (time_t)obj -> swr ? CACHE_STALE_SWR : CACHE_STALE;
+    else obj = NULL;
+  }
+  // 신선도가 지난 엔트리는 지우지 않는다(조건부 요청의 검증자로 쓰고, 304면 제자리에서 갱신, 새 응답이 오면 같은 키로 교체된다)
+  // 조건부 요청을 못 하는 호출자(이벤트 루프 모드)에게는 미스로 보인다.
+  if(obj){
+    atomic_fetch_add(&obj -> refcnt, 1);
+    if(g_policy -> hit_shared) g_policy -> hit_shared(s, obj);
+  }
+  pthread_rwlock_unlock(&s -> rwlock);
+  atomic_fetch_add_explicit(&g_policy -> lookups, 1, memory_order_relaxed);
+  if(stale) atomic_fetch_add_explicit(&g_policy -> expired, 1, memory_order_relaxed);
+  if(obj && !stale){
+    atomic_fetch_add_explicit(&g_policy -> hits, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_policy -> hit_bytes, obj -> size, memory_order_relaxed);
+  }
+  // 찾으면(히트) 데이터를 복사하지 않고 참조만 하나 올려서 엔트리를 고정(pin)한다.
+  // 읽기 락 아래에서는 여러 스레드가 동시에 올릴 수 있으므로 원자적 증가를 쓴다.
+  // 락 안에서 올려야 축출하는 쪽이 캐시 참조를 내려놓기 전에 우리 참조가 먼저 잡힌다.
+  // CLOCK 계열 정책은 hit_shared에서 참조 비트만 세우고 끝 -> 히트 경로에서 쓰기 락을 전혀 잡지 않아 읽기가 완전히 병렬로 돈다.
+
+  if(obj && g_policy -> hit_exclusive){
+    pthread_rwlock_wrlock(&s -> rwlock);
+    // 히트 때 리스트를 고쳐야 하는 정책(LRU)만 쓰기 락(wrlock)을 걸어 갱신
+    if(cache_find_unlocked(s, key, len, hash) == obj) g_policy -> hit_exclusive(s, obj);
+    // 방금 락을 풀었다가 다시 잡았기 때문에 그 사이에 축출/교체됐을 수 있어 아직 같은 엔트리가 캐시에 있을 때만 고친다.
+    pthread_rwlock_unlock(&s -> rwlock);
+  }
+  return obj;
+}
+// 쓰기 락 구간을 아주 짧게 유지하므로 여러 리더 동시성 + 최소한의 라이터 충돌을 달성
+
+//######################################################################################################################################################
+static void cache_release(cache_obj_t *o){
+  if(atomic_fetch_sub(&o -> refcnt, 1) == 1){
+    for(int i = 0; i < o -> nsegs; i++){
+      size_t at = (size_t)i * CACHE_SEG_SIZE;
+      slab_free(o -> segs[i], o -> body_len - at < CACHE_SEG_SIZE ? o -> body_len - at : CACHE_SEG_SIZE);
+    }
+    if(o -> segs) slab_free(o -> segs, o -> nsegs * sizeof(char*));
+    slab_free(o -> hdr, o -> hdr_len);
+    if(o -> key) key_release(o -> key);
+    slab_free(o, sizeof(cache_obj_t));
+  }
+}
+// 참조 하나를 내려놓는다. 방금 내려놓은 게 마지막 참조(이전 값 1)면 엔트리를 해제한다.
+// 캐시에서 이미 빠진(축출/교체된) 엔트리는 이 시점에 해제되고, 아직 캐시에 있으면 캐시 참조가 남아 있어 그대로 유지된다.
+
+//######################################################################################################################################################
+static void cache_refresh(cache_obj_t* o, const cache_control_t* cc, const char* expires, const char* date, long age){
+  long ttl = response_ttl(200, cc, expires, date, age);
+  if(ttl < 0) ttl = 0;
+  uint32_t swr = response_swr(cc);
+  time_t now = upstream_now();
+  cache_shard_t* s = cache_shard_of(o -> hash);
+  pthread_rwlock_wrlock(&s -> rwlock);
+  o -> expires = now + ttl;
+  o -> swr = swr;
+  pthread_rwlock_unlock(&s -> rwlock);
+  if(g_disk.enabled) disk_touch(o -> hash, time(NULL) + ttl, swr);
+  // 디스크 사본의 신선도도 같이 늘린다(재시작 뒤에 또 확인하지 않게)
+}
+// 304로 확인된 엔트리의 신선도를 304 헤더 기준으로 다시 잡는다(헤더/본문은 그대로, 캐시에서 이미 빠진 엔트리여도 무해)
+// 304가 신선도를 안 알려 주면 원래 응답처럼 기본 TTL을 쓴다. no-store 같은 지시자가 와도 이번 요청은 확인된 사본으로 답하고 다음엔 다시 확인한다.
+
+//######################################################################################################################################################
+static const char* cache_obj_header(const cache_obj_t* o, const char* name, size_t* vlen){
+  size_t nlen = strlen(name);
+  const char* p = o -> hdr;
+  const char* end = o -> hdr + o -> hdr_len;
+  while(p < end){
+    const char* nl = memchr(p, '\n', end - p);
+    if(!nl) break;
+    if((size_t)(nl - p) > nlen && !strncasecmp(p, name, nlen)){
+      const char* v = p + nlen;
+      const char* e = nl;
+      while(v < e && (*v == ' ' || *v == '\t')) v++;
+      while(e > v && (e[-1] == '\r' || e[-1] == ' ' || e[-1] == '\t')) e--;
+      *vlen = e - v;
+      return v;
+    }
+    p = nl + 1;
+  }
+  return NULL;
+}
+// 캐시 엔트리의 헤더 블록에서 name("ETag:" 처럼 콜론 포함) 헤더 값을 찾는다(앞뒤 공백/CR 제외, 길이는 *vlen). 없으면 NULL
+// 헤더 블록은 삽입 후 바뀌지 않으므로 락 없이 읽는다.
+
+//######################################################################################################################################################
+static cache_obj_t* cache_insert(const char *key, uint64_t hash, cache_obj_t *o){
+  if(!o) return NULL;
+  size_t len = strlen(key);
+  cache_shard_t* s = cache_shard_of(hash);
+  // o는 cache_make_object가 만든 엔트리로, 소유권이 캐시로 넘어온다(헤더와 본문 세그먼트를 복사하지 않고 그대로 쓴다).
+
+  o -> key = key_intern(key, len, hash);
+  o -> hash = hash;
+  o -> charge = o -> size;
+  if(g_count_meta) o -> charge += sizeof(cache_obj_t) + sizeof(cache_key_t) + len + 1 + o -> nsegs * sizeof(char*);
+  size_t sz = o -> charge;
+  atomic_init(&o -> refcnt, 2);
+  atomic_init(&o -> referenced, 0);
+  o -> prev = o -> next = o -> hnext = NULL;
+  // 새 노드는 락 밖에서 미리 채운다:
+    // 키는 인터닝(같은 키를 가져오던 미스나 교체될 옛 엔트리와 문자열 하나를 공유)
+    // 용량 계산에 쓸 바이트(-M이면 메타데이터 포함)
+    // 참조 2개(캐시 자신 + 돌려받는 호출자)로 시작, 링크 초기화
+
+  if(sz > s -> budget){
+    atomic_fetch_add_explicit(&g_policy -> rejects, 1, memory_order_relaxed);
+    cache_release(o);
+    return o;
+  }
+  // 샤드 한도보다 큰 엔트리는 받지 않는다(-M이면 한도 근처 오브젝트가 메타데이터 몫만큼 넘을 수 있다)
+  // 받으면 샤드를 다 비우고도 한도를 넘긴 채 걸리므로, 승인 거절처럼 호출자 참조만 남긴 독립 객체로 돌려준다. budget은 안 바뀌어서 락 없이 본다.
+
+  pthread_rwlock_wrlock(&s -> rwlock);
+  // 쓰기 락: 샤드 구조(head/tail/total, 노드 연결)를 바꾸므로 단일 라이터만 허용
+
+  cache_obj_t* ex = cache_find_unlocked(s, key, len, hash);
+  size_t exc = ex ? ex -> charge : 0;
+  // 동일 키가 이미 있다면 새 엔트리가 승인된 뒤에야 뗀다: 승인 정책이 새 엔트리를 거절하면 옛 엔트리가 그대로 남아야 한다.
+  // 그동안 옛 엔트리 몫(exc)은 곧 비워질 공간으로 치고 용량을 계산한다.
+
+  while(s -> total - exc + sz > s -> budget && s -> tail){
+    cache_obj_t* v = g_policy -> victim(s);
+    if(v == ex){
+      ht_remove(s, ex);
+      dll_remove(s, ex);
+      s -> total -= exc;
+      cache_release(ex);
+      ex = NULL;
+      exc = 0;
+      continue;
+    }
+    // 후보가 교체될 옛 엔트리면 승인을 물을 필요 없이 뗀다(어차피 새 엔트리로 바뀐다, 축출로 세지 않음)
+    if(g_policy -> admit && !g_policy -> admit(s, hash, v)){
+      pthread_rwlock_unlock(&s -> rwlock);
+      atomic_fetch_add_explicit(&g_policy -> rejects, 1, memory_order_relaxed);
+      cache_release(o);
+      return o;
+    }
+    // 승인 정책이 있으면 후보(v)를 내보낼 만한 가치가 있는지 먼저 묻는다. 거절이면 캐시의 참조를 내려놓고 캐시는 그대로 둔다.
+    // 엔트리는 호출자 참조만 남은 독립 객체가 된다(호출자가 release하면 해제)
+    ht_remove(s, v);
+    dll_remove(s, v);
+    s -> total -= v -> charge;
+    cache_release(v);
+    atomic_fetch_add_explicit(&g_policy -> evictions, 1, memory_order_relaxed);
+  }
+  // 용량 확보: 샤드 한도(budget)를 벗어나지 않도록 정책이 고른 후보(LRU면 꼬리)부터 반복 추출
+  // 모든 샤드가 각자 한도를 지키므로 전체 합도 g_max_cache를 넘지 않는다.
+  // while인 이유: 한 번 축출로 충분치 않을 수 있어서 여러 개를 제거할 수도 있음
+  // 축출도 캐시 참조만 내려놓으므로, 지금 클라이언트에 쓰고 있는 엔트리는 마지막 리더가 끝날 때 해제된다.
+
+  if(ex){
+    ht_remove(s, ex);
+    dll_remove(s, ex);
+    s -> total -= exc;
+    cache_release(ex);
+  }
+  // 승인됐으니 옛 엔트리를 떼고 캐시의 참조를 내려놓는다(총량 감소)
+  // 이 엔트리를 쓰고 있는 스레드가 있으면 그 스레드가 release할 때 해제된다.
+
+  dll_push_front(s, o);
+  ht_insert(s, o);
+  s -> total += sz;
+  // 리스트 앞(head, MRU)에 삽입 -> 가장 최근 사용으로 표시
+  // 같은 노드를 해시 버킷에도 걸어서 다음 조회가 O(1)
+  // 총량 갱신(기본은 스펙대로 오브젝트 바이트만, -M이면 메타데이터까지)
+
+  pthread_rwlock_unlock(&s -> rwlock);
+  atomic_fetch_add_explicit(&g_policy -> inserts, 1, memory_order_relaxed);
+  return o;
+}
+// 반환: 호출자 몫의 참조를 잡은 엔트리(다 쓰면 cache_release). o가 NULL이면(캐시할 수 없는 응답) NULL
+// 방금 가져온 응답을 팔로워들에게 그대로 넘길 수 있도록 캐시에 남았는지와 상관없이 엔트리를 돌려준다.
+
+//######################################################################################################################################################
+static void policy_lru_hit(cache_shard_t *s, cache_obj_t *o){
+  if(o != s -> head){
+    dll_remove(s, o);
+    dll_push_front(s, o);
+  }
+}
+// LRU 히트: obj != head면 dll_remove로 떼고 dll_push_front로 MRU(앞)에 붙임 -> 엄격한 LRU 순서 유지(쓰기 락 필요)
+
+//######################################################################################################################################################
+static cache_obj_t* policy_lru_victim(cache_shard_t *s){
+  return s -> tail;
+}
+// LRU 축출 후보: 꼬리(가장 오래전에 쓰인 엔트리)
+
+//######################################################################################################################################################
+static void policy_clock_hit(cache_shard_t *s, cache_obj_t *o){
+  atomic_store_explicit(&o -> referenced, 1, memory_order_relaxed);
+}
+// CLOCK 히트: 참조 비트만 세운다. 읽기 락만 잡은 상태에서 여러 스레드가 동시에 불러도 안전하다.
+
+//######################################################################################################################################################
+static cache_obj_t* policy_clock_victim(cache_shard_t *s){
+  cache_obj_t *v = s -> tail;
+  while(atomic_exchange(&v -> referenced, 0)){
+    dll_remove(s, v);
+    dll_push_front(s, v);
+    v = s -> tail;
+  }
+  return v;
+}
+// CLOCK 축출 후보: 꼬리가 마지막 검사 이후 히트된 적 있으면(참조 비트 1) 비트를 지우고 맨 앞으로 돌려보낸다(second chance).
+// 히트 때 미뤄 둔 리스트 이동을 여기서 몰아서 한다. 비트는 한 번씩만 지워지므로 최대 한 바퀴 돌면 반드시 후보가 나온다.
+
+//######################################################################################################################################################
+static void sketch_init(cache_shard_t *s){
+  s -> sketch = Calloc(SKETCH_DEPTH * SKETCH_WIDTH, sizeof(atomic_uchar));
+  atomic_init(&s -> sketch_adds, 0);
+}
+
+//######################################################################################################################################################
+static void sketch_record(cache_shard_t *s, uint64_t hash){
+  uint32_t h1 = (uint32_t)hash, h2 = (uint32_t)(hash >> 32) | 1;
+  for(int i = 0; i < SKETCH_DEPTH; i++){
+    atomic_uchar *c = &s -> sketch[i * SKETCH_WIDTH + ((h1 + i * h2) & (SKETCH_WIDTH - 1))];
+    if(atomic_load_explicit(c, memory_order_relaxed) < SKETCH_MAX)
+      atomic_fetch_add_explicit(c, 1, memory_order_relaxed);
+  }
+  // 행마다 다른 위치(double hashing: h1 + i*h2)의 카운터를 하나씩 올린다. 15에서 멈춰서(포화) 넘치지 않게 한다.
+  // 검사와 증가 사이에 다른 스레드가 끼어들면 16이 될 수도 있지만 추정치라서 문제없다.
+
+  if(atomic_fetch_add_explicit(&s -> sketch_adds, 1, memory_order_relaxed) + 1 == SKETCH_SAMPLE){
+    for(int i = 0; i < SKETCH_DEPTH * SKETCH_WIDTH; i++)
+      atomic_store_explicit(&s -> sketch[i], atomic_load_explicit(&s -> sketch[i], memory_order_relaxed) >> 1, memory_order_relaxed);
+    atomic_store_explicit(&s -> sketch_adds, 0, memory_order_relaxed);
+  }
+  // aging: 기록이 SKETCH_SAMPLE번 쌓이면 모든 카운터를 절반으로 줄인다.
+  // 카운터를 정확히 SAMPLE에 닿게 만든 스레드 한 개만 줄이므로 중복 감소는 없다.
+}
+// TinyLFU 빈도 기록. 히트/미스 모두 조회마다 불린다(읽기 락만 잡고 있으므로 원자 연산만 사용).
+
+//######################################################################################################################################################
+static unsigned sketch_estimate(cache_shard_t *s, uint64_t hash){
+  uint32_t h1 = (uint32_t)hash, h2 = (uint32_t)(hash >> 32) | 1;
+  unsigned est = SKETCH_MAX;
+  for(int i = 0; i < SKETCH_DEPTH; i++){
+    unsigned c = atomic_load_explicit(&s -> sketch[i * SKETCH_WIDTH + ((h1 + i * h2) & (SKETCH_WIDTH - 1))], memory_order_relaxed);
+    if(c < est) est = c;
+  }
+  return est;
+}
+// 빈도 추정: 행들 중 가장 작은 카운터(count-min). 해시 충돌로 부풀려질 수는 있어도 실제보다 작게 나오지는 않는다.
+
+//######################################################################################################################################################
+static bool policy_tinylfu_admit(cache_shard_t *s, uint64_t hash, cache_obj_t *victim){
+  return sketch_estimate(s, hash) > sketch_estimate(s, victim -> hash);
+}
+// TinyLFU 승인: 새 오브젝트의 추정 빈도가 축출 후보보다 높을 때만 후보를 내보내고 받아들인다.
+// 한 번만 요청된 URL(빈도 1)은 자주 쓰이는 엔트리를 밀어낼 수 없다. 두 번째 요청부터 빈도가 쌓여 들어올 기회가 생긴다.
+
+//######################################################################################################################################################
+static void disk_init(const char* dir){
+  if(mkdir(dir, 0755) < 0 && errno != EEXIST){
+    fprintf(stderr, "disk tier: cannot create %s: %s\n", dir, strerror(errno));
+    exit(1);
+  }
+  pthread_rwlock_init(&g_disk.lock, NULL);
+  pthread_mutex_init(&g_disk.qlock, NULL);
+  pthread_cond_init(&g_disk.qcond, NULL);
+  for(int i = 0; i < DISK_MAX_SEGS; i++) g_disk.fds[i] = -1;
+  g_disk.seg_max = g_disk_max / 8;
+  if(g_disk.seg_max < DISK_SEG_MIN) g_disk.seg_max = DISK_SEG_MIN;
+  if(g_disk.seg_max > DISK_SEG_MAX) g_disk.seg_max = DISK_SEG_MAX;
+  // 용량의 1/8씩 세그먼트를 채우고, 넘치면 가장 오래된 세그먼트를 지운다(한 번에 용량의 1/8 정도만 잃는다)
+
+  uint32_t nslots = 4096;
+  while(nslots < g_disk_max / 4096) nslots <<= 1;
+  // 평균 4KB당 슬롯 하나(2의 거듭제곱, 선형 탐사)
+
+  uint32_t head = UINT32_MAX, tail = 0;
+  DIR* d = opendir(dir);
+  struct dirent* e;
+  while(d && (e = readdir(d))){
+    unsigned seg;
+    char extra;
+    if(sscanf(e -> d_name, "seg.%u%c", &seg, &extra) != 1) continue;
+    if(seg < head) head = seg;
+    if(seg > tail) tail = seg;
+  }
+  if(d) closedir(d);
+  if(head == UINT32_MAX) head = tail = 0;
+  if(tail - head >= DISK_MAX_SEGS){
+    head = tail - DISK_MAX_SEGS + 1;
+    d = opendir(dir);
+    while(d && (e = readdir(d))){
+      unsigned seg;
+      char extra, path[MAXLINE];
+      if(sscanf(e -> d_name, "seg.%u%c", &seg, &extra) != 1 || seg >= head) continue;
+      disk_seg_path(path, sizeof(path), seg);
+      unlink(path);
+      atomic_fetch_add_explicit(&g_disk.dropped, 1, memory_order_relaxed);
+    }
+    if(d) closedir(d);
+  }
+  // 디렉터리에 있는 세그먼트 파일 범위(없으면 0번부터 새로 시작)
+  // 세그먼트가 DISK_MAX_SEGS개보다 많으면(예: 더 큰 설정으로 돌던 디렉터리) 최신 것만 쓰고 나머지 오래된 파일은 지운다
+  // -> 안 지우면 인덱스 밖에 남아 용량 계산에도 안 잡히고 영영 안 지워진다
+
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  bool warm = disk_index_open(nslots, head, tail);
+  for(uint32_t seg = head; seg <= tail; seg++){
+    if(disk_seg_open(seg, seg == tail) < 0 && warm) warm = false;
+  }
+  if(!warm) disk_rebuild();
+  else for(uint32_t i = 0; i < nslots; i++){
+    disk_slot_t* sl = &g_disk.slots[i];
+    if(sl -> state != 1) continue;
+    g_disk.objects++;
+    disk_seg_note(sl -> seg, sl -> hash);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  // 인덱스 헤더의 슬롯 수와 세그먼트 범위가 지금과 맞으면 인덱스를 그대로 쓴다(읽는 것 없이 mmap만 -> 바로 따뜻한 상태)
+// 이때 세그먼트별 키 목록(seg_keys)은 슬롯을 한 번 훑어 메모리에 다시 만든다.
+  // 인덱스가 없거나 안 맞으면(처음, -S 변경, 파일 손상) 세그먼트의 레코드 머리만 건너뛰며 읽어 다시 만든다.
+
+  fprintf(stderr, "disk tier %s: %s index, %u objects, %llu bytes in %u segments (%.1f ms)\n",
+    dir, warm ? "mapped" : "rebuilt", g_disk.objects, (unsigned long long)g_disk.bytes, tail - head + 1,
+    (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+
+  pthread_t tid;
+  pthread_create(&tid, NULL, disk_writer, NULL);
+  pthread_detach(tid);
+  // 새 엔트리를 디스크에 쓰는 스레드(쓰기는 쓰기 락 아래에서 한 레코드씩이라 하나면 충분하다)
+}
+// 디스크 계층 초기화(main에서 스레드를 만들기 전에 한 번)
+// 디렉터리 구성: seg.NNNNNNNN(덧붙이기만 하는 세그먼트 파일들) + index(mmap하는 해시 인덱스)
+
+//######################################################################################################################################################
+static void disk_seg_path(char* buf, size_t sz, uint32_t seg){
+  snprintf(buf, sz, "%s/seg.%08u", g_disk.dir, seg);
+}
+
+//######################################################################################################################################################
+static int disk_seg_open(uint32_t seg, bool create){
+  char path[MAXLINE + 16];
+  disk_seg_path(path, sizeof(path), seg);
+  int fd = open(path, O_RDWR | (create ? O_CREAT : 0), 0644);
+  struct stat st;
+  if(fd < 0 || fstat(fd, &st) < 0){
+    if(fd >= 0) close(fd);
+    return -1;
+  }
+  g_disk.fds[seg % DISK_MAX_SEGS] = fd;
+  g_disk.seg_bytes[seg % DISK_MAX_SEGS] = st.st_size;
+  g_disk.bytes += st.st_size;
+  return fd;
+}
+// 세그먼트 파일을 열어 링에 건다(create면 없을 때 만든다). 크기는 이어 쓸 위치이자 용량 계산에 쓴다.
+
+//######################################################################################################################################################
+static bool disk_index_open(uint32_t nslots, uint32_t head, uint32_t tail){
+  char path[MAXLINE + 16];
+  snprintf(path, sizeof(path), "%s/index", g_disk.dir);
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  struct stat st;
+  g_disk.map_len = DISK_IDX_HDR + (size_t)nslots * sizeof(disk_slot_t);
+  if(fd < 0 || fstat(fd, &st) < 0){
+    fprintf(stderr, "disk tier: cannot open %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  bool fits = (size_t)st.st_size == g_disk.map_len;
+  if(!fits && ftruncate(fd, g_disk.map_len) < 0){
+    fprintf(stderr, "disk tier: cannot size %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  char* m = mmap(NULL, g_disk.map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(m == MAP_FAILED){
+    fprintf(stderr, "disk tier: cannot map %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  g_disk.hdr = (disk_index_hdr_t*)m;
+  g_disk.slots = (disk_slot_t*)(m + DISK_IDX_HDR);
+  // 인덱스 파일 전체를 공유 매핑으로 붙인다. 이후 슬롯 읽기/쓰기는 메모리 접근뿐이고 파일 반영은 커널이 한다.
+
+  disk_index_hdr_t* h = g_disk.hdr;
+  if(fits && h -> magic == DISK_IDX_MAGIC && h -> nslots == nslots && h -> head == head && h -> tail == tail) return true;
+  memset(m, 0, g_disk.map_len);
+  h -> nslots = nslots;
+  h -> head = head;
+  h -> tail = tail;
+  return false;
+  // 맞지 않으면 비우고 재구성을 기다린다(magic은 재구성이 끝난 뒤에 쓴다 -> 도중에 죽으면 다음에 다시 재구성)
+}
+// 인덱스 파일을 mmap한다. 반환: 기존 인덱스를 그대로 쓸 수 있으면 true
+
+//######################################################################################################################################################
+static void disk_rebuild(void){
+  disk_index_hdr_t* h = g_disk.hdr;
+  for(uint32_t seg = h -> head; seg <= h -> tail; seg++){
+    int fd = g_disk.fds[seg % DISK_MAX_SEGS];
+    if(fd < 0) continue;
+    uint64_t size = g_disk.seg_bytes[seg % DISK_MAX_SEGS], off = 0;
+    disk_rec_t rec;
+    while(off + sizeof(rec) <= size){
+      if(pread(fd, &rec, sizeof(rec), off) != sizeof(rec) || rec.magic != DISK_REC_MAGIC) break;
+      uint64_t len = sizeof(rec) + (uint64_t)rec.key_len + rec.hdr_len + rec.body_len;
+      if(off + len > size) break;
+      disk_slot_put(rec.hash, seg, off, (uint32_t)len, rec.expires, rec.swr);
+      off += len;
+    }
+    // 레코드 머리만 읽고 키/헤더/본문은 건너뛴다. 같은 키의 나중 레코드가 앞의 것을 덮어쓴다(로그 순서 = 세그먼트 번호 순서)
+
+    if(off < size && seg == h -> tail && ftruncate(fd, off) == 0){
+      g_disk.bytes -= size - off;
+      g_disk.seg_bytes[seg % DISK_MAX_SEGS] = off;
+    }
+    // 쓰다가 죽어서 잘린 마지막 레코드는 잘라 낸다(이어 쓸 위치를 온전한 레코드 끝에 맞춘다)
+  }
+  h -> magic = DISK_IDX_MAGIC;
+}
+// 세그먼트들을 처음부터 훑어 인덱스를 다시 만든다(인덱스가 없거나 맞지 않을 때만)
+
+//######################################################################################################################################################
+static disk_slot_t* disk_slot_find(uint64_t hash){
+  uint32_t mask = g_disk.hdr -> nslots - 1;
+  for(uint32_t i = 0, k = (uint32_t)hash & mask; i <= mask; i++, k = (k + 1) & mask){
+    disk_slot_t* sl = &g_disk.slots[k];
+    if(sl -> state == 0) return NULL;
+    if(sl -> hash == hash) return sl;
+  }
+  return NULL;
+}
+// 해시로 슬롯을 찾는다(선형 탐사, 빈 칸을 만나면 없음). 락은 호출자가 잡는다.
+// 지울 때 뒤쪽 엔트리를 당겨 와서(disk_slot_delete) 탐사 사슬에 구멍이 없으므로 빈 칸에서 멈춰도 된다.
+
+//######################################################################################################################################################
+static void disk_slot_put(uint64_t hash, uint32_t seg, uint64_t off, uint32_t len, int64_t expires, uint32_t swr){
+  disk_slot_t* sl = disk_slot_find(hash);
+  if(!sl){
+    uint32_t mask = g_disk.hdr -> nslots - 1;
+    for(uint32_t i = 0, k = (uint32_t)hash & mask; i <= mask && !sl; i++, k = (k + 1) & mask)
+      if(g_disk.slots[k].state == 0) sl = &g_disk.slots[k];
+    if(!sl) return;
+    g_disk.objects++;
+  }
+  // 같은 키(해시)가 있으면 덮어쓰고(옛 레코드는 세그먼트에 남은 쓰레기가 된다), 없으면 탐사 경로의 첫 빈 칸을 쓴다.
+  // 인덱스가 가득 차면 기록하지 않는다(용량의 1/4KB개라 평균 크기가 아주 작을 때만 생긴다)
+
+  sl -> hash = hash;
+  sl -> seg = seg;
+  sl -> off = off;
+  sl -> len = len;
+  sl -> expires = expires;
+  sl -> swr = swr;
+  sl -> state = 1;
+  disk_seg_note(seg, hash);
+}
+// 슬롯 기록(쓰기 락 아래에서만). 레코드를 다 쓴 뒤에 불러야 인덱스가 반쯤 쓴 레코드를 가리키지 않는다.
+
+//######################################################################################################################################################
+static void disk_slot_delete(disk_slot_t* sl){
+  uint32_t mask = g_disk.hdr -> nslots - 1;
+  uint32_t i = (uint32_t)(sl - g_disk.slots);
+  for(uint32_t j = (i + 1) & mask; g_disk.slots[j].state != 0; j = (j + 1) & mask){
+    uint32_t home = (uint32_t)g_disk.slots[j].hash & mask;
+    bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+    if(stays) continue;
+    g_disk.slots[i] = g_disk.slots[j];
+    i = j;
+  }
+  g_disk.slots[i].state = 0;
+  g_disk.objects--;
+}
+// 슬롯을 지운다(backward-shift deletion). 뒤에 이어지는 엔트리 중 제자리(home)가 빈 칸 i 이전인 것을 당겨 와 구멍을 메운다.
+// 지운 칸(tombstone)을 남기지 않으므로 세그먼트가 계속 돌아도 탐사 길이가 늘지 않는다. 쓰기 락 아래에서만.
+
+//######################################################################################################################################################
+static void disk_seg_note(uint32_t seg, uint64_t hash){
+  disk_seg_keys_t* k = &g_disk.seg_keys[seg % DISK_MAX_SEGS];
+  if(k -> n == k -> cap){
+    k -> cap = k -> cap ? k -> cap * 2 : 64;
+    k -> hash = Realloc(k -> hash, k -> cap * sizeof(uint64_t));
+  }
+  k -> hash[k -> n++] = hash;
+}
+// 이 세그먼트에 기록한 키 해시를 적어 둔다(세그먼트를 버릴 때 지울 슬롯 목록)
+
+//######################################################################################################################################################
+static void disk_drop_oldest(void){
+  disk_index_hdr_t* h = g_disk.hdr;
+  uint32_t seg = h -> head;
+  disk_seg_keys_t* k = &g_disk.seg_keys[seg % DISK_MAX_SEGS];
+  for(uint32_t i = 0; i < k -> n; i++){
+    disk_slot_t* sl = disk_slot_find(k -> hash[i]);
+    if(sl && sl -> seg == seg) disk_slot_delete(sl);
+  }
+  Free(k -> hash);
+  k -> hash = NULL;
+  k -> n = k -> cap = 0;
+  // 이 세그먼트에 기록했던 키들 중 아직 이 세그먼트를 가리키는 슬롯만 지운다(뒤 세그먼트에 다시 쓰인 키는 그대로)
+  // -> 인덱스 전체가 아니라 이 세그먼트의 오브젝트 수만큼만 든다
+
+  h -> head = seg + 1;
+  char path[MAXLINE + 16];
+  disk_seg_path(path, sizeof(path), seg);
+  unlink(path);
+  if(g_disk.fds[seg % DISK_MAX_SEGS] >= 0) close(g_disk.fds[seg % DISK_MAX_SEGS]);
+  g_disk.fds[seg % DISK_MAX_SEGS] = -1;
+  g_disk.bytes -= g_disk.seg_bytes[seg % DISK_MAX_SEGS];
+  g_disk.seg_bytes[seg % DISK_MAX_SEGS] = 0;
+  atomic_fetch_add_explicit(&g_disk.dropped, 1, memory_order_relaxed);
+}
+// 디스크 용량을 넘으면 가장 오래된 세그먼트 파일을 통째로 버린다(FIFO, 쓰기 락 아래에서). 개별 삭제나 압축(compaction)은 하지 않는다.
+
+//######################################################################################################################################################
+static int disk_io(int fd, struct iovec* iov, int cnt, off_t off, bool write){
+  while(cnt > 0){
+    int c = cnt < IOV_MAX ? cnt : IOV_MAX;
+    ssize_t n = write ? pwritev(fd, iov, c, off) : preadv(fd, iov, c, off);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) return -1;
+    off += n;
+    iov_advance(iov, &cnt, (size_t)n);
+  }
+  return 0;
+}
+// iov 조각들을 off부터 끝까지 쓰거나 읽는다(pwritev/preadv, 파일 끝에 걸려 짧게 읽히면 -1). iov 배열은 당겨진다.
+
+//######################################################################################################################################################
+static void disk_store(const char* key, cache_obj_t* o){
+  uint32_t klen = (uint32_t)strlen(key);
+  uint64_t len = sizeof(disk_rec_t) + klen + o -> hdr_len + o -> body_len;
+  disk_rec_t rec = { .magic = DISK_REC_MAGIC, .key_len = klen, .hdr_len = (uint32_t)o -> hdr_len,
+    .body_len = (uint32_t)o -> body_len, .hash = o -> hash, .swr = o -> swr };
+  rec.expires = time(NULL) + (o -> expires - upstream_now());
+  struct iovec* iov = Malloc((o -> nsegs + 3) * sizeof(struct iovec));
+  iov[0] = (struct iovec){ &rec, sizeof(rec) };
+  iov[1] = (struct iovec){ (void*)key, klen };
+  iov[2] = (struct iovec){ o -> hdr, o -> hdr_len };
+  for(int i = 0; i < o -> nsegs; i++){
+    size_t at = (size_t)i * CACHE_SEG_SIZE;
+    iov[3 + i] = (struct iovec){ o -> segs[i], o -> body_len - at < CACHE_SEG_SIZE ? o -> body_len - at : CACHE_SEG_SIZE };
+  }
+  // 레코드 = 머리 + 키 + 헤더 블록 + 본문 세그먼트들. 엔트리의 슬랩 조각을 그대로 pwritev로 넘긴다(모아 복사하지 않음)
+  // 신선도는 벽시계 시각으로 바꿔 적는다.
+
+  pthread_rwlock_wrlock(&g_disk.lock);
+  disk_index_hdr_t* h = g_disk.hdr;
+  uint32_t tail = h -> tail;
+  uint64_t off = g_disk.seg_bytes[tail % DISK_MAX_SEGS];
+  if(off > 0 && off + len > g_disk.seg_max){
+    if(tail + 1 - h -> head >= DISK_MAX_SEGS) disk_drop_oldest();
+    tail++;
+    if(disk_seg_open(tail, true) < 0) goto out;
+    h -> tail = tail;
+    off = 0;
+  }
+  // 지금 세그먼트가 차면 다음 번호의 새 세그먼트로 넘어간다(레코드 하나는 세그먼트를 넘나들지 않는다)
+  while(g_disk.bytes + len > g_disk_max && h -> head < h -> tail) disk_drop_oldest();
+  // 용량을 넘으면 오래된 세그먼트부터 버린다(지금 쓰는 세그먼트는 남긴다)
+
+  if(disk_io(g_disk.fds[tail % DISK_MAX_SEGS], iov, o -> nsegs + 3, off, true) == 0){
+    g_disk.seg_bytes[tail % DISK_MAX_SEGS] = off + len;
+    g_disk.bytes += len;
+    disk_slot_put(o -> hash, tail, off, (uint32_t)len, rec.expires, rec.swr);
+    atomic_fetch_add_explicit(&g_disk.stores, 1, memory_order_relaxed);
+  }
+  // 다 쓴 뒤에 슬롯을 건다. 실패하면(디스크 가득 등) 이어 쓸 위치를 그대로 둬서 다음 레코드가 덮어쓴다.
+out:
+  pthread_rwlock_unlock(&g_disk.lock);
+  Free(iov);
+}
+// 캐시 엔트리 하나를 디스크 계층에 덧붙인다(disk_writer 스레드가 호출, 쓰기 락 아래에서 한 레코드씩)
+// 쓰기는 페이지 캐시까지만 가고 fsync는 하지 않는다(캐시라서 잃어도 원서버에서 다시 가져오면 된다)
+
+//######################################################################################################################################################
+static void disk_enqueue(cache_obj_t* o){
+  disk_job_t* j = NULL;
+  pthread_mutex_lock(&g_disk.qlock);
+  if(g_disk.qlen < DISK_QUEUE_MAX){
+    j = Malloc(sizeof(disk_job_t));
+    j -> o = o;
+    j -> next = NULL;
+    if(g_disk.qtail) g_disk.qtail -> next = j;
+    else g_disk.qhead = j;
+    g_disk.qtail = j;
+    g_disk.qlen++;
+    pthread_cond_signal(&g_disk.qcond);
+  }
+  pthread_mutex_unlock(&g_disk.qlock);
+  if(!j){
+    atomic_fetch_add_explicit(&g_disk.skipped, 1, memory_order_relaxed);
+    cache_release(o);
+  }
+}
+// 엔트리를 디스크 쓰기 대기열에 넣는다(호출자의 참조를 넘겨받는다). 디스크가 못 따라와 대기열이 차면
+// 기다리지 않고 이 엔트리는 메모리에만 둔다(다음 미스 때 다시 가져오면 그때 쓴다)
+
+//######################################################################################################################################################
+static void* disk_writer(void* arg){
+  while(1){
+    pthread_mutex_lock(&g_disk.qlock);
+    while(!g_disk.qhead) pthread_cond_wait(&g_disk.qcond, &g_disk.qlock);
+    disk_job_t* j = g_disk.qhead;
+    g_disk.qhead = j -> next;
+    if(!g_disk.qhead) g_disk.qtail = NULL;
+    g_disk.qlen--;
+    pthread_mutex_unlock(&g_disk.qlock);
+
+    disk_store(j -> o -> key -> str, j -> o);
+    cache_release(j -> o);
+    Free(j);
+  }
+  return NULL;
+}
+// 대기열에서 엔트리를 하나씩 꺼내 디스크에 쓴다. 쥐고 있는 참조 덕분에 그 사이 캐시에서 밀려나도 엔트리는 살아 있다.
+
+//######################################################################################################################################################
+static cache_obj_t* disk_load(const char* key, uint64_t hash){
+  uint32_t klen = (uint32_t)strlen(key);
+  pthread_rwlock_rdlock(&g_disk.lock);
+  disk_slot_t* sl = disk_slot_find(hash);
+  if(!sl){
+    pthread_rwlock_unlock(&g_disk.lock);
+    atomic_fetch_add_explicit(&g_disk.misses, 1, memory_order_relaxed);
+    return NULL;
+  }
+  int fd = g_disk.fds[sl -> seg % DISK_MAX_SEGS];
+  uint64_t off = sl -> off;
+  uint32_t len = sl -> len;
+  int64_t expires = sl -> expires;
+  uint32_t swr = sl -> swr;
+  // 읽기 락 아래에서 슬롯을 찾고 레코드를 읽는다(그동안 세그먼트가 지워지거나 파일이 닫히지 않는다)
+
+  disk_rec_t rec;
+  char kbuf[KEYMAX];
+  cache_obj_t* o = NULL;
+  struct iovec* iov = NULL;
+  if(pread(fd, &rec, sizeof(rec), off) != sizeof(rec) || rec.magic != DISK_REC_MAGIC || rec.hash != hash ||
+    rec.key_len != klen || sizeof(rec) + (uint64_t)rec.key_len + rec.hdr_len + rec.body_len != len ||
+    pread(fd, kbuf, klen, off + sizeof(rec)) != (ssize_t)klen || memcmp(kbuf, key, klen))
+    goto miss;
+  // 레코드 머리와 키가 슬롯과 요청에 맞는지 확인한다(해시가 같은 다른 키, 잘린 레코드를 거른다)
+
+  o = slab_alloc(sizeof(cache_obj_t));
+  memset(o, 0, sizeof(cache_obj_t));
+  o -> hdr_len = rec.hdr_len;
+  o -> hdr = slab_alloc(rec.hdr_len);
+  o -> body_len = rec.body_len;
+  o -> size = rec.hdr_len + 2 + rec.body_len;
+  o -> nsegs = (int)((rec.body_len + CACHE_SEG_SIZE - 1) / CACHE_SEG_SIZE);
+  o -> segs = o -> nsegs ? slab_alloc(o -> nsegs * sizeof(char*)) : NULL;
+  iov = Malloc((o -> nsegs + 1) * sizeof(struct iovec));
+  iov[0] = (struct iovec){ o -> hdr, o -> hdr_len };
+  for(int i = 0; i < o -> nsegs; i++){
+    size_t at = (size_t)i * CACHE_SEG_SIZE;
+    size_t n = o -> body_len - at < CACHE_SEG_SIZE ? o -> body_len - at : CACHE_SEG_SIZE;
+    o -> segs[i] = slab_alloc(n);
+    iov[1 + i] = (struct iovec){ o -> segs[i], n };
+  }
+  if(disk_io(fd, iov, o -> nsegs + 1, off + sizeof(rec) + klen, false) < 0) goto miss;
+  pthread_rwlock_unlock(&g_disk.lock);
+  Free(iov);
+  // 엔트리를 cache_make_object와 같은 모양(슬랩의 헤더 블록 + 세그먼트)으로 만들고 preadv 한 번으로 바로 채운다.
+
+  o -> expires = upstream_now() + (expires - time(NULL));
+  o -> swr = swr;
+  atomic_fetch_add_explicit(&g_disk.hits, 1, memory_order_relaxed);
+  return o;
+  // 벽시계 만료 시각을 다시 단조 시계 기준으로 바꾼다(이미 지났으면 만료된 엔트리로 올라가 조건부 요청의 검증자가 된다)
+
+miss:
+  pthread_rwlock_unlock(&g_disk.lock);
+  if(iov) Free(iov);
+  if(o){
+    o -> key = NULL;
+    atomic_init(&o -> refcnt, 1);
+    cache_release(o);
+  }
+  atomic_fetch_add_explicit(&g_disk.misses, 1, memory_order_relaxed);
+  return NULL;
+}
+// 디스크 계층에서 키의 오브젝트를 읽어 아직 캐시에 넣지 않은 엔트리로 돌려준다(호출자가 cache_insert로 메모리에 올린다). 없으면 NULL
+
+//######################################################################################################################################################
+static void disk_touch(uint64_t hash, time_t expires, uint32_t swr){
+  pthread_rwlock_wrlock(&g_disk.lock);
+  disk_slot_t* sl = disk_slot_find(hash);
+  if(sl){
+    sl -> expires = expires;
+    sl -> swr = swr;
+  }
+  pthread_rwlock_unlock(&g_disk.lock);
+}
+// 304로 확인된 엔트리의 디스크 슬롯 신선도만 고친다(레코드 머리의 옛 값은 인덱스를 재구성할 때만 쓰인다)
+
+//######################################################################################################################################################
+static void* stats_thread(void* arg){
+  sigset_t mask;
+  int sig;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+
+  while(1){
+    if(sigwait(&mask, &sig) != 0) continue;
+    // SIGUSR1이 올 때까지 잠들어 있다가 깨어나서 한 번 출력
+
+    size_t bytes = 0, entries = 0;
+    for(int i = 0; i < CACHE_SHARDS; i++){
+      cache_shard_t *s = &g_cache.shards[i];
+      pthread_rwlock_rdlock(&s -> rwlock);
+      bytes += s -> total;
+      entries += s -> count;
+      pthread_rwlock_unlock(&s -> rwlock);
+    }
+    // 현재 캐시 점유량(샤드별 합)
+
+    cache_policy_t *p = g_policy;
+    unsigned long lookups = atomic_load(&p -> lookups), hits = atomic_load(&p -> hits);
+    fprintf(stderr, "cache policy=%s lookups=%lu hits=%lu hit_ratio=%.2f%% hit_bytes=%lu inserts=%lu rejects=%lu evictions=%lu expired=%lu revalidated=%lu swr=%lu entries=%zu bytes=%zu\n",
+      p -> name, lookups, hits, lookups ? 100.0 * hits / lookups : 0.0,
+      (unsigned long)atomic_load(&p -> hit_bytes), (unsigned long)atomic_load(&p -> inserts),
+      (unsigned long)atomic_load(&p -> rejects), (unsigned long)atomic_load(&p -> evictions),
+      (unsigned long)atomic_load(&p -> expired), (unsigned long)atomic_load(&p -> revalidated),
+      (unsigned long)atomic_load(&p -> swr_served), entries, bytes);
+    // 사용 중인 정책의 통계 한 줄 출력. 요청 기록을 -c 옵션만 바꿔 재생하고 hit_ratio를 비교하면 된다.
+
+    pthread_mutex_lock(&g_upstream.lock);
+    int idle = g_upstream.nidle;
+    pthread_mutex_unlock(&g_upstream.lock);
+    fprintf(stderr, "upstream opened=%lu reused=%lu expired=%lu idle=%d spliced=%lu spliced_bytes=%lu\n",
+      (unsigned long)atomic_load(&g_upstream.opened), (unsigned long)atomic_load(&g_upstream.reused),
+      (unsigned long)atomic_load(&g_upstream.expired), idle,
+      (unsigned long)atomic_load(&g_upstream.spliced), (unsigned long)atomic_load(&g_upstream.spliced_bytes));
+    // 원서버 연결 풀: reused / (opened + reused)가 미스 중 연결 수립을 건너뛴 비율
+
+    size_t slab_bytes = 0, slab_used = 0;
+    for(int i = 0; i < SLAB_CLASSES; i++){
+      slab_class_t* sc = &g_slab.classes[i];
+      pthread_mutex_lock(&sc -> lock);
+      size_t nobjs = sc -> nobjs, nfree = sc -> nfree, req = sc -> req_bytes;
+      unsigned long allocs = sc -> allocs;
+      pthread_mutex_unlock(&sc -> lock);
+      if(!nobjs) continue;
+      size_t used = nobjs - nfree;
+      fprintf(stderr, "slab class=%zu objs=%zu used=%zu free=%zu allocs=%lu fill=%.1f%%\n",
+        sc -> size, nobjs, used, nfree, allocs, used ? 100.0 * req / (used * sc -> size) : 0.0);
+      slab_bytes += nobjs * sc -> size;
+      slab_used += used * sc -> size;
+    }
+    fprintf(stderr, "slab total=%zu used=%zu large_allocs=%lu max_object=%zu max_cache=%zu\n",
+      slab_bytes, slab_used, (unsigned long)atomic_load(&g_slab.large_allocs), g_max_object, g_max_cache);
+    size_t nkeys = 0, key_bytes = 0;
+    for(int i = 0; i < KEY_STRIPES; i++){
+      pthread_mutex_lock(&g_keys[i].lock);
+      nkeys += g_keys[i].count;
+      key_bytes += g_keys[i].bytes;
+      pthread_mutex_unlock(&g_keys[i].lock);
+    }
+    fprintf(stderr, "keys interned=%zu bytes=%zu entry_size=%zu count_meta=%d\n",
+      nkeys, key_bytes, sizeof(cache_obj_t), g_count_meta);
+    // 인터닝된 키 수와 메모리, 엔트리 구조체 크기(메타데이터 오버헤드 가늠용)
+
+    fprintf(stderr, "arena requests=%lu overflow_blocks=%lu peak=%zu\n",
+      (unsigned long)atomic_load(&g_arena_stats.resets), (unsigned long)atomic_load(&g_arena_stats.overflow_blocks),
+      (size_t)atomic_load(&g_arena_stats.peak));
+    // 슬랩 이용률: 클래스별로 잘라 낸 칸 / 쓰는 칸 / 빈 칸, fill = 쓰는 칸에 실제로 요청된 바이트 비율(클래스 내부 낭비)
+    // 아레나: 처리한 요청 수, 기본 블록이 모자랐던 횟수, 요청 하나가 쓴 최대 바이트
+
+    fprintf(stderr, "inflight leaders=%lu coalesced=%lu fill_bytes=%ld\n",
+      (unsigned long)atomic_load(&g_flights.leaders), (unsigned long)atomic_load(&g_flights.coalesced),
+      (long)atomic_load(&g_flights.fill_bytes));
+    // 요청 합치기: coalesced만큼의 미스가 원서버 요청 없이 리더의 응답을 받았다.
+
+    if(g_disk.enabled){
+      pthread_rwlock_rdlock(&g_disk.lock);
+      fprintf(stderr, "disk objects=%u bytes=%llu segs=%u hits=%lu misses=%lu stores=%lu dropped_segs=%lu skipped=%lu\n",
+        g_disk.objects, (unsigned long long)g_disk.bytes, g_disk.hdr -> tail - g_disk.hdr -> head + 1,
+        (unsigned long)atomic_load(&g_disk.hits), (unsigned long)atomic_load(&g_disk.misses),
+        (unsigned long)atomic_load(&g_disk.stores), (unsigned long)atomic_load(&g_disk.dropped),
+        (unsigned long)atomic_load(&g_disk.skipped));
+      pthread_rwlock_unlock(&g_disk.lock);
+    }
+    // 디스크 계층: hits는 메모리 미스를 디스크에서 올려 원서버 요청을 아낀 횟수
+  }
+  return NULL;
 }
+// 통계 출력 전용 스레드(main에서 만들고 detach)
 
 //######################################################################################################################################################
@@ -40,43 +40,99 @@
 // }
 /* $end adder */
 
-int main(void) {
-	char* buf, *p, *method;
-	char arg1[MAXLINE], arg2[MAXLINE], content[MAXLINE];
+#include "cgiworker.h"
+#include "tinyplugin.h"
+
+// 덧셈 결과로 CGI 출력(헤더 + 본문)을 out에 만들고 길이를 돌려준다
+// CGI, 상주 워커, 플러그인이 모두 쓴다. 이제 tiny 스레드 스택에서도 돌므로 content/out 크기를 넘지 않게 snprintf만 쓴다
+// QUERY_STRING은 고정 문구가 들어갈 자리를 남기고 잘라서 보여 준다
+static int adder_format(const char* query, int n1, int n2, char* out, size_t outsz) {
+	char content[MAXLINE];
+	int len, n;
+
+	len = snprintf(content, sizeof(content), "QUERY_STRING=%.*s\r\n<p>", (int)sizeof(content) - 256, query ? query : "");
+	len += snprintf(content + len, sizeof(content) - len, "Welcome to add.com: ");
+	len += snprintf(content + len, sizeof(content) - len, "THE Internet addition portal.\r\n<p>");
+	len += snprintf(content + len, sizeof(content) - len, "The answer is: %d + %d = %d\r\n<p>",
+		n1, n2, n1 + n2);
+	len += snprintf(content + len, sizeof(content) - len, "Thanks for visiting!\r\n");
+
+	// generate HTTP response
+	n = snprintf(out, outsz, "Connection: close\r\n"
+		"Content-length: %d\r\n"
+		"Content-type: text/html\r\n\r\n"
+		"%s", len, content);
+	return n < (int)outsz ? n : (int)outsz - 1;
+}
+
+// QUERY_STRING(buf)에서 두 수를 꺼내 CGI 출력을 out에 만들고 길이를 돌려준다
+// 한 번 실행하는 CGI와 상주 워커가 같이 쓴다
+int adder_response(char* buf, char* out, size_t outsz) {
+	char *p;
+	char arg1[MAXLINE], arg2[MAXLINE];
 	int n1=0, n2=0;
 
-	if ((buf = getenv("QUERY_STRING")) != NULL) {
-		p = strchr(buf, '&'); // buf 안에서 '&' 문자 찾음
+	if (buf != NULL && (p = strchr(buf, '&')) != NULL) { // buf 안에서 '&' 문자 찾음
 		*p = '\0';
-		strcpy(arg1, buf);
-		strcat(arg2, buf);
-		// strcpy(arg2, buf);
+		snprintf(arg1, sizeof(arg1), "%s", buf);
+		snprintf(arg2, sizeof(arg2), "%s", p + 1);
 		// n1 = atoi(arg1); // 문자열 to INT
 		// n2 = atoi(arg2);
-		n1 = atoi(strchr(arg1, '=') + 1);
-    	n2 = atoi(strchr(arg2, '=') + 1);
+		if (strchr(arg1, '=')) n1 = atoi(strchr(arg1, '=') + 1);
+		if (strchr(arg2, '=')) n2 = atoi(strchr(arg2, '=') + 1);
+		*p = '&'; // 보여 줄 때는 원래 QUERY_STRING 그대로
 	}
 
-	// make response body
-	// sprintf(content, "QUERY_STRING=%s", buf);
-	// sprintf(content, "<p>QUERY_STRING=%s</p> <p>Welcome to add.com: THE Internet addition portal.\r\n</p><p>The answer is: %d + %d = %d\r\n</p><p>Thanks for visiting!\r\n</p>", buf, n1, n2, n1 + n2);
-	// sprintf(content, "QUERY_STRING=%s<p>Welcome to add.com: THE Internet addition portal.\r\n<p>The answer is: %d + %d = %d\r\n<p>Thanks for visiting!\r\n", buf, n1, n2, n1 + n2);
-	sprintf(content, "QUERY_STRING=%s\r\n<p>", buf);
-  	sprintf(content + strlen(content), "Welcome to add.com: ");
-  	sprintf(content + strlen(content), "THE Internet addition portal.\r\n<p>");
-  	sprintf(content + strlen(content), "The answer is: %d + %d = %d\r\n<p>",
-    n1, n2, n1 + n2);
-  	sprintf(content + strlen(content), "Thanks for visiting!\r\n");
-	method = getenv("REQUEST_METHOD");
-
-	// if (strcasecmp(method, "GET") == 0) {
-	// generate HTTP response
-	printf("Connection: close\r\n");
-	printf("Content-length: %d\r\n", (int)strlen(content));
-	printf("Content-type: text/html\r\n\r\n");
-	printf("%s", content);	
-	//	}
+	return adder_format(buf, n1, n2, out, outsz);
+}
+
+#ifdef TINY_PLUGIN
+// 플러그인 빌드 (adder.so, -DTINY_PLUGIN): tiny 안에서 불린다. 두 수는 tiny가 디코딩해 둔 req->args에서 꺼내고
+// 출력은 CGI와 똑같이 adder_format으로 만든다
+static int adder_handle(const tp_request_t* req, tp_writer_t* w) {
+	char out[2 * MAXLINE];
+	int n1 = 0, n2 = 0, n;
+
+	if (req->nargs >= 2) {
+		n1 = atoi(req->args[0].value);
+		n2 = atoi(req->args[1].value);
+	}
+	n = adder_format(req->query, n1, n2, out, sizeof(out));
+	return w->write(w, out, n);
+}
+
+const tiny_plugin_t tiny_plugin = { TINY_PLUGIN_ABI, adder_handle };
+
+#else
+// 상주 워커 모드: tiny가 닫을 때까지 REQUEST를 받아 STDOUT + END로 답한다
+int worker_loop(int fd) {
+	char req[MAXLINE + 64], out[2 * MAXLINE];
+	uint32_t type;
+	int n;
+
+	if (cgiw_send(fd, CGIW_HELLO, NULL, 0) < 0) return 1;
+	while ((n = cgiw_recv(fd, &type, req, sizeof(req) - 1)) >= 0) {
+		req[n] = '\0';
+		if (type != CGIW_REQUEST) continue;
+		n = adder_response(cgiw_param(req, n, "QUERY_STRING"), out, sizeof(out));
+		if (cgiw_send(fd, CGIW_STDOUT, out, n) < 0 || cgiw_send(fd, CGIW_END, NULL, 0) < 0) return 1;
+	}
+	return 0; // tiny가 소켓을 닫음
+}
+
+int main(void) {
+	char out[2 * MAXLINE], *wfd;
+	int n;
+
+	// tiny가 -F로 띄운 상주 워커면 소켓 번호가 넘어온다, 아니면 원래처럼 CGI 한 번
+	if ((wfd = getenv(CGIW_FD_ENV)) != NULL) {
+		exit(worker_loop(atoi(wfd)));
+	}
+
+	n = adder_response(getenv("QUERY_STRING"), out, sizeof(out));
+	fwrite(out, 1, n, stdout);
 	fflush(stdout);
 
 	exit(0);
-}
\ No newline at end of file
+}
+#endif
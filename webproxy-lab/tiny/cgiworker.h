@@ -0,0 +1,77 @@
+/*
+ * cgiworker.h - tiny의 상주 CGI 워커 프로토콜 (tiny와 cgi-bin 프로그램이 같이 include)
+ *
+ * 요청마다 fork/exec 하는 대신, tiny가 -F로 등록된 프로그램을 미리 몇 개 띄워 두고
+ * Unix 도메인 소켓(socketpair) 하나로 요청을 계속 넘긴다. 워커는 환경변수 TINY_WORKER_FD로
+ * 그 소켓 번호를 받고, 이 변수가 없으면 원래대로 CGI 한 번 실행하고 끝나면 된다.
+ *
+ * 모든 메시지는 프레임: 헤더(type, len, 같은 호스트라 바이트 순서 변환 없음) + len 바이트
+ *   worker -> tiny  HELLO             띄운 직후 한 번, 포팅된 프로그램이라는 표시
+ *   tiny -> worker  REQUEST           "NAME=value\0" 들의 나열 (지금은 QUERY_STRING 하나)
+ *   worker -> tiny  STDOUT ... END    CGI가 stdout에 쓰던 내용(헤더 + 본문)을 여러 프레임으로, END로 한 요청 끝
+ *
+ * csapp.o 없이 빌드되는 cgi-bin 프로그램도 쓰므로 read/write만으로 구현한다.
+ */
+#ifndef __CGIWORKER_H__
+#define __CGIWORKER_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define CGIW_FD_ENV    "TINY_WORKER_FD"
+#define CGIW_MAX_FRAME (1 << 20)        // 이보다 큰 프레임은 프로토콜 오류로 본다
+
+enum { CGIW_HELLO = 1, CGIW_REQUEST, CGIW_STDOUT, CGIW_END };
+
+typedef struct {
+    uint32_t type;
+    uint32_t len;
+} cgiw_hdr_t;
+
+// n바이트를 다 읽거나 쓸 때까지 반복 (EINTR은 다시), 실패하거나 EOF면 -1
+static inline int cgiw_io(int fd, void* buf, size_t n, int wr) {
+    char* p = buf;
+
+    while (n > 0) {
+        ssize_t k = wr ? write(fd, p, n) : read(fd, p, n);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return -1;
+        p += k;
+        n -= k;
+    }
+    return 0;
+}
+
+static inline int cgiw_send(int fd, uint32_t type, const void* buf, uint32_t len) {
+    cgiw_hdr_t h = { type, len };
+
+    if (cgiw_io(fd, &h, sizeof(h), 1) < 0) return -1;
+    return len ? cgiw_io(fd, (void*)buf, len, 1) : 0;
+}
+
+// 프레임 하나를 받는다, 본문은 buf(크기 cap)에. 본문 길이를 돌려주고 실패하면 -1
+static inline int cgiw_recv(int fd, uint32_t* type, char* buf, uint32_t cap) {
+    cgiw_hdr_t h;
+
+    if (cgiw_io(fd, &h, sizeof(h), 0) < 0) return -1;
+    if (h.len > cap || h.len > CGIW_MAX_FRAME) return -1;
+    if (h.len && cgiw_io(fd, buf, h.len, 0) < 0) return -1;
+    *type = h.type;
+    return h.len;
+}
+
+// REQUEST 본문("NAME=value\0"...)에서 name의 값을 찾는다 (getenv 대신)
+static inline char* cgiw_param(char* params, uint32_t len, const char* name) {
+    size_t nl = strlen(name);
+    char* p = params;
+
+    while (p < params + len) {
+        if (!strncmp(p, name, nl) && p[nl] == '=') return p + nl + 1;
+        p += strlen(p) + 1;
+    }
+    return NULL;
+}
+
+#endif /* __CGIWORKER_H__ */
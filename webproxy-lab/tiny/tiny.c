@@ -7,16 +7,259 @@
  *   - Fixed sprintf() aliasing issue in serve_static(), and clienterror().
  */
 #include "csapp.h"
+#include "cgiworker.h"
+#include "tinyplugin.h"
+#include <poll.h>
+#include <dlfcn.h>
+#include <spawn.h>
+#include <sys/signalfd.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <stdatomic.h>
+
+// strptime, accept4, mkostemp는 _GNU_SOURCE(또는 _XOPEN_SOURCE)에서만 선언되는데, 그러면 csapp.h의 gai_error가 glibc 선언과 충돌해서 직접 선언한다
+char *strptime(const char *s, const char *format, struct tm *tm);
+int accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags);
+int mkostemp(char *template, int flags);
 
 void doit(int fd);
-void read_requesthdrs(rio_t *rp);
+void read_requesthdrs(rio_t *rp, char *ims);
+int match_ims(char *line, char *ims);
+int not_modified_since(char *ims, time_t mtime);
 int parse_uri(char *uri, char *filename, char *cgiargs);
-void serve_static(int fd, char *filename, int filesize);
+void serve_static(int fd, int srcfd, off_t filesize);
+int static_headers(char *buf, char *filename, int filesize, char *lastmod);
 void get_filetype(char *filename, char *filetype);
-void serve_dynamic(int fd, char *filename, char *cgiargs);
-void clienterror(int fd, char *cause, char *errnum, char *shortmsg,
+char **make_envp(char *var);
+long now_ms(void);
+
+// 정적 파일 본문을 보내는 방법 (-s sendfile|mmap)
+// SEND_SENDFILE(기본): 커널이 페이지 캐시에서 소켓으로 바로 복사, 사용자 버퍼가 없어서 파일 크기와 상관없이 메모리 사용이 일정
+// SEND_MMAP: 파일을 매핑해서 그 주소로 바로 write (tiny_origin.c 방식, 읽기용 버퍼 복사가 없음)
+enum { SEND_SENDFILE, SEND_MMAP };
+static int static_send = SEND_SENDFILE;
+
+/*
+ * 정적 파일 캐시 (-C bytes, 0이면 끔)
+ * 자주 요청되는 작은 파일(home.html, godzilla.gif ...)은 응답 헤더 + 본문을 한 버퍼에 미리 만들어 두고
+ * 히트하면 stat/open/read/close 없이 write 한 번으로 끝낸다.
+ * 파일이 바뀌었는지는 요청마다 stat으로 확인하지 않고, 디렉토리에 건 inotify를 감시 스레드가 읽어서 해당 항목을 지운다.
+ */
+#define FCACHE_BUCKETS   1024
+#define FCACHE_MAX_FILE  (256 * 1024)          // 이보다 큰 파일은 캐시하지 않고 sendfile/mmap으로
+#define FCACHE_DEF_BYTES (32 * 1024 * 1024)    // 기본 캐시 용량
+#define FCACHE_EVENTS    (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+                          IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+typedef struct fentry {
+    char* uri;                      // 키: 요청 URI 그대로 ("/", "/home" 같은 것도 그대로 키가 된다)
+    char* base;                     // 실제 파일 이름 (디렉토리 제외), inotify 이벤트 이름과 비교
+    char* alt;                      // URI 마지막 요소 ("/home" -> "home"), 나중에 그 이름의 파일이 생기면 매핑이 바뀌므로 같이 비교
+    int wd;                         // 파일이 있는 디렉토리의 watch descriptor
+    char lastmod[64];               // Last-Modified 값
+    time_t mtime;                   // 파일 수정 시각 (If-Modified-Since 비교용)
+    char* resp;                     // 미리 만든 200 응답 (헤더 + 본문)
+    size_t len;
+    atomic_int refs;                // 캐시가 가진 1 + 응답을 쓰고 있는 요청 수, 0이 되면 해제
+    struct fentry* hnext;           // 해시 버킷 체인
+    struct fentry *prev, *next;     // 넣은 순서 리스트 (용량이 차면 가장 오래된 것부터 뺀다)
+} fentry_t;
+
+static struct {
+    pthread_rwlock_t lock;
+    fentry_t* bucket[FCACHE_BUCKETS];
+    fentry_t *head, *tail;          // head가 가장 오래된 항목
+    size_t bytes, max_bytes;
+    unsigned long gen;              // inotify 이벤트를 처리할 때마다 증가, 파일을 읽는 도중 바뀌었는지 판단
+    int ifd;                        // inotify fd (-1이면 캐시 꺼짐)
+} fcache = { .lock = PTHREAD_RWLOCK_INITIALIZER, .max_bytes = FCACHE_DEF_BYTES, .ifd = -1 };
+
+void fcache_init(void);
+fentry_t* fcache_get(char* uri);
+void fcache_put(fentry_t* e);
+fentry_t* fcache_add(char* uri, char* filename, struct stat* sbuf, char* lastmod);
+
+/*
+ * 요청 하나에 대한 응답. plan_reply가 무엇을 보낼지 정하고,
+ * 블로킹 모드(iter/thread/pool)는 send_reply가, epoll 모드는 이벤트 루프가 나눠서 보낸다.
+ */
+typedef struct {
+    char head[MAXBUF];              // 먼저 보낼 바이트: 응답 헤더, 에러/304면 응답 전체
+    int hlen;
+    fentry_t* fe;                   // 캐시 히트: head 대신 fe->resp(헤더+본문)를 그대로 보낸다
+    int srcfd;                      // 헤더 다음에 보낼 정적 파일 (-1이면 없음)
+    off_t size;
+    int cgi;                        // 헤더 다음에 CGI 실행
+    char filename[MAXLINE], cgiargs[MAXLINE];
+} reply_t;
+
+void plan_reply(char *method, char *uri, char *ims, reply_t *r);
+void send_reply(int fd, reply_t *r);
+void serve_dynamic(int fd, reply_t *r);
+void not_modified(reply_t *r, char *lastmod);
+void clienterror(reply_t *r, char *cause, char *errnum, char *shortmsg,
                  char *longmsg);
 
+/*
+ * 동시 처리 방식 (-m)
+ * MODE_ITER(기본): 원래 tiny처럼 accept -> doit -> close를 하나씩
+ * MODE_THREAD: 연결마다 스레드 하나 (CS:APP echoservert)
+ * MODE_POOL: -n개의 워커 스레드가 연결 큐(sbuf)에서 fd를 꺼내 doit
+ * MODE_EPOLL: 스레드 하나가 논블로킹 소켓을 epoll로 다중화, 요청이 다 올 때까지/소켓이 쓸 수 있을 때까지 기다리는 동안 다른 연결을 처리
+ */
+enum { MODE_ITER, MODE_THREAD, MODE_POOL, MODE_EPOLL };
+static int mode = MODE_ITER;
+static int nworkers = 8;
+
+// pool 모드의 연결 큐 (CS:APP sbuf): main이 넣고 워커가 꺼낸다, 가득 차면 main이 accept를 멈추고 기다린다
+#define SBUF_SIZE 64
+static struct {
+    int buf[SBUF_SIZE];
+    int front, rear;
+    sem_t mutex, slots, items;
+} sbuf;
+
+#define EPOLL_MAX_EVENTS 64
+#define EPOLL_READ_MS    5000           // 요청 라인 + 헤더를 이 시간 안에 다 보내야 한다 (안 보내는 연결이 fd를 계속 쥐지 않게)
+#define EPOLL_BACKOFF_MS 100            // fd가 바닥나 accept가 실패하면 이 시간 동안 리스너를 빼 둔다
+
+/*
+ * fork/exec CGI (플러그인도 상주 워커도 없을 때)
+ * posix_spawn으로 띄우고(glibc는 CLONE_VM|CLONE_VFORK라 서버의 페이지 테이블을 복사하지 않는다) stdout은 파이프로 받는다.
+ * 출력을 다 모은 뒤 상태줄과 실제 본문 길이의 Content-length를 붙여서 보내므로,
+ * 시간 제한(-T)을 넘기거나 출력이 너무 크면(-O) 자식을 죽이고 504/502로 답할 수 있다.
+ * 자식은 누구도 waitpid로 기다리지 않고 reaper 스레드가 signalfd로 SIGCHLD를 받아 거둔다.
+ */
+#define CGI_DEF_TIMEOUT 10              // 초
+#define CGI_DEF_MAX_OUT (1024 * 1024)
+#define CGI_MAX_PIDS    1024
+
+enum { CGI_MORE, CGI_EOF, CGI_TOOBIG }; // cgi_read 결과
+
+typedef struct {
+    pid_t pid;                          // 0이면 실행 중이 아님
+    int rfd;                            // 자식 stdout 파이프의 읽는 쪽 (논블로킹)
+    char* buf;                          // 지금까지 받은 출력
+    size_t len, cap;
+    long deadline;                      // 이 시각(now_ms)까지 끝나야 한다
+} cgi_t;
+
+static struct {
+    int timeout;                        // -T 초
+    size_t max_out;                     // -O 바이트
+    int sfd;                            // SIGCHLD signalfd
+    pthread_mutex_t lock;               // pids, 그리고 파이프 생성~spawn 구간 (다른 spawn/fork에 파이프가 새지 않게)
+    pid_t pids[CGI_MAX_PIDS];           // 아직 거두지 않은 CGI 자식들 (상주 워커는 없음, fcgi_kill이 직접 거둔다)
+    int npids;
+} cgis = { .timeout = CGI_DEF_TIMEOUT, .max_out = CGI_DEF_MAX_OUT, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+void cgi_init(void);
+int cgi_start(cgi_t* g, char* filename, char* cgiargs);
+int cgi_read(cgi_t* g);
+char* cgi_done(cgi_t* g, int st, reply_t* r, size_t* outlen);
+
+// epoll_event.data.ptr에 넣는 핸들: 이벤트가 온 fd가 클라이언트 소켓인지 CGI 파이프인지와 어느 연결인지
+enum { EH_CLIENT, EH_CGI };
+struct econn;
+typedef struct {
+    int kind;
+    struct econn* c;
+} ehandle_t;
+
+// epoll 모드의 연결 상태
+typedef struct econn {
+    int fd;
+    char in[MAXBUF];                // 요청 라인 + 헤더를 빈 줄까지 모은다
+    int inlen;
+    reply_t r;
+    char* out;                      // 보내는 중인 바이트 (r.head, r.fe->resp 또는 obuf), NULL이면 아직 읽는 중
+    size_t outlen, outoff;
+    char* obuf;                     // 플러그인/상주 워커/CGI에게 받아 둔 응답
+    off_t off;                      // 정적 파일 본문을 어디까지 보냈는지
+    cgi_t g;                        // 실행 중인 fork/exec CGI (g.pid != 0)
+    ehandle_t ch, ph;               // 클라이언트 소켓, CGI 파이프의 epoll 핸들
+    struct econn *cprev, *cnext;    // CGI 실행 중인 연결 목록 (시간 제한 검사), 닫힌 뒤에는 해제 대기 목록
+    long rdeadline;                 // 요청을 이 시각(now_ms)까지 다 받아야 한다, 0이면 다 받았음
+    struct econn *rprev, *rnext;    // 요청을 읽는 중인 연결 목록 (마감 순, 모두 같은 EPOLL_READ_MS라 뒤에 붙이면 정렬 유지)
+    int dead;                       // 닫혔음, 이번 epoll_wait 결과를 다 처리한 뒤 해제
+} econn_t;
+
+/*
+ * 상주 CGI 워커 (-F prog[:n], 여러 번 줄 수 있음)
+ * cgi-bin/prog를 n개(기본 2) 띄워 두고 요청을 cgiworker.h의 프레임으로 넘긴다 -> 요청마다 fork/exec/wait가 없다.
+ * 워커는 처음 쓸 때 띄우고 죽으면 다음 요청 때 다시 띄운다.
+ * 등록 안 된 프로그램이나 HELLO를 보내지 않는 프로그램(포팅 안 됨)은 원래의 fork/exec CGI로 처리한다.
+ */
+#define FCGI_MAX_PROGS 16
+#define FCGI_MAX_PROCS 32
+#define FCGI_DEF_PROCS 2
+#define FCGI_HELLO_MS  1000             // 띄운 뒤 HELLO를 기다리는 시간
+
+typedef struct {
+    char path[MAXLINE];                 // "./cgi-bin/adder" (parse_uri가 만든 filename과 비교)
+    int n;                              // 프로세스 수
+    int fd[FCGI_MAX_PROCS];             // 워커와 이어진 소켓 (-1이면 아직 안 띄웠거나 죽음)
+    pid_t pid[FCGI_MAX_PROCS];
+    int idle[FCGI_MAX_PROCS], nidle;    // 쉬고 있는 슬롯 번호 스택
+    int classic;                        // HELLO를 못 받았다 -> 이후로는 fork/exec
+    pthread_mutex_t lock;
+    pthread_cond_t cond;                // 모두 바쁘면 여기서 기다린다 (thread/pool 모드)
+} fprog_t;
+
+static fprog_t fprogs[FCGI_MAX_PROGS];
+static int nfprogs;
+
+/*
+ * CGI 출력을 받는 곳 (상주 워커와 플러그인이 같이 씀)
+ * fd >= 0이면 받는 대로 클라이언트 소켓에 쓰고, fd < 0이면 buf에 모은다 (epoll 모드가 나중에 논블로킹으로 보냄)
+ */
+typedef struct {
+    int fd;
+    int ok;                             // 클라이언트에 쓰다 실패하면 0, 이후 출력은 버린다
+    char* buf;                          // Malloc, 받는 쪽이 Free
+    size_t len, cap;                    // len: 지금까지 받은 바이트 (fd로 보낸 것 포함)
+    char* pre;                          // 첫 출력 앞에 한 번 보낼 것 (상태줄, r->head)
+    size_t prelen;
+} sink_t;
+
+void sink_put(sink_t* s, const void* p, size_t n);
+int fcgi_register(char* spec);
+int fcgi_run(char* filename, char* cgiargs, sink_t* s);
+
+/*
+ * in-process 플러그인 (-L on|reload, tinyplugin.h)
+ * cgi-bin/prog.so가 있으면 /cgi-bin/prog를 dlopen한 핸들러로 처리한다 (없으면 상주 워커 -> fork/exec CGI 순서).
+ * on: 처음 요청 때 한 번 읽고 계속 쓴다 (없다는 결과도 기억)
+ * reload: 요청마다 .so를 stat해서 바뀌었으면 다시 읽는다. 같은 경로는 glibc가 이미 읽은 핸들을 돌려주므로
+ *         임시 파일로 복사해서 dlopen, 이전 버전은 실행 중인 요청이 끝나면 dlclose
+ */
+enum { PLUGIN_OFF, PLUGIN_ON, PLUGIN_RELOAD };
+#define PLUGIN_MAX 32
+
+typedef struct {
+    void* dl;
+    const tiny_plugin_t* tp;
+    atomic_int refs;                    // 테이블이 가진 1 + 실행 중인 요청 수, 0이 되면 dlclose
+} plug_t;
+
+static struct {
+    int mode;
+    pthread_mutex_t lock;
+    int n;
+    struct {
+        char path[MAXLINE];             // "./cgi-bin/adder.so"
+        plug_t* cur;                    // NULL이면 .so가 없거나 못 읽음
+        struct stat st;                 // 마지막으로 확인한 파일 상태 (reload 비교용)
+    } slot[PLUGIN_MAX];
+} plugins = { .mode = PLUGIN_OFF, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+int plugin_run(char* filename, char* cgiargs, sink_t* s);
+
+void* conn_thread(void* vargp);
+void* pool_worker(void* vargp);
+void epoll_loop(int listenfd);
+
 /*
  * # tiny는 반복실행 서버, 명령줄에서 넘겨받은 포트로의 연결 요청을 듣는다.
  * 1. open_listenfd 함수를 호출해서 듣기 소켓을 오픈한 후
@@ -26,22 +269,113 @@ void clienterror(int fd, char *cause, char *errnum, char *shortmsg,
  * 5. 자신 쪽의 연결 끝을 닫는다.
  */
 int main(int argc, char* argv[]) {
-    int listenfd, connfd;
+    int listenfd, connfd, opt, i;
+    pthread_t tid;
     char hostname[MAXLINE], port[MAXLINE];
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
 
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while ((opt = getopt(argc, argv, "s:C:m:n:F:L:T:O:")) != -1) {
+        if (opt == 's' && !strcmp(optarg, "sendfile")) {
+            static_send = SEND_SENDFILE;
+        } else if (opt == 's' && !strcmp(optarg, "mmap")) {
+            static_send = SEND_MMAP;
+        } else if (opt == 'C' && atol(optarg) >= 0) {
+            fcache.max_bytes = atol(optarg);
+        } else if (opt == 'm' && !strcmp(optarg, "iter")) {
+            mode = MODE_ITER;
+        } else if (opt == 'm' && !strcmp(optarg, "thread")) {
+            mode = MODE_THREAD;
+        } else if (opt == 'm' && !strcmp(optarg, "pool")) {
+            mode = MODE_POOL;
+        } else if (opt == 'm' && !strcmp(optarg, "epoll")) {
+            mode = MODE_EPOLL;
+        } else if (opt == 'n' && atoi(optarg) > 0) {
+            nworkers = atoi(optarg);
+        } else if (opt == 'F' && fcgi_register(optarg) == 0) {
+            ;
+        } else if (opt == 'L' && !strcmp(optarg, "on")) {
+            plugins.mode = PLUGIN_ON;
+        } else if (opt == 'L' && !strcmp(optarg, "reload")) {
+            plugins.mode = PLUGIN_RELOAD;
+        } else if (opt == 'T' && atoi(optarg) > 0) {
+            cgis.timeout = atoi(optarg);
+        } else if (opt == 'O' && atol(optarg) > 0) {
+            cgis.max_out = atol(optarg);
+        } else {
+            fprintf(stderr, "usage: %s [-s sendfile|mmap] [-C cachebytes] [-m iter|thread|pool|epoll] [-n workers] [-F prog[:n]] [-L on|reload] [-T cgi_secs] [-O cgi_bytes] <port>\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 1) {
+        fprintf(stderr, "usage: %s [-s sendfile|mmap] [-C cachebytes] [-m iter|thread|pool|epoll] [-n workers] [-F prog[:n]] [-L on|reload] [-T cgi_secs] [-O cgi_bytes] <port>\n", argv[0]);
         exit(1);
     }
 
-    listenfd = Open_listenfd(argv[1]);
+    // 클라이언트가 중간에 끊어도 write/sendfile이 SIGPIPE로 서버를 죽이지 않게 (EPIPE로 받고 그 연결만 끝낸다)
+    Signal(SIGPIPE, SIG_IGN);
+    cgi_init(); // SIGCHLD를 막으므로 다른 스레드를 만들기 전에 (새 스레드는 마스크를 물려받는다)
+    if (fcache.max_bytes > 0) fcache_init();
+
+    listenfd = Open_listenfd(argv[optind]);
+    // CGI 자식에게 리스닝 소켓/다른 연결이 새지 않게 (자식이 들고 있으면 그 연결들이 닫히지 않는다)
+    fcntl(listenfd, F_SETFD, FD_CLOEXEC);
+    if (mode == MODE_EPOLL) {
+        epoll_loop(listenfd); // 돌아오지 않음
+    }
+    if (mode == MODE_POOL) {
+        Sem_init(&sbuf.mutex, 0, 1);
+        Sem_init(&sbuf.slots, 0, SBUF_SIZE);
+        Sem_init(&sbuf.items, 0, 0);
+        for (i = 0; i < nworkers; i++) {
+            Pthread_create(&tid, NULL, pool_worker, NULL);
+        }
+    }
     while (1) {
         clientlen = sizeof(clientaddr);
-        connfd = Accept(listenfd, (SA*)&clientaddr, &clientlen);
-        Getnameinfo((SA*)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE, 0);
-        printf("Accepted connection from (%s, %s)\n", hostname, port);
+        // 받는 순간부터 close-on-exec: accept 뒤에 따로 fcntl하면 그 사이 다른 스레드가 띄운 CGI가 소켓을 물려받는다
+        connfd = accept4(listenfd, (SA*)&clientaddr, &clientlen, SOCK_CLOEXEC);
+        if (connfd < 0) continue; // 클라이언트가 먼저 끊은 경우(ECONNABORTED) 등, 서버는 계속
+        if (getnameinfo((SA*)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE, 0) == 0) {
+            printf("Accepted connection from (%s, %s)\n", hostname, port);
+        }
+        if (mode == MODE_POOL) {
+            P(&sbuf.slots);
+            P(&sbuf.mutex);
+            sbuf.buf[(++sbuf.rear) % SBUF_SIZE] = connfd;
+            V(&sbuf.mutex);
+            V(&sbuf.items);
+        } else if (mode == MODE_THREAD) {
+            int* connfdp = Malloc(sizeof(int)); // 스레드에 넘길 fd는 따로 (다음 accept가 덮어쓰지 않게)
+            *connfdp = connfd;
+            Pthread_create(&tid, NULL, conn_thread, connfdp);
+        } else {
+            doit(connfd);
+            Close(connfd);
+        }
+    }
+}
+
+void* conn_thread(void* vargp) {
+    int connfd = *((int*)vargp);
+
+    Pthread_detach(pthread_self());
+    Free(vargp);
+    doit(connfd);
+    Close(connfd);
+    return NULL;
+}
+
+void* pool_worker(void* vargp) {
+    int connfd;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        P(&sbuf.items);
+        P(&sbuf.mutex);
+        connfd = sbuf.buf[(++sbuf.front) % SBUF_SIZE];
+        V(&sbuf.mutex);
+        V(&sbuf.slots);
         doit(connfd);
         Close(connfd);
     }
@@ -69,83 +403,181 @@ strcat(filename, uri);: 변경된 uri를 filename에 추가하여 "./cgi-bin/add
 
 
 
-// 한 개의 HTTP 트랜잭션을 처리한다.
+// 한 개의 HTTP 트랜잭션을 처리한다. (iter/thread/pool 모드, 블로킹 소켓)
+// 여러 스레드가 동시에 부르므로 에러로 프로세스를 끝내는 Rio_ 래퍼 대신 rio_를 쓰고, 실패하면 이 연결만 포기한다
 void doit(int fd) {
-    int is_static;
-    struct stat sbuf;
     char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char filename[MAXLINE], cgiargs[MAXLINE];
+    char ims[MAXLINE] = "";
     rio_t rio;
+    reply_t r;
 
     // request line and headers
     // 요청 라인을 읽고 분석한다.
-    Rio_readinitb(&rio, fd);
-    Rio_readlineb(&rio, buf, MAXLINE);
+    rio_readinitb(&rio, fd);
+    if (rio_readlineb(&rio, buf, MAXLINE) <= 0) return; // 아무것도 안 보내고 끊음
     printf("Request headers:\n");
     printf("%s", buf);
-    sscanf(buf, "%s %s %s", method, uri, version);
-    // GET 메소드만 지원함, POST같은 요청을 하면 에러 메시지를 보낸 후 main루틴으로 돌아옴
-    if (strcasecmp(method, "GET")) { 
-        clienterror(fd, method, "501", "Not implemented", "Tiny does not implement this method");
+    if (sscanf(buf, "%s %s %s", method, uri, version) < 2) return;
+    // request header들을 읽기 (If-Modified-Since만 ims에 받아둔다)
+    read_requesthdrs(&rio, ims);
+
+    plan_reply(method, uri, ims, &r);
+    send_reply(fd, &r);
+}
+
+/*
+ * 무엇을 보낼지 정한다: 에러/304(head만), 캐시 히트(fe), 정적 파일(head + srcfd), CGI(head + cgi)
+ * 소켓에는 아무것도 쓰지 않아서 블로킹 모드와 epoll 모드가 같이 쓴다.
+ */
+void plan_reply(char* method, char* uri, char* ims, reply_t* r) {
+    int is_static;
+    struct stat sbuf;
+    char lastmod[64];
+
+    r->hlen = 0;
+    r->fe = NULL;
+    r->srcfd = -1;
+    r->size = 0;
+    r->cgi = 0;
+    // GET 메소드만 지원함, POST같은 요청을 하면 에러 메시지를 보낸다
+    if (strcasecmp(method, "GET")) {
+        clienterror(r, method, "501", "Not implemented", "Tiny does not implement this method");
+        return;
+    }
+
+    // 캐시된 정적 파일이면 stat/open/read 없이 미리 만든 응답을 그대로 쓴다 (parse_uri의 stat도 건너뜀)
+    if (!strstr(uri, "cgi-bin") && (r->fe = fcache_get(uri)) != NULL) {
+        if (not_modified_since(ims, r->fe->mtime)) {
+            not_modified(r, r->fe->lastmod);
+            fcache_put(r->fe);
+            r->fe = NULL;
+        }
         return;
     }
-    // request header들을 읽기
-    read_requesthdrs(&rio);
 
     // parse URI from GET request
-    is_static = parse_uri(uri, filename, cgiargs); // 정적 또는 동적 컨텐츠를 위한 것인지 판별
-    if (stat(filename, &sbuf) < 0) {
-        clienterror(fd, filename, "403", "Forbidden", "Tiny couldn't read the file");
+    is_static = parse_uri(uri, r->filename, r->cgiargs); // 정적 또는 동적 컨텐츠를 위한 것인지 판별
+    if (stat(r->filename, &sbuf) < 0) {
+        clienterror(r, r->filename, "403", "Forbidden", "Tiny couldn't read the file");
         return;
     }
     
     if (is_static) { // 정적컨텐츠 제공
         if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) { // 읽기 권한 및 보통파일인지 검증
-            clienterror(fd, filename, "403", "Forbidden", "Tiny couldn't read the file");
+            clienterror(r, r->filename, "403", "Forbidden", "Tiny couldn't read the file");
+            return;
+        }
+        // Last-Modified는 파일 수정 시각(HTTP 날짜), 그 뒤로 바뀌지 않았으면(If-Modified-Since) 본문 없이 304
+        struct tm tm;
+        strftime(lastmod, sizeof(lastmod), "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&sbuf.st_mtime, &tm));
+        if (not_modified_since(ims, sbuf.st_mtime)) {
+            not_modified(r, lastmod);
             return;
         }
-        serve_static(fd, filename, sbuf.st_size); // 정적 컨텐츠 제공
+        // 작은 파일은 캐시에 올리고 거기서 바로 보낸다, 못 올리면(용량 초과, 읽는 중 변경 등) 평소처럼 보냄
+        if (sbuf.st_size <= FCACHE_MAX_FILE && (r->fe = fcache_add(uri, r->filename, &sbuf, lastmod)) != NULL) {
+            return;
+        }
+        // stat과 open 사이에 지워졌을 수도 있다
+        if ((r->srcfd = open(r->filename, O_RDONLY | O_CLOEXEC)) < 0) {
+            clienterror(r, r->filename, "403", "Forbidden", "Tiny couldn't read the file");
+            return;
+        }
+        r->size = sbuf.st_size;
+        r->hlen = static_headers(r->head, r->filename, sbuf.st_size, lastmod);
+        printf("Reponse headers:\n");
+        printf("%s", r->head);
     } else { // 동적컨텐츠일때
         if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) { // 쓰기 권한 및 보통파일인지 검증
-            clienterror(fd, filename, "403", "Forbidden", "Tiny couldn't run the CGI program");
+            clienterror(r, r->filename, "403", "Forbidden", "Tiny couldn't run the CGI program");
             return;
         }
-        serve_dynamic(fd, filename, cgiargs); // 동적 컨텐츠 제공
+        // 나머지 헤더와 본문은 CGI 프로그램이 쓴다
+        r->hlen = snprintf(r->head, sizeof(r->head), "HTTP/1.0 200 OK\r\nServer: Tiny Web Server\r\n");
+        r->cgi = 1;
+    }
+}
+
+// plan_reply 결과를 블로킹 소켓에 끝까지 보낸다
+void send_reply(int fd, reply_t* r) {
+    if (r->cgi) {
+        serve_dynamic(fd, r); // 상태줄도 결과를 보고 정한다
+        return;
+    }
+    if (r->fe) {
+        rio_writen(fd, r->fe->resp, r->fe->len);
+        fcache_put(r->fe);
+        return;
+    }
+    if (rio_writen(fd, r->head, r->hlen) != r->hlen) { // 클라이언트가 끊음
+        if (r->srcfd >= 0) close(r->srcfd);
+        return;
+    }
+    if (r->srcfd >= 0) {
+        serve_static(fd, r->srcfd, r->size); // 정적 컨텐츠 제공
     }
 }
 
-void clienterror(int fd, char* cause, char* errnum, char* shortmsg, char* longmsg) {
-    char buf[MAXLINE], body[MAXLINE];
+void not_modified(reply_t* r, char* lastmod) {
+    int n = 0;
+
+    n += snprintf(r->head + n, sizeof(r->head) - n, "HTTP/1.0 304 Not Modified\r\n");
+    n += snprintf(r->head + n, sizeof(r->head) - n, "Server: Tiny Web Server\r\n");
+    n += snprintf(r->head + n, sizeof(r->head) - n, "Connection: close\r\n");
+    n += snprintf(r->head + n, sizeof(r->head) - n, "Last-Modified: %s\r\n\r\n", lastmod);
+    r->hlen = n;
+}
+
+void clienterror(reply_t* r, char* cause, char* errnum, char* shortmsg, char* longmsg) {
+    char body[MAXLINE];
+    int b = 0, n = 0;
 
-    // build the HTTP response body
-    sprintf(body, "<html><title>Tiny Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
+    // build the HTTP response body (버퍼 자신을 sprintf 인자로 넘기지 않고 오프셋에 이어 쓴다)
+    b += snprintf(body + b, sizeof(body) - b, "<html><title>Tiny Error</title>");
+    b += snprintf(body + b, sizeof(body) - b, "<body bgcolor=""ffffff"">\r\n");
+    b += snprintf(body + b, sizeof(body) - b, "%s: %s\r\n", errnum, shortmsg);
+    b += snprintf(body + b, sizeof(body) - b, "<p>%s: %s\r\n", longmsg, cause);
+    b += snprintf(body + b, sizeof(body) - b, "<hr><em>The Tiny Web server</em>\r\n");
+    if (b >= (int)sizeof(body)) b = sizeof(body) - 1; // cause가 길면 잘린다
 
-    // printf the response
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg); 
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
+    // build the response (헤더 + 본문을 r->head 하나에)
+    n += snprintf(r->head + n, sizeof(r->head) - n, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
+    n += snprintf(r->head + n, sizeof(r->head) - n, "Content-type: text/html\r\n");
+    n += snprintf(r->head + n, sizeof(r->head) - n, "Content-length: %d\r\n\r\n", b);
+    n += snprintf(r->head + n, sizeof(r->head) - n, "%s", body);
+    r->hlen = n;
 }
 
-// 요청 해더 내의 어떤 정보도 사용하지 않음
-void read_requesthdrs(rio_t* rp) {
+// 요청 해더 중 If-Modified-Since 값만 ims에 복사한다(CRLF 제외), 나머지는 사용하지 않음
+void read_requesthdrs(rio_t* rp, char* ims) {
     char buf[MAXLINE];
 
-    Rio_readlineb(rp, buf, MAXLINE);
-    while (strcmp(buf, "\r\n")) {
-        Rio_readlineb(rp, buf, MAXLINE);
+    while (rio_readlineb(rp, buf, MAXLINE) > 0 && strcmp(buf, "\r\n")) {
+        match_ims(buf, ims);
         printf("%s", buf);
     }
     return;
 }
 
+// 헤더 한 줄이 If-Modified-Since면 값을 ims에 복사 (doit과 epoll 모드가 같이 씀)
+int match_ims(char* line, char* ims) {
+    if (strncasecmp(line, "If-Modified-Since:", 18)) return 0;
+    char* v = line + 18;
+    while (*v == ' ') v++;
+    strcpy(ims, v);
+    ims[strcspn(ims, "\r\n")] = '\0';
+    return 1;
+}
+
+// If-Modified-Since 날짜 이후로 파일이 바뀌지 않았으면(mtime <= ims) 1, 헤더가 없거나 날짜를 못 읽으면 0
+int not_modified_since(char* ims, time_t mtime) {
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    if (!ims[0] || !strptime(ims, "%a, %d %b %Y %H:%M:%S GMT", &tm)) return 0;
+    return mtime <= timegm(&tm);
+}
+
 /*
  * 정적 컨텐츠: 자신의 현재 디렉토리(.) ex) workingDirectory/webproxy-lab/tiny
  * 정적 컨텐츠의 기본파일명: home.html
@@ -189,52 +621,205 @@ int parse_uri(char* uri, char* filename, char* cgiargs) {
     }
 }
 
-void serve_static(int fd, char* filename, int filesize) { // 정적 컨텐츠 제공 함수
-    int srcfd;
-    char* srcp, filetype[MAXLINE], buf[MAXLINE];
+// 헤더를 보낸 뒤 정적 파일 본문을 보내고 srcfd를 닫는다
+void serve_static(int fd, int srcfd, off_t filesize) { // 정적 컨텐츠 제공 함수
+    char* srcp;
+
+    if (static_send == SEND_MMAP) {
+        // 파일을 주소 공간에 매핑해서 그대로 소켓에 쓴다 (크기 0인 파일은 매핑할 수 없으니 건너뜀)
+        if (filesize > 0 && (srcp = mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0)) != MAP_FAILED) {
+            rio_writen(fd, srcp, filesize);
+            Munmap(srcp, filesize);
+        }
+        Close(srcfd);
+        return;
+    }
+
+    // sendfile은 한 번에 다 못 보낼 수 있다 (소켓 버퍼가 차거나 시그널) -> off가 보낸 만큼 앞으로 가므로 남은 만큼 다시 부른다
+    // 클라이언트가 끊으면(EPIPE 등) 더 보낼 곳이 없으니 그만둔다
+    off_t off = 0;
+    while (off < filesize) {
+        ssize_t n = sendfile(fd, srcfd, &off, filesize - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+    }
+    Close(srcfd);
+}
+
+// 정적 파일 200 응답 헤더를 buf(MAXBUF)에 만들고 길이를 돌려준다 (serve_static과 캐시가 같이 씀)
+int static_headers(char* buf, char* filename, int filesize, char* lastmod) {
+    char filetype[MAXLINE];
+    int n = 0;
 
-    // 클라이언트에게 response header 보내기
     get_filetype(filename, filetype);
+    n += snprintf(buf + n, MAXBUF - n, "HTTP/1.0 200 OK\r\n");
+    n += snprintf(buf + n, MAXBUF - n, "Server: Tiny Web Server\r\n");
+    n += snprintf(buf + n, MAXBUF - n, "Connection: close\r\n");
+    n += snprintf(buf + n, MAXBUF - n, "Content-length: %d\r\n", filesize);
+    n += snprintf(buf + n, MAXBUF - n, "Last-Modified: %s\r\n", lastmod);
+    n += snprintf(buf + n, MAXBUF - n, "Content-type: %s\r\n\r\n", filetype);
+    return n;
+}
 
-    // sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    // Rio_writen(fd, buf, strlen(buf));
-    // sprintf(buf, "Server: Tiny Web Server\r\n");
-    // Rio_writen(fd, buf, strlen(buf));
-    // sprintf(buf, "Connection: close\r\n");
-    // Rio_writen(fd, buf, strlen(buf));
-    // sprintf(buf, "Content-length: %d\r\n", filesize);
-    // Rio_writen(fd, buf, strlen(buf));
-    // sprintf(buf, "Content-type: %s\r\n\r\n", filetype);
-    // Rio_writen(fd, buf, strlen(buf));
-
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    sprintf(buf, "%sServer: Tiny Web Server\r\n", buf);
-    sprintf(buf, "%sConnection: close\r\n", buf);
-    sprintf(buf, "%sContent-length: %d\r\n", buf, filesize);
-    sprintf(buf, "%sContent-type: %s\r\n\r\n", buf, filetype);
-    Rio_writen(fd, buf, strlen(buf));
-    printf("Reponse headers:\n");
-    printf("%s", buf);
+static unsigned fcache_hash(char* s) {
+    unsigned h = 2166136261u; // FNV-1a
+    while (*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h % FCACHE_BUCKETS;
+}
 
-    // response body 클라이언트에게 보내기
-    srcfd = Open(filename, O_RDONLY, 0);
+// 항목을 해시/리스트에서 빼고 캐시가 가진 참조를 놓는다 (wrlock 잡은 상태에서)
+static void fcache_unlink(fentry_t* e) {
+    fentry_t** pp = &fcache.bucket[fcache_hash(e->uri)];
+    while (*pp != e) pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    if (e->prev) e->prev->next = e->next; else fcache.head = e->next;
+    if (e->next) e->next->prev = e->prev; else fcache.tail = e->prev;
+    fcache.bytes -= e->len;
+    fcache_put(e);
+}
 
-    char* file_buf = (char*)malloc(filesize);
-    if (file_buf == NULL) {
-        // 메모리 할당 실패 처리
-        clienterror(fd, "malloc", "500", "Internal Server Error", "Failed to allocate memory for file content");
-        Close(srcfd);
+// inotify 감시 스레드: 이벤트가 온 디렉토리에서 이름이 맞는 항목을 지운다
+static void* fcache_watch(void* vargp) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (1) {
+        ssize_t n = read(fcache.ifd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        pthread_rwlock_wrlock(&fcache.lock);
+        fcache.gen++;
+        for (char* p = buf; p < buf + n; ) {
+            struct inotify_event* ev = (struct inotify_event*)p;
+            fentry_t *e = fcache.head, *next;
+            for (; e; e = next) {
+                next = e->next;
+                // 큐가 넘쳤으면 무엇이 바뀌었는지 모르니 전부, 디렉토리 자체가 사라졌으면 그 디렉토리 전부
+                if ((ev->mask & IN_Q_OVERFLOW) ||
+                    (ev->wd == e->wd && (!ev->len || (ev->mask & IN_IGNORED) ||
+                                         !strcmp(ev->name, e->base) || !strcmp(ev->name, e->alt))))
+                    fcache_unlink(e);
+            }
+            p += sizeof(*ev) + ev->len;
+        }
+        pthread_rwlock_unlock(&fcache.lock);
+    }
+    fprintf(stderr, "fcache: inotify read failed, static cache disabled\n");
+    pthread_rwlock_wrlock(&fcache.lock);
+    while (fcache.head) fcache_unlink(fcache.head);
+    fcache.max_bytes = 0; // 더 이상 무효화를 못 하니 새로 넣지도 않는다
+    pthread_rwlock_unlock(&fcache.lock);
+    return NULL;
+}
+
+void fcache_init(void) {
+    pthread_t tid;
+
+    if ((fcache.ifd = inotify_init1(IN_CLOEXEC)) < 0) {
+        fprintf(stderr, "fcache: inotify_init1: %s, static cache disabled\n", strerror(errno));
+        fcache.max_bytes = 0;
         return;
     }
-    
-    // 파일에서 클라이언트 소켓이 아닌, 새로 오픈한 파일 디스크립터에서 읽기
-    Rio_readn(srcfd, file_buf, filesize);
-    
-    // 읽어온 내용을 소켓에 쓰기
-    Rio_writen(fd, file_buf, filesize);
+    Pthread_create(&tid, NULL, fcache_watch, NULL);
+    pthread_detach(tid);
+}
 
-    Close(srcfd);
-    free(file_buf);
+// uri로 캐시를 찾는다, 찾으면 참조를 하나 올려서 돌려줌 (다 쓰면 fcache_put)
+fentry_t* fcache_get(char* uri) {
+    fentry_t* e;
+
+    if (fcache.ifd < 0) return NULL;
+    pthread_rwlock_rdlock(&fcache.lock);
+    for (e = fcache.bucket[fcache_hash(uri)]; e; e = e->hnext) {
+        if (!strcmp(e->uri, uri)) {
+            atomic_fetch_add(&e->refs, 1);
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&fcache.lock);
+    return e;
+}
+
+void fcache_put(fentry_t* e) {
+    if (atomic_fetch_sub(&e->refs, 1) == 1) {
+        free(e->uri);
+        free(e->base);
+        free(e->alt);
+        free(e->resp);
+        free(e);
+    }
+}
+
+/*
+ * 파일을 읽어서 응답을 미리 만들고 캐시에 넣는다. 요청 하나가 쓸 참조를 올려서 돌려준다.
+ * watch를 먼저 걸고 나서 읽으므로, 읽은 뒤의 변경은 반드시 이벤트로 온다.
+ * 읽는 도중에 이벤트가 왔으면(gen이 바뀜) 읽은 내용이 옛것일 수 있으니 넣지 않는다.
+ */
+fentry_t* fcache_add(char* uri, char* filename, struct stat* sbuf, char* lastmod) {
+    char dir[MAXLINE], hdr[MAXLINE], *slash;
+    unsigned long gen;
+    fentry_t* e;
+    int srcfd, wd, hlen;
+    ssize_t n;
+    size_t got;
+
+    if (fcache.ifd < 0 || fcache.max_bytes == 0) return NULL;
+
+    strcpy(dir, filename);
+    slash = strrchr(dir, '/'); // filename은 항상 "./..."
+    *slash = '\0';
+    pthread_rwlock_rdlock(&fcache.lock);
+    gen = fcache.gen;
+    pthread_rwlock_unlock(&fcache.lock);
+    if ((wd = inotify_add_watch(fcache.ifd, dir, FCACHE_EVENTS)) < 0) return NULL;
+
+    hlen = static_headers(hdr, filename, sbuf->st_size, lastmod);
+    if ((size_t)hlen + sbuf->st_size > fcache.max_bytes) return NULL;
+    if ((srcfd = open(filename, O_RDONLY | O_CLOEXEC)) < 0) return NULL; // 동시에 띄우는 CGI에 새지 않게
+    e = Calloc(1, sizeof(fentry_t));
+    e->len = hlen + sbuf->st_size;
+    e->resp = Malloc(e->len);
+    memcpy(e->resp, hdr, hlen);
+    for (got = 0; got < (size_t)sbuf->st_size; got += n) {
+        n = read(srcfd, e->resp + hlen + got, sbuf->st_size - got);
+        if (n < 0 && errno == EINTR) { n = 0; continue; }
+        if (n <= 0) break;
+    }
+    close(srcfd);
+
+    e->uri = strdup(uri);
+    e->base = strdup(filename + (slash - dir) + 1);
+    e->alt = strdup(strrchr(uri, '/') + 1);
+    e->wd = wd;
+    strcpy(e->lastmod, lastmod);
+    e->mtime = sbuf->st_mtime;
+    atomic_init(&e->refs, 2); // 캐시 1 + 호출한 요청 1
+
+    pthread_rwlock_wrlock(&fcache.lock);
+    if (got != (size_t)sbuf->st_size || gen != fcache.gen || fcache.max_bytes == 0) {
+        // 파일 크기가 stat과 다르거나 읽는 사이 바뀌었다 -> 캐시에 넣지 않고 그냥 보낸다
+        pthread_rwlock_unlock(&fcache.lock);
+        atomic_store(&e->refs, 1);
+        fcache_put(e);
+        return NULL;
+    }
+    // 같은 uri가 이미 들어 있으면 (동시에 채운 경우) 새 것으로 바꾼다
+    fentry_t* old;
+    for (old = fcache.bucket[fcache_hash(uri)]; old; old = old->hnext) {
+        if (!strcmp(old->uri, uri)) {
+            fcache_unlink(old);
+            break;
+        }
+    }
+    while (fcache.head && fcache.bytes + e->len > fcache.max_bytes) fcache_unlink(fcache.head);
+    unsigned h = fcache_hash(uri);
+    e->hnext = fcache.bucket[h];
+    fcache.bucket[h] = e;
+    e->prev = fcache.tail;
+    if (fcache.tail) fcache.tail->next = e; else fcache.head = e;
+    fcache.tail = e;
+    fcache.bytes += e->len;
+    pthread_rwlock_unlock(&fcache.lock);
+    return e;
 }
 
 void get_filetype(char* filename, char* filetype) {
@@ -251,20 +836,747 @@ void get_filetype(char* filename, char* filetype) {
     }
 }
 
-void serve_dynamic(int fd, char* filename, char* cgiargs) {
-    char buf[MAXLINE], *emptylist[] = { NULL };
+/*
+ * 동적 컨텐츠 (블로킹 모드)
+ * 플러그인/상주 워커가 있으면 상태줄(r->head)부터 출력을 받는 대로 흘려 보낸다.
+ * 없으면 fork/exec CGI를 띄우고 파이프를 poll로 기다리며 다 받은 뒤 한 번에 보낸다 (시간 제한 -T)
+ */
+void serve_dynamic(int fd, reply_t* r) {
+    sink_t s = { .fd = fd, .ok = 1, .pre = r->head, .prelen = r->hlen };
+    struct pollfd pfd;
+    cgi_t g;
+    char* out;
+    size_t outlen;
+    long left;
+    int st;
 
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Server: Tiny Web Server\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    if (plugin_run(r->filename, r->cgiargs, &s) == 0 || fcgi_run(r->filename, r->cgiargs, &s) == 0) {
+        sink_put(&s, NULL, 0); // 출력이 하나도 없었어도 상태줄은 보낸다
+        return;
+    }
+    if (cgi_start(&g, r->filename, r->cgiargs) < 0) {
+        clienterror(r, r->filename, "502", "Bad Gateway", "Tiny couldn't run the CGI program");
+        rio_writen(fd, r->head, r->hlen);
+        return;
+    }
+    pfd.fd = g.rfd;
+    pfd.events = POLLIN;
+    while ((st = cgi_read(&g)) == CGI_MORE && (left = g.deadline - now_ms()) > 0) {
+        poll(&pfd, 1, left); // EINTR이든 시간이 됐든 다시 읽어 보고 남은 시간을 계산한다
+    }
+    if ((out = cgi_done(&g, st, r, &outlen)) != NULL) {
+        rio_writen(fd, out, outlen);
+        Free(out);
+    } else {
+        rio_writen(fd, r->head, r->hlen);
+    }
+}
 
-    if (Fork() == 0) { // 자식 프로세스 생성
-        setenv("QUERY_STRING", cgiargs, 1); //환경변수 설정 
-        Dup2(fd, STDOUT_FILENO); // redirect 
-        Execve(filename, emptylist, environ);
+long now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// CGI 자식 거두기: 추적 중인 자식을 모두 WNOHANG으로 확인 (SIGCHLD 여러 개가 하나로 합쳐질 수 있다)
+static void* cgi_reaper(void* vargp) {
+    struct signalfd_siginfo si;
+    int i, status;
+
+    while (read(cgis.sfd, &si, sizeof(si)) > 0 || errno == EINTR) {
+        pthread_mutex_lock(&cgis.lock);
+        for (i = 0; i < cgis.npids; ) {
+            if (waitpid(cgis.pids[i], &status, WNOHANG) > 0) {
+                if (WIFSIGNALED(status) && WTERMSIG(status) != SIGKILL) {
+                    fprintf(stderr, "cgi: pid %d killed by signal %d\n", (int)cgis.pids[i], WTERMSIG(status));
+                }
+                cgis.pids[i] = cgis.pids[--cgis.npids];
+            } else {
+                i++;
+            }
+        }
+        pthread_mutex_unlock(&cgis.lock);
+    }
+    unix_error("cgi reaper: signalfd read error");
+    return NULL;
+}
+
+/*
+ * SIGCHLD를 모든 스레드에서 막고 signalfd로만 받는다.
+ * 시그널 핸들러를 쓰면 아무 스레드에서나 P()의 sem_wait, poll, epoll_wait가 EINTR로 깨진다 (sem_wait는 SA_RESTART와 상관없음)
+ */
+void cgi_init(void) {
+    sigset_t mask;
+    pthread_t tid;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    if ((cgis.sfd = signalfd(-1, &mask, SFD_CLOEXEC)) < 0) unix_error("signalfd error");
+    Pthread_create(&tid, NULL, cgi_reaper, NULL);
+    pthread_detach(tid);
+}
+
+/*
+ * CGI 자식을 띄운다: stdout은 파이프, QUERY_STRING을 넣은 환경으로 실행
+ * 환경(envp)은 부모에서 미리 만든다 (자식에서 malloc을 쓰는 setenv를 부르지 않는다)
+ */
+int cgi_start(cgi_t* g, char* filename, char* cgiargs) {
+    char qs[MAXLINE + 16], **envp, *argv[] = { filename, NULL };
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    sigset_t none, def;
+    int p[2], rc = -1;
+
+    memset(g, 0, sizeof(*g));
+    g->rfd = -1;
+    sprintf(qs, "QUERY_STRING=%s", cgiargs);
+    envp = make_envp(qs);
+    posix_spawn_file_actions_init(&fa);
+    posix_spawnattr_init(&attr);
+    sigemptyset(&none);
+    sigemptyset(&def);
+    sigaddset(&def, SIGPIPE);
+    posix_spawnattr_setsigmask(&attr, &none);   // 서버가 막아 둔 SIGCHLD를 물려주지 않는다
+    posix_spawnattr_setsigdefault(&attr, &def); // 서버가 무시하는 SIGPIPE도 기본 동작으로
+    posix_spawnattr_setpgroup(&attr, 0);        // 자기 프로세스 그룹: 시간 초과 때 스크립트가 띄운 손자까지 죽인다
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+
+    pthread_mutex_lock(&cgis.lock);
+    if (cgis.npids < CGI_MAX_PIDS && pipe(p) == 0) {
+        fcntl(p[0], F_SETFD, FD_CLOEXEC);
+        fcntl(p[1], F_SETFD, FD_CLOEXEC);
+        fcntl(p[0], F_SETFL, O_NONBLOCK);
+        posix_spawn_file_actions_adddup2(&fa, p[1], STDOUT_FILENO); // dup2한 fd는 close-on-exec가 풀린다
+        if (posix_spawn(&g->pid, filename, &fa, &attr, argv, envp) == 0) {
+            cgis.pids[cgis.npids++] = g->pid;
+            g->rfd = p[0];
+            g->deadline = now_ms() + cgis.timeout * 1000L;
+            rc = 0;
+        } else {
+            g->pid = 0;
+            close(p[0]);
+        }
+        close(p[1]); // 쓰는 쪽은 자식만 가진다 -> 자식이 끝나면 EOF
+    }
+    pthread_mutex_unlock(&cgis.lock);
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    Free(envp);
+    return rc;
+}
+
+// 파이프에서 지금 읽을 수 있는 만큼 읽는다
+int cgi_read(cgi_t* g) {
+    ssize_t n;
+
+    while (1) {
+        if (g->len == g->cap) {
+            g->cap = g->cap ? g->cap * 2 : MAXBUF;
+            g->buf = Realloc(g->buf, g->cap);
+        }
+        n = read(g->rfd, g->buf + g->len, g->cap - g->len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) return CGI_MORE;
+        if (n <= 0) return CGI_EOF;             // 자식이 stdout을 닫음 (보통은 끝남)
+        g->len += n;
+        if (g->len > cgis.max_out) return CGI_TOOBIG;
+    }
+}
+
+/*
+ * CGI를 정리하고 응답을 만든다. st가 CGI_EOF가 아니면(시간 초과, 너무 큼) 자식을 죽인다.
+ * CGI 출력(헤더들 + 빈 줄 + 본문)에 상태줄(Status: 헤더가 있으면 그 값)과 실제 본문 길이의 Content-length를 붙여
+ * Malloc한 응답을 돌려준다. 실패하면 NULL이고 r->head에 에러 응답을 만들어 둔다.
+ */
+char* cgi_done(cgi_t* g, int st, reply_t* r, size_t* outlen) {
+    char status[64] = "200 OK", hdr[MAXBUF], *p, *e, *nl, *out = NULL;
+    size_t ll, hlen = 0;
+    int n;
+
+    if (st != CGI_EOF) {
+        pthread_mutex_lock(&cgis.lock); // 아직 안 거둔 자식만 죽인다 (거둔 pid는 다른 프로세스가 쓸 수 있다)
+        for (n = 0; n < cgis.npids; n++) {
+            if (cgis.pids[n] == g->pid) kill(-g->pid, SIGKILL);
+        }
+        pthread_mutex_unlock(&cgis.lock);
+    }
+    close(g->rfd);
+    g->rfd = -1;
+    g->pid = 0;
+
+    if (st == CGI_MORE) {
+        clienterror(r, r->filename, "504", "Gateway Timeout", "The CGI program did not finish in time");
+    } else if (st == CGI_TOOBIG) {
+        clienterror(r, r->filename, "502", "Bad Gateway", "The CGI program wrote too much output");
+    } else {
+        for (p = g->buf, e = g->buf + g->len; (nl = memchr(p, '\n', e - p)) != NULL; p = nl + 1) {
+            ll = nl - p;
+            if (ll && p[ll - 1] == '\r') ll--;
+            if (ll == 0) break; // 빈 줄: 헤더 끝
+            if (!strncasecmp(p, "Status:", 7)) {
+                for (p += 7, ll -= 7; ll && *p == ' '; p++, ll--)
+                    ;
+                snprintf(status, sizeof(status), "%.*s", (int)ll, p);
+            } else if (strncasecmp(p, "Content-length:", 15)) { // 길이는 tiny가 다시 센다
+                if (hlen + ll + 2 >= sizeof(hdr)) break;
+                memcpy(hdr + hlen, p, ll);
+                memcpy(hdr + hlen + ll, "\r\n", 2);
+                hlen += ll + 2;
+            }
+        }
+        if (nl && ll == 0) {
+            p = nl + 1;
+            out = Malloc(MAXLINE + hlen + (e - p));
+            n = sprintf(out, "HTTP/1.0 %s\r\nServer: Tiny Web Server\r\n", status);
+            memcpy(out + n, hdr, hlen);
+            n += hlen;
+            n += sprintf(out + n, "Content-length: %d\r\n\r\n", (int)(e - p));
+            memcpy(out + n, p, e - p);
+            *outlen = n + (e - p);
+        } else {
+            clienterror(r, r->filename, "502", "Bad Gateway", "The CGI program sent a malformed response");
+        }
+    }
+    Free(g->buf);
+    g->buf = NULL;
+    return out;
+}
+
+// 지금 환경에서 var("NAME=value")와 같은 이름을 빼고 var를 더한 envp (Free로 해제, 문자열은 복사하지 않음)
+char** make_envp(char* var) {
+    char** envp;
+    int n = 0, i, j = 0, nl = strcspn(var, "=") + 1;
+
+    while (environ[n]) n++;
+    envp = Malloc((n + 2) * sizeof(char*));
+    for (i = 0; i < n; i++) {
+        if (strncmp(environ[i], var, nl)) envp[j++] = environ[i];
+    }
+    envp[j++] = var;
+    envp[j] = NULL;
+    return envp;
+}
+
+// "prog" 또는 "prog:n" -> ./cgi-bin/prog를 n개의 상주 워커로 등록
+int fcgi_register(char* spec) {
+    fprog_t* p;
+    char* colon;
+    int i;
+
+    if (nfprogs == FCGI_MAX_PROGS) return -1;
+    p = &fprogs[nfprogs];
+    p->n = FCGI_DEF_PROCS;
+    if ((colon = strchr(spec, ':')) != NULL) {
+        p->n = atoi(colon + 1);
+        *colon = '\0';
+    }
+    if (p->n < 1 || p->n > FCGI_MAX_PROCS || !*spec) return -1;
+    snprintf(p->path, sizeof(p->path), "./cgi-bin/%s", spec);
+    for (i = 0; i < p->n; i++) {
+        p->fd[i] = -1;
+        p->idle[i] = i;
+    }
+    p->nidle = p->n;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    nfprogs++;
+    return 0;
+}
+
+static void fcgi_kill(fprog_t* p, int i) {
+    close(p->fd[i]);
+    kill(p->pid[i], SIGKILL);
+    waitpid(p->pid[i], NULL, 0); // 워커는 cgi_reaper가 거두지 않으니 여기서
+    p->fd[i] = -1;
+}
+
+// 슬롯 i에 워커를 띄우고 HELLO를 기다린다. fd 3에 socketpair 한쪽을 넘기고 번호는 환경변수로 알린다
+static int fcgi_spawn(fprog_t* p, int i) {
+    char var[] = CGIW_FD_ENV "=3", **envp, *argv[] = { p->path, NULL };
+    struct pollfd pfd;
+    uint32_t type;
+    int sv[2];
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) return -1;
+    envp = make_envp(var);
+    pthread_mutex_lock(&cgis.lock); // cgi_start가 만든 파이프가 close-on-exec가 되기 전에 fork하지 않게
+    pid = fork();
+    pthread_mutex_unlock(&cgis.lock);
+    if (pid == 0) {
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL); // 서버가 막아 둔 SIGCHLD를 워커에 물려주지 않는다
+        if (sv[1] == 3) fcntl(3, F_SETFD, 0); // dup2(3, 3)은 close-on-exec를 지우지 않는다
+        else dup2(sv[1], 3);
+        execve(p->path, argv, envp);
+        _exit(127);
+    }
+    Free(envp);
+    close(sv[1]);
+    p->fd[i] = sv[0];
+    p->pid[i] = pid;
+    if (pid < 0) {
+        close(sv[0]);
+        p->fd[i] = -1;
+        return -1;
+    }
+    pfd.fd = sv[0];
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, FCGI_HELLO_MS) != 1 || cgiw_recv(sv[0], &type, NULL, 0) != 0 || type != CGIW_HELLO) {
+        fprintf(stderr, "fcgi: %s did not say hello, using classic CGI for it\n", p->path);
+        fcgi_kill(p, i);
+        p->classic = 1;
+        return -1;
+    }
+    return 0;
+}
+
+void sink_put(sink_t* s, const void* p, size_t n) {
+    if (s->pre) {
+        char* pre = s->pre;
+        s->pre = NULL;
+        sink_put(s, pre, s->prelen);
+    }
+    if (n == 0) return;
+    if (s->fd >= 0) {
+        if (s->ok && rio_writen(s->fd, (void*)p, n) != n) s->ok = 0;
+    } else {
+        if (s->len + n > s->cap) {
+            s->cap = (s->len + n) * 2;
+            s->buf = Realloc(s->buf, s->cap);
+        }
+        memcpy(s->buf + s->len, p, n);
+    }
+    s->len += n;
+}
+
+/*
+ * filename이 상주 워커로 등록돼 있으면 워커에게 요청을 넘기고 STDOUT 프레임을 END까지 받아 s로 보낸다.
+ * 0: 처리함, -1: 워커가 없음/아무것도 못 받고 죽음 -> 호출한 쪽이 fork/exec로 처리
+ */
+int fcgi_run(char* filename, char* cgiargs, sink_t* s) {
+    fprog_t* p = NULL;
+    char req[MAXLINE + 16], buf[MAXBUF];
+    cgiw_hdr_t h;
+    int i, k, n, ret = -1;
+
+    for (k = 0; k < nfprogs; k++) {
+        if (!strcmp(fprogs[k].path, filename)) p = &fprogs[k];
+    }
+    if (!p || p->classic) return -1;
+
+    pthread_mutex_lock(&p->lock);
+    while (p->nidle == 0) pthread_cond_wait(&p->cond, &p->lock);
+    i = p->idle[--p->nidle];
+    pthread_mutex_unlock(&p->lock);
+
+    n = sprintf(req, "QUERY_STRING=%s", cgiargs) + 1; // "NAME=value\0"
+    // 쉬는 동안 워커가 죽었을 수 있으니 보내기에 실패하면 한 번 새로 띄워서 다시
+    for (k = 0; k < 2; k++) {
+        if (p->fd[i] < 0 && fcgi_spawn(p, i) < 0) goto done;
+        if (cgiw_send(p->fd[i], CGIW_REQUEST, req, n) == 0) break;
+        fcgi_kill(p, i);
+    }
+    if (k == 2) goto done;
+
+    while (1) {
+        if (cgiw_io(p->fd[i], &h, sizeof(h), 0) < 0 || (h.type != CGIW_STDOUT && h.type != CGIW_END)) {
+            // 응답 도중 워커가 죽었다: 아직 아무것도 안 보냈으면 fork/exec로 다시, 보냈으면 여기서 끝
+            fcgi_kill(p, i);
+            ret = s->len ? 0 : -1;
+            break;
+        }
+        if (h.type == CGIW_END) {
+            ret = 0;
+            break;
+        }
+        // 프레임 본문은 MAXBUF씩 옮긴다. 클라이언트가 끊어도 프레임은 끝까지 읽어야 다음 요청과 어긋나지 않는다
+        while (h.len > 0) {
+            k = h.len < sizeof(buf) ? h.len : sizeof(buf);
+            if (cgiw_io(p->fd[i], buf, k, 0) < 0) break;
+            sink_put(s, buf, k);
+            h.len -= k;
+        }
+    }
+
+done:
+    pthread_mutex_lock(&p->lock);
+    p->idle[p->nidle++] = i;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+static void plug_put(plug_t* pl) {
+    if (atomic_fetch_sub(&pl->refs, 1) == 1) {
+        dlclose(pl->dl);
+        Free(pl);
+    }
+}
+
+// slot의 .so가 마지막으로 본 것과 다르면 다시 읽는다 (plugins.lock 잡은 상태에서). 없어졌으면 내린다
+static void plugin_load(int i) {
+    char* path = plugins.slot[i].path, tmp[] = "/tmp/tiny-plugin-XXXXXX";
+    struct stat st, *old = &plugins.slot[i].st;
+    const tiny_plugin_t* tp;
+    plug_t* pl;
+    void* dl;
+    int in, out;
+
+    if (stat(path, &st) < 0) memset(&st, 0, sizeof(st));
+    if (st.st_ino == old->st_ino && st.st_size == old->st_size &&
+        st.st_mtim.tv_sec == old->st_mtim.tv_sec && st.st_mtim.tv_nsec == old->st_mtim.tv_nsec) {
+        return; // 그대로 (못 읽었던 .so도 바뀔 때까지 다시 시도하지 않는다)
+    }
+    *old = st;
+    if (plugins.slot[i].cur) {
+        plug_put(plugins.slot[i].cur);
+        plugins.slot[i].cur = NULL;
+    }
+    if (!st.st_ino) return;
+
+    if (plugins.mode == PLUGIN_RELOAD) {
+        if ((in = open(path, O_RDONLY | O_CLOEXEC)) < 0) return;
+        if ((out = mkostemp(tmp, O_CLOEXEC)) < 0) { // 동시에 띄우는 CGI에 새지 않게
+            close(in);
+            return;
+        }
+        off_t off = 0;
+        while (off < st.st_size && sendfile(out, in, &off, st.st_size - off) > 0)
+            ;
+        close(in);
+        close(out);
+        dl = off == st.st_size ? dlopen(tmp, RTLD_NOW | RTLD_LOCAL) : NULL;
+        unlink(tmp); // 매핑된 뒤에는 파일이 없어도 된다
+    } else {
+        dl = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    }
+    if (!dl) {
+        fprintf(stderr, "plugin: %s: %s\n", path, dlerror());
+        return;
+    }
+    tp = dlsym(dl, "tiny_plugin");
+    if (!tp || tp->abi != TINY_PLUGIN_ABI || !tp->handle) {
+        fprintf(stderr, "plugin: %s: no tiny_plugin with ABI %d\n", path, TINY_PLUGIN_ABI);
+        dlclose(dl);
+        return;
+    }
+    pl = Malloc(sizeof(plug_t));
+    pl->dl = dl;
+    pl->tp = tp;
+    atomic_init(&pl->refs, 1);
+    plugins.slot[i].cur = pl;
+}
+
+// filename("./cgi-bin/adder")의 플러그인을 찾아 참조를 올려서 돌려준다, 없으면 NULL
+static plug_t* plugin_get(char* filename) {
+    char path[MAXLINE];
+    plug_t* pl;
+    int i;
+
+    snprintf(path, sizeof(path), "%s.so", filename);
+    pthread_mutex_lock(&plugins.lock);
+    for (i = 0; i < plugins.n && strcmp(plugins.slot[i].path, path); i++)
+        ;
+    if (i == plugins.n) { // 처음 보는 프로그램
+        if (i == PLUGIN_MAX) {
+            pthread_mutex_unlock(&plugins.lock);
+            return NULL;
+        }
+        strcpy(plugins.slot[i].path, path);
+        plugins.n++;
+        plugin_load(i);
+    } else if (plugins.mode == PLUGIN_RELOAD) {
+        plugin_load(i);
+    }
+    if ((pl = plugins.slot[i].cur) != NULL) atomic_fetch_add(&pl->refs, 1);
+    pthread_mutex_unlock(&plugins.lock);
+    return pl;
+}
+
+// %XX와 '+'를 풀어서 제자리에 쓴다
+static void url_decode(char* p) {
+    char* q = p;
+    unsigned int c;
+
+    for (; *p; p++) {
+        if (*p == '+') {
+            *q++ = ' ';
+        } else if (*p == '%' && isxdigit((unsigned char)p[1]) && isxdigit((unsigned char)p[2]) &&
+                   sscanf(p + 1, "%2x", &c) == 1) {
+            *q++ = c;
+            p += 2;
+        } else {
+            *q++ = *p;
+        }
+    }
+    *q = '\0';
+}
+
+static int plugin_write(tp_writer_t* w, const void* buf, size_t len) {
+    sink_t* s = w->ctx;
+
+    sink_put(s, buf, len);
+    return s->ok ? 0 : -1;
+}
+
+// 플러그인이 있으면 쿼리를 인자로 나눠 핸들러를 부르고 출력을 s로. 0: 처리함, -1: 플러그인 없음
+int plugin_run(char* filename, char* cgiargs, sink_t* s) {
+    char qs[MAXLINE], *p, *next, *eq;
+    tp_request_t req;
+    tp_writer_t w = { plugin_write, s };
+    plug_t* pl;
+
+    if (plugins.mode == PLUGIN_OFF || (pl = plugin_get(filename)) == NULL) return -1;
+    req.query = cgiargs;
+    req.nargs = 0;
+    snprintf(qs, sizeof(qs), "%s", cgiargs);
+    for (p = qs; *p && req.nargs < TP_MAX_ARGS; p = next) {
+        next = p + strcspn(p, "&");
+        if (*next) *next++ = '\0';
+        eq = p + strcspn(p, "=");
+        if (*eq) *eq++ = '\0';
+        url_decode(p);
+        url_decode(eq);
+        req.args[req.nargs].name = p;
+        req.args[req.nargs].value = eq;
+        req.nargs++;
+    }
+    pl->tp->handle(&req, &w);
+    plug_put(pl);
+    return 0;
+}
+
+static econn_t *ecgi_head, *edead; // CGI 실행 중인 연결, 해제 대기 연결
+static econn_t *eread_head, *eread_tail; // 요청을 읽는 중인 연결
+
+// 요청 읽기 마감 목록에서 뺀다 (다 읽었거나 닫을 때, 이미 빠져 있으면 아무것도 안 함)
+static void eread_unlink(econn_t* c) {
+    if (!c->rdeadline) return;
+    if (c->rprev) c->rprev->rnext = c->rnext; else eread_head = c->rnext;
+    if (c->rnext) c->rnext->rprev = c->rprev; else eread_tail = c->rprev;
+    c->rprev = c->rnext = NULL;
+    c->rdeadline = 0;
+}
+
+// 읽을 수 있을 때: 빈 줄까지 모이면 doit과 같은 plan_reply로 응답을 정하고 쓰기로 넘어간다
+// 반환값이 0이 아니면 연결을 닫는다
+static int econn_write(int epfd, econn_t* c);
+static int econn_read(int epfd, econn_t* c) {
+    char method[MAXLINE], uri[MAXLINE], version[MAXLINE], ims[MAXLINE] = "", *line;
+    ssize_t n;
+
+    while (!strstr(c->in, "\r\n\r\n") && c->inlen < (int)sizeof(c->in) - 1) {
+        n = read(c->fd, c->in + c->inlen, sizeof(c->in) - 1 - c->inlen);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) return 0; // 나머지는 다음 이벤트에서 (느린 클라이언트가 루프를 막지 않는다)
+        if (n <= 0) return 1;                   // 요청을 다 보내기 전에 끊김
+        c->inlen += n;
+        c->in[c->inlen] = '\0';
+    }
+    eread_unlink(c);
+    printf("Request headers:\n");
+    printf("%s", c->in);
+    if (sscanf(c->in, "%s %s %s", method, uri, version) < 2) return 1;
+    for (line = strstr(c->in, "\r\n"); line; line = strstr(line, "\r\n")) {
+        line += 2;
+        match_ims(line, ims);
+    }
+
+    plan_reply(method, uri, ims, &c->r);
+    c->out = c->r.fe ? c->r.fe->resp : c->r.head;
+    c->outlen = c->r.fe ? c->r.fe->len : c->r.cgi ? 0 : c->r.hlen; // CGI는 상태줄을 결과를 보고 보낸다
+    struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = &c->ch };
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    return econn_write(epfd, c); // 보통은 바로 다 써진다
+}
+
+// 쓸 수 있을 때: 헤더(또는 캐시 응답) -> 정적 파일 본문(sendfile) -> CGI 시작 순서로 진행
+// epoll 모드는 -s mmap이어도 sendfile을 쓴다 (논블로킹 소켓에서 남은 위치를 off로 이어가기 쉬움)
+static int econn_write(int epfd, econn_t* c) {
+    ssize_t n;
+
+    while (c->outoff < c->outlen) {
+        n = write(c->fd, c->out + c->outoff, c->outlen - c->outoff);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) return 0;
+        if (n <= 0) return 1;
+        c->outoff += n;
+    }
+    while (c->r.srcfd >= 0 && c->off < c->r.size) {
+        n = sendfile(c->fd, c->r.srcfd, &c->off, c->r.size - c->off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) return 0;
+        if (n <= 0) return 1;
+    }
+    if (c->r.cgi) {
+        sink_t s = { .fd = -1, .ok = 1, .pre = c->r.head, .prelen = c->r.hlen };
+        struct epoll_event ev;
+
+        c->r.cgi = 0;
+        // 플러그인/상주 워커가 있으면 출력을 다 받아 두었다가 논블로킹으로 이어서 보낸다
+        // (핸들러가 도는 동안은 블로킹이라 그 계산 시간만큼 루프가 멈춘다, adder처럼 짧은 핸들러용)
+        if (plugin_run(c->r.filename, c->r.cgiargs, &s) == 0 || fcgi_run(c->r.filename, c->r.cgiargs, &s) == 0) {
+            sink_put(&s, NULL, 0);
+            c->out = c->obuf = s.buf;
+            c->outlen = s.len;
+            c->outoff = 0;
+            return econn_write(epfd, c);
+        }
+        if (cgi_start(&c->g, c->r.filename, c->r.cgiargs) < 0) {
+            clienterror(&c->r, c->r.filename, "502", "Bad Gateway", "Tiny couldn't run the CGI program");
+            c->outlen = c->r.hlen;
+            return econn_write(epfd, c);
+        }
+        // CGI 파이프를 걸고, 끝날 때까지 클라이언트 쪽은 에러/끊김만 받는다
+        ev.events = EPOLLIN;
+        ev.data.ptr = &c->ph;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, c->g.rfd, &ev);
+        ev.events = 0;
+        ev.data.ptr = &c->ch;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->cprev = NULL;
+        c->cnext = ecgi_head;
+        if (ecgi_head) ecgi_head->cprev = c;
+        ecgi_head = c;
+        return 0;
+    }
+    return 1; // 다 보냈다 (HTTP/1.0, 요청 하나에 연결 하나)
+}
+
+static void ecgi_unlink(int epfd, econn_t* c) {
+    if (c->cprev) c->cprev->cnext = c->cnext; else ecgi_head = c->cnext;
+    if (c->cnext) c->cnext->cprev = c->cprev;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->g.rfd, NULL);
+}
+
+// CGI 파이프에서 읽을 수 있을 때, 또는 시간이 다 됐을 때(expired): 끝났으면 응답을 만들어 쓰기로 넘어간다
+static int econn_cgi(int epfd, econn_t* c, int expired) {
+    int st = expired ? CGI_MORE : cgi_read(&c->g);
+    struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = &c->ch };
+
+    if (st == CGI_MORE && !expired) return 0;
+    ecgi_unlink(epfd, c);
+    if ((c->obuf = cgi_done(&c->g, st, &c->r, &c->outlen)) != NULL) {
+        c->out = c->obuf;
+    } else {
+        c->out = c->r.head;
+        c->outlen = c->r.hlen;
+    }
+    c->outoff = 0;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    return econn_write(epfd, c);
+}
+
+// 바로 해제하지 않는다: 같은 epoll_wait 결과에 이 연결의 다른 fd(CGI 파이프) 이벤트가 남아 있을 수 있다
+static void econn_close(int epfd, econn_t* c) {
+    if (c->g.pid) {
+        ecgi_unlink(epfd, c);
+        cgi_done(&c->g, CGI_MORE, &c->r, &c->outlen); // 클라이언트가 먼저 끊음: 자식을 죽이고 정리
+    }
+    eread_unlink(c);
+    if (c->r.fe) fcache_put(c->r.fe);
+    if (c->r.srcfd >= 0) close(c->r.srcfd);
+    if (c->obuf) Free(c->obuf);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->dead = 1;
+    c->cnext = edead;
+    edead = c;
+}
+
+// epoll 모드 (-m epoll): 스레드 하나가 모든 연결을 논블로킹으로 다룬다. 레벨 트리거, 리스닝 소켓은 data.ptr == NULL
+void epoll_loop(int listenfd) {
+    struct epoll_event ev, events[EPOLL_MAX_EVENTS];
+    int epfd, n, i, fd, timeout;
+    econn_t *c, *next;
+    ehandle_t* h;
+    long now, resume = 0;
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) unix_error("epoll_create1 error");
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0) unix_error("epoll_ctl error");
+
+    while (1) {
+        // 가장 먼저 끝나야 하는 CGI, 요청 읽기 마감, 리스너 복귀까지만 기다린다
+        timeout = -1;
+        now = now_ms();
+        if (resume && resume <= now) {
+            ev.events = EPOLLIN;
+            ev.data.ptr = NULL;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev);
+            resume = 0;
+        }
+        for (c = ecgi_head; c; c = c->cnext) {
+            long left = c->g.deadline > now ? c->g.deadline - now : 0;
+            if (timeout < 0 || left < timeout) timeout = left;
+        }
+        if (eread_head) {
+            long left = eread_head->rdeadline > now ? eread_head->rdeadline - now : 0;
+            if (timeout < 0 || left < timeout) timeout = left;
+        }
+        if (resume && (timeout < 0 || resume - now < timeout)) timeout = resume - now;
+        n = epoll_wait(epfd, events, EPOLL_MAX_EVENTS, timeout);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) unix_error("epoll_wait error");
+        for (i = 0; i < n; i++) {
+            if (!(h = events[i].data.ptr)) {
+                // 밀린 연결을 한 번에 받는다
+                while ((fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    c = Calloc(1, sizeof(econn_t));
+                    c->fd = fd;
+                    c->r.srcfd = -1;
+                    c->ch.kind = EH_CLIENT;
+                    c->ch.c = c;
+                    c->ph.kind = EH_CGI;
+                    c->ph.c = c;
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = &c->ch;
+                    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                        econn_close(epfd, c);
+                        continue;
+                    }
+                    c->rdeadline = now_ms() + EPOLL_READ_MS;
+                    c->rprev = eread_tail;
+                    if (eread_tail) eread_tail->rnext = c; else eread_head = c;
+                    eread_tail = c;
+                }
+                // fd가 바닥나면 밀린 연결이 그대로 남아 레벨 트리거 리스너가 계속 깨운다 (CPU 100%)
+                // -> 잠깐 리스너를 빼 두고 다시 건다, 그동안 연결은 커널 backlog에서 기다린다
+                if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, listenfd, NULL);
+                    resume = now_ms() + EPOLL_BACKOFF_MS;
+                }
+                continue;
+            }
+            c = h->c;
+            if (c->dead) continue;
+            if (h->kind == EH_CGI) {
+                if (econn_cgi(epfd, c, 0)) econn_close(epfd, c);
+            } else if (c->g.pid) {
+                econn_close(epfd, c); // CGI 실행 중에 클라이언트 쪽 에러/끊김
+            } else if (c->out ? econn_write(epfd, c) : econn_read(epfd, c)) {
+                econn_close(epfd, c);
+            }
+        }
+        // 시간이 다 된 CGI: 죽이고 504
+        now = now_ms();
+        for (c = ecgi_head; c; c = next) {
+            next = c->cnext;
+            if (c->g.deadline <= now && econn_cgi(epfd, c, 1)) econn_close(epfd, c);
+        }
+        // 요청을 마감까지 다 보내지 않은 연결: 그냥 닫는다 (econn_close가 목록에서 뺀다)
+        while (eread_head && eread_head->rdeadline <= now) econn_close(epfd, eread_head);
+        while ((c = edead) != NULL) {
+            edead = c->cnext;
+            Free(c);
+        }
     }
-    Wait(NULL); // 부모가 죽기전에 자식을 죽여
 }
 
 // int main(int argc, char **argv)
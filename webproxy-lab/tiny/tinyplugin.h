@@ -0,0 +1,40 @@
+/*
+ * tinyplugin.h - tiny의 in-process 동적 핸들러 ABI (tiny -L on|reload)
+ *
+ * cgi-bin/prog.so가 있으면 /cgi-bin/prog 요청을 fork/exec 없이 tiny 안에서 그 .so의 함수로 처리한다.
+ * .so는 tiny_plugin이라는 이름으로 tiny_plugin_t 하나를 내보낸다.
+ * 핸들러는 CGI가 stdout에 쓰던 것과 같은 내용(상태줄 다음의 헤더들 + 빈 줄 + 본문)을 w->write로 쓴다.
+ * 상태줄과 Server 헤더는 tiny가 먼저 보낸다.
+ * thread/pool 모드에서는 여러 스레드가 동시에 부르므로 핸들러는 전역 상태 없이 재진입 가능해야 한다.
+ */
+#ifndef __TINYPLUGIN_H__
+#define __TINYPLUGIN_H__
+
+#include <stddef.h>
+
+#define TINY_PLUGIN_ABI 1
+#define TP_MAX_ARGS     32
+
+// 쿼리 인자 하나 (URL 디코딩됨), "a=1&b" -> {"a", "1"}, {"b", ""}
+typedef struct {
+    char* name;
+    char* value;
+} tp_arg_t;
+
+typedef struct {
+    const char* query;              // 원래 QUERY_STRING (디코딩 전)
+    int nargs;
+    tp_arg_t args[TP_MAX_ARGS];
+} tp_request_t;
+
+typedef struct tp_writer {
+    int (*write)(struct tp_writer* w, const void* buf, size_t len); // 0: 성공, -1: 클라이언트가 끊음
+    void* ctx;                      // tiny 내부용
+} tp_writer_t;
+
+typedef struct {
+    int abi;                        // TINY_PLUGIN_ABI
+    int (*handle)(const tp_request_t* req, tp_writer_t* w);
+} tiny_plugin_t;
+
+#endif /* __TINYPLUGIN_H__ */